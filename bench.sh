@@ -0,0 +1,47 @@
+#!/bin/sh
+# Chạy nothingbench với từng biến thể WM trên một Xvfb riêng để so sánh trực tiếp.
+#
+#   ./bench.sh                        # tất cả các WM
+#   ./bench.sh fun.cpp nothing.cpp    # chỉ một số WM
+#   BENCH_ARGS="--windows 500 --rate 200" ./bench.sh
+
+set -e
+cd "$(dirname "$0")"
+
+BENCH_DISPLAY=${BENCH_DISPLAY:-:99}
+OUT=${OUT:-/tmp/wmbench}
+mkdir -p "$OUT"
+
+if [ $# -eq 0 ]; then
+    set -- anotherwm-btw.cpp anotherwm.cpp benswm.cpp buddyigotonechin.cpp fun.cpp \
+           mywindowmanager.cpp nothing.cpp wm.cpp wmagain.cpp yourmom.cpp
+fi
+
+g++ -O2 nothingbench.cpp -o "$OUT/nothingbench" -lX11
+
+for src in "$@"; do
+    name=$(basename "$src" .cpp)
+    case "$name" in
+        nothing) flags="-pthread -rdynamic"; libs="-lX11-xcb -lxcb -lXext -lXcomposite -lXfixes -lXrender" ;;
+        *) flags=""; libs="" ;;
+    esac
+    # Không có libXdamage-dev thì nothing.cpp vẫn build được, chỉ thiếu --thumbnails và --composite
+    if [ "$name" = nothing ] && echo '#include <X11/extensions/Xdamage.h>' | g++ -E -x c++ - >/dev/null 2>&1; then
+        libs="$libs -lXdamage"
+    fi
+    g++ -O2 $flags "$src" -o "$OUT/$name" -lX11 $libs
+
+    Xvfb "$BENCH_DISPLAY" -screen 0 1920x1080x24 -nolisten tcp >/dev/null 2>&1 &
+    xvfb_pid=$!
+    sleep 1
+    DISPLAY=$BENCH_DISPLAY "$OUT/$name" >/dev/null 2>&1 &
+    wm_pid=$!
+    sleep 0.5
+
+    echo "== $name"
+    DISPLAY=$BENCH_DISPLAY "$OUT/nothingbench" $BENCH_ARGS || true
+
+    kill $wm_pid 2>/dev/null || true
+    kill $xvfb_pid 2>/dev/null || true
+    wait 2>/dev/null || true
+done
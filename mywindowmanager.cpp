@@ -7,10 +7,62 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <cstring>
+#include <unordered_map>
 
 Atom WM_PROTOCOLS;
 Atom WM_DELETE_WINDOW;
 
+// Bộ đệm thuộc tính của từng cửa sổ: mỗi thuộc tính chỉ được hỏi X server một lần,
+// và chỉ hỏi lại sau khi có PropertyNotify báo thuộc tính đó đã thay đổi
+struct WindowInfo {
+    bool name_valid = false;
+    std::string name;
+    bool protocols_valid = false;
+    bool has_protocols = false;
+    std::vector<Atom> protocols;
+};
+std::unordered_map<Window, WindowInfo> window_info;
+
+// Cửa sổ có từ trước khi WM chạy chưa có trong bộ đệm: đăng ký PropertyChangeMask để bộ đệm không bị cũ
+WindowInfo& info_for(Display* display, Window window) {
+    auto it = window_info.find(window);
+    if (it == window_info.end()) {
+        XSelectInput(display, window, PropertyChangeMask);
+        it = window_info.emplace(window, WindowInfo()).first;
+    }
+    return it->second;
+}
+
+const std::string& window_name(Display* display, Window window) {
+    WindowInfo& info = info_for(display, window);
+    if (!info.name_valid) {
+        info.name.clear();
+        XTextProperty window_name;
+        if (XGetWMName(display, window, &window_name)) {
+            if (window_name.value != nullptr) info.name = (char*)window_name.value;
+            XFree(window_name.value);
+        }
+        info.name_valid = true;
+    }
+    return info.name;
+}
+
+const WindowInfo& window_protocols(Display* display, Window window) {
+    WindowInfo& info = info_for(display, window);
+    if (!info.protocols_valid) {
+        Atom* protocols = nullptr;
+        int count;
+        info.has_protocols = XGetWMProtocols(display, window, &protocols, &count);
+        info.protocols.clear();
+        if (info.has_protocols) {
+            info.protocols.assign(protocols, protocols + count);
+            XFree(protocols);
+        }
+        info.protocols_valid = true;
+    }
+    return info;
+}
+
 int x_error_handler(Display* display, XErrorEvent* error) {
     char error_text[1024];
     XGetErrorText(display, error->error_code, error_text, sizeof(error_text));
@@ -38,17 +90,15 @@ void execute_command(const std::vector<std::string>& command_args) {
 }
 
 void close_window(Display* display, Window window) {
-    Atom* protocols = nullptr;
-    int count;
-    if (XGetWMProtocols(display, window, &protocols, &count)) {
+    const WindowInfo& info = window_protocols(display, window);
+    if (info.has_protocols) {
         bool delete_supported = false;
-        for (int i = 0; i < count; ++i) {
-            if (protocols[i] == WM_DELETE_WINDOW) {
+        for (Atom protocol : info.protocols) {
+            if (protocol == WM_DELETE_WINDOW) {
                 delete_supported = true;
                 break;
             }
         }
-        XFree(protocols);
         
         if (delete_supported) {
             XClientMessageEvent cm;
@@ -135,19 +185,18 @@ int main() {
         switch (event.type) {
             case CreateNotify:
                 std::cout << "CreateNotify event: New window created, ID: " << event.xcreatewindow.window << std::endl;
-                
-                XTextProperty window_name;
-                if (XGetWMName(display, event.xcreatewindow.window, &window_name)) {
-                    std::cout << "  Window name: " << (char*)window_name.value << std::endl;
-                    XFree(window_name.value);
-                }
-                
-                XSelectInput(display, event.xcreatewindow.window, StructureNotifyMask | ExposureMask | KeyPressMask | ButtonPressMask);
+
+                // Tên cửa sổ không được hỏi ở đây nữa (lúc vừa tạo thường chưa có), mà lấy lúc map rồi giữ trong bộ đệm
+                window_info[event.xcreatewindow.window] = WindowInfo();
+                XSelectInput(display, event.xcreatewindow.window, StructureNotifyMask | ExposureMask | KeyPressMask | ButtonPressMask | PropertyChangeMask);
                 XMapWindow(display, event.xcreatewindow.window);
                 break;
 
             case MapRequest:
                 std::cout << "MapRequest event: Application requests window display ID: " << event.xmaprequest.window << std::endl;
+                if (!window_name(display, event.xmaprequest.window).empty()) {
+                    std::cout << "  Window name: " << window_name(display, event.xmaprequest.window) << std::endl;
+                }
                 XMapWindow(display, event.xmaprequest.window);
                 break;
 
@@ -167,7 +216,17 @@ int main() {
 
             case DestroyNotify:
                 std::cout << "DestroyNotify event: Window destroyed, ID: " << event.xdestroywindow.window << std::endl;
+                window_info.erase(event.xdestroywindow.window);
                 break;
+
+            case PropertyNotify: {
+                auto it = window_info.find(event.xproperty.window);
+                if (it != window_info.end()) {
+                    if (event.xproperty.atom == XA_WM_NAME) it->second.name_valid = false;
+                    if (event.xproperty.atom == WM_PROTOCOLS) it->second.protocols_valid = false;
+                }
+                break;
+            }
             
             case KeyPress:
                 if (event.xkey.keycode == key_a_keycode && (event.xkey.state & Mod4Mask)) {
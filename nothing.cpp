@@ -1,6 +1,40 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
+#include <X11/Xlib-xcb.h>
+#include <X11/extensions/sync.h>
+#include <X11/extensions/Xcomposite.h>
+#if __has_include(<X11/extensions/Xdamage.h>)
+#include <X11/extensions/Xdamage.h>
+#define HAVE_XDAMAGE 1
+#else
+// Build không có libXdamage-dev: --thumbnails và --composite tự tắt lúc chạy. Mock vẫn cần các hằng số
+// và sự kiện DamageNotify (theo damagewire.h) để kiểm tra hai đường này.
+#define HAVE_XDAMAGE 0
+#define XDamageNotify 0
+#define XDamageReportBoundingBox 2
+#define XDamageReportNonEmpty 3
+typedef XID Damage;
+typedef struct {
+    int type;
+    unsigned long serial;
+    Bool send_event;
+    Display* display;
+    Drawable drawable;
+    Damage damage;
+    int level;
+    Bool more;
+    Time timestamp;
+    XRectangle area;
+    XRectangle geometry;
+} XDamageNotifyEvent;
+#endif
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xrender.h>
+#include <X11/extensions/Xfixes.h>
+#include <X11/extensions/shape.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -8,160 +42,4537 @@
 #include <sys/wait.h>
 #include <cstring>
 #include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+#include <sstream>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <fcntl.h>
+#include <unordered_map>
+#include <new>
+#include <ctime>
+#include <csignal>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <pthread.h>
+#include <execinfo.h>
+#include <random>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "wmstate.h"
+#include "wmtrace.h"
+
+// Các biến toàn cục
+Atom WM_PROTOCOLS;
+Atom WM_DELETE_WINDOW;
+Atom NET_WM_NAME;
+Atom UTF8_STRING;
+Atom COMPOUND_TEXT;
+Atom NET_WM_WINDOW_TYPE;
+Atom NET_WM_WINDOW_TYPE_DIALOG;
+Atom NET_WM_WINDOW_TYPE_SPLASH;
+Atom NET_WM_SYNC_REQUEST;
+Atom NET_WM_SYNC_REQUEST_COUNTER;
+Atom NET_WM_WINDOW_OPACITY;
+Atom NET_WM_STATE;
+Atom NET_WM_STATE_FULLSCREEN;
+Atom NET_SUPPORTED;
+// Các biến để quản lý việc di chuyển cửa sổ
+bool is_moving = false;
+int start_x, start_y;
+int start_win_x, start_win_y;
+Window current_moving_window = None;
+bool drag_moved = false; // Chuột đã thật sự di chuyển kể từ ButtonPress (không chỉ là một cú click)
+
+// Bắt dính khi kéo: mép màn hình, mép dưới thanh taskbar và mép của các cửa sổ khác, mỗi trục một mảng
+// đã sắp xếp để mỗi MotionNotify chỉ tốn một lần tìm nhị phân. Mảng chỉ dựng lại khi có cửa sổ đổi chỗ.
+const int snap_threshold = 12; // Khoảng cách tối đa (pixel) để mép cửa sổ dính vào một mép khác
+std::vector<int> snap_edges_x, snap_edges_y;
+bool snap_edges_dirty = true;
+
+// Thay đổi kích thước bằng Super + chuột phải. Mỗi lúc chỉ có nhiều nhất một kích thước đang chờ client vẽ:
+// client hỗ trợ _NET_WM_SYNC_REQUEST báo vẽ xong qua counter XSync, client khác bị giới hạn tần suất.
+// Các vị trí chuột tới trong lúc chờ chỉ ghi đè kích thước mới nhất, không xếp hàng.
+bool is_resizing = false;
+Window current_resizing_window = None;
+int start_win_width, start_win_height;
+int resize_width, resize_height;           // Kích thước mới nhất theo chuột
+int resize_sent_width, resize_sent_height; // Kích thước đã gửi cho client gần nhất
+bool resize_sync = false;                  // Client có counter _NET_WM_SYNC_REQUEST
+bool sync_waiting = false;                 // Đang chờ client vẽ xong kích thước đã gửi
+uint64_t resize_sent_ns = 0;
+uint64_t sync_serial = 0;                  // Giá trị counter mà client phải đạt sau khi vẽ xong
+XID resize_alarm = None;
+int sync_event_base = 0;                   // 0 = X server không có extension SYNC
+const uint64_t resize_interval_ns = 16 * 1000000ull; // ~60 lần/giây với client không hỗ trợ sync
+const uint64_t sync_timeout_ns = 200 * 1000000ull;   // Client không trả lời sync lâu hơn thì gửi tiếp
+
+// Chế độ khung (--outline): khi kéo hoặc thay đổi kích thước chỉ vẽ một khung XOR trên root (hoặc trong
+// compositor), cửa sổ chỉ nhận một MoveResize duy nhất lúc thả chuột, nên chi phí không phụ thuộc vào client
+bool outline_mode = false;
+bool outline_shown = false;
+bool outline_composited = false; // Khung đang hiện do compositor vẽ chứ không phải XOR trên root
+int outline_x, outline_y, outline_width, outline_height; // Khung đang vẽ, kể cả viền
+const int outline_line_width = 2;
+
+// Các biến để quản lý layout và cửa sổ
+std::vector<Window> managed_windows;
+std::vector<Window> floating_windows; // Lớp nổi (dialog, transient), thứ tự xếp chồng từ dưới lên
+enum Layout { LAYOUT_TILE, LAYOUT_MONOCLE };
+Layout current_layout = LAYOUT_TILE;
+const float master_ratio = 0.6; // Cửa sổ chính chiếm 60% màn hình
+const int border_width = 2; // Chiều rộng viền cửa sổ
+const int statusbar_height = 20; // Chiều cao của thanh taskbar
+unsigned long focused_border_color;
+unsigned long unfocused_border_color;
+Window focused_window = None;
+Window statusbar_window = None;
+// Cửa sổ fullscreen (_NET_WM_STATE_FULLSCREEN): không viền, phủ cả màn hình, nằm trên thanh taskbar.
+// Trong lúc có nó, tile_windows không sắp xếp các cửa sổ tiling bị che mà chỉ ghi nhớ để làm khi thoát.
+Window fullscreen_window = None;
+bool relayout_pending = false;
+// Cửa sổ tiling mà raise_client đưa lên sau cùng: trong monocle đây là cửa sổ tiling duy nhất thấy được
+Window top_tiled_window = None;
+std::string status_text; // Nội dung _NET_WM_NAME của cửa sổ gốc, hiển thị trên thanh taskbar
+int screen_width = 0;  // Kích thước cửa sổ gốc, lấy một lần lúc khởi động
+int screen_height = 0;
+
+// Keycode của các phím tắt, được gán lúc khởi động
+KeyCode key_enter_keycode = 0;
+KeyCode key_d_keycode = 0;
+KeyCode key_e_keycode = 0;
+KeyCode key_q_keycode = 0;
+KeyCode key_m_keycode = 0;
+KeyCode key_space_keycode = 0;
+KeyCode key_h_keycode = 0;
+KeyCode key_j_keycode = 0;
+KeyCode key_k_keycode = 0;
+KeyCode key_l_keycode = 0;
+KeyCode key_tab_keycode = 0;
+KeyCode key_alt_l_keycode = 0;
+KeyCode key_alt_r_keycode = 0;
+
+// Ràng buộc kích thước từ WM_NORMAL_HINTS (ICCCM 4.1.2.3), chỉ phân tích lại khi thuộc tính thay đổi
+struct SizeHints {
+    int base_width = 0, base_height = 0;
+    int min_width = 0, min_height = 0;
+    int max_width = 0, max_height = 0;    // 0 = không giới hạn
+    int inc_width = 0, inc_height = 0;
+    float min_aspect = 0, max_aspect = 0; // Tỉ lệ width / height, 0 = không giới hạn
+};
+
+// Thông tin của từng cửa sổ được quản lý (vị trí do tile_windows gán, tiêu đề, thuộc tính ICCCM/EWMH)
+struct Client {
+    int x = 0, y = 0;
+    int width = 0, height = 0;
+    std::string title;
+    std::string wm_name, net_wm_name;
+    std::string wm_class;               // "instance\0class\0" như trong thuộc tính WM_CLASS
+    Window transient_for = None;
+    std::vector<Atom> window_type;      // _NET_WM_WINDOW_TYPE
+    std::vector<Atom> protocols;        // WM_PROTOCOLS
+    std::vector<uint32_t> wm_hints;     // Nội dung thô của WM_HINTS (9 giá trị 32-bit)
+    SizeHints size_hints;               // Từ WM_NORMAL_HINTS
+    bool floating = false;              // Nằm trong lớp nổi, không được tile_windows sắp xếp
+    XID sync_counter = None;            // _NET_WM_SYNC_REQUEST_COUNTER
+    int grid_col0 = 0, grid_row0 = 0, grid_col1 = -1, grid_row1 = -1; // Các ô của chỉ mục không gian đang chứa cửa sổ
+    Window window = None;               // Cửa sổ của client này, để đi từ danh sách MRU về cửa sổ
+    Client* mru_prev = nullptr;         // Liên kết trong lịch sử focus (xem mru_push_front)
+    Client* mru_next = nullptr;
+    bool in_mru = false;
+    XID damage = None;                  // Đối tượng XDamage theo dõi nội dung cửa sổ (--thumbnails)
+    std::vector<uint32_t> thumbnail;    // Ảnh thu nhỏ, mỗi pixel 32-bit như trong ZPixmap của X server
+    int thumbnail_width = 0, thumbnail_height = 0;
+    bool thumbnail_stale = true;        // Cửa sổ đã vẽ lại (DamageNotify) từ lần chụp trước
+    uint32_t opacity = 0xffffffff;      // _NET_WM_WINDOW_OPACITY, chỉ có tác dụng với --composite
+    std::vector<Atom> net_wm_state;     // _NET_WM_STATE, client tự đặt trước khi map, sau đó do WM ghi
+    bool fullscreen = false;
+    int saved_x = 0, saved_y = 0, saved_width = 0, saved_height = 0; // Vị trí trước khi fullscreen (cửa sổ nổi)
+};
+std::unordered_map<Window, Client> clients; // Phần tử của unordered_map không bị dời chỗ, nên Client* luôn hợp lệ tới khi bị xóa
+
+// Lịch sử focus (MRU): danh sách liên kết đôi đi xuyên qua chính các Client, cửa sổ được focus gần nhất
+// nằm ở đầu. Đưa lên đầu và gỡ ra đều là O(1), không cấp phát gì thêm.
+Client* mru_head = nullptr;
+Client* mru_tail = nullptr;
+
+// Alt+Tab: duyệt lịch sử focus mà không đổi focus hay thứ tự xếp chồng, chỉ tô viền cửa sổ đang chọn;
+// focus và raise chỉ được gửi một lần khi nhả Alt
+bool switching = false;
+Client* switch_target = nullptr;
+
+// Ảnh thu nhỏ trong Alt+Tab (--thumbnails): nội dung cửa sổ được chụp qua XComposite + MIT-SHM, thu nhỏ
+// bằng bộ lọc hộp (SSE2/AVX2) và giữ lại tới khi XDamage báo cửa sổ đã vẽ lại
+bool thumbnails_enabled = false;
+int damage_event_base = 0; // 0 = X server không có extension DAMAGE
+const int thumbnail_max_width = 320;
+const int thumbnail_max_height = 200;
+const int switcher_padding = 8;
+Window switcher_window = None; // Cửa sổ override-redirect giữa màn hình hiện ảnh của cửa sổ đang chọn
+bool switcher_shown = false;
+int switcher_width = 0, switcher_height = 0;
+
+// Compositor (--composite): mọi cửa sổ con của root được redirect thủ công và được ghép bằng XRender vào
+// một back buffer, rồi chép lên cửa sổ overlay của COMPOSITE. Mỗi khung chỉ vẽ lại hợp của các vùng bị
+// damage, nhiều nhất một khung mỗi composite_interval_ns. Khi cửa sổ trên cùng phủ kín màn hình (game,
+// video) thì bỏ redirect, X server vẽ thẳng lên màn hình như không có compositor.
+struct CompWindow {
+    int x = 0, y = 0;
+    int width = 1, height = 1, border = 0;
+    bool mapped = false;
+    XID damage = None;
+    bool damaged = false; // Có damage chưa được trừ, sẽ trừ ở khung sau
+};
+bool composite_enabled = false;
+bool composite_redirected = false;
+Window composite_overlay = None;
+std::unordered_map<Window, CompWindow> comp_windows;
+std::vector<Window> comp_stack;         // Thứ tự xếp chồng của các cửa sổ con của root, từ dưới lên trên
+std::vector<XRectangle> comp_damage;    // Vùng màn hình (tọa độ root) cần vẽ lại ở khung sau
+std::vector<Window> comp_damaged;       // Cửa sổ có damage cần trừ lúc vẽ khung
+std::vector<Window> comp_dirty_windows; // Cửa sổ đổi độ trong suốt, phải vẽ lại cả cửa sổ
+uint64_t comp_last_frame_ns = 0;
+const uint64_t composite_interval_ns = 16 * 1000000ull;
+const size_t comp_damage_max_rects = 32; // Vượt quá thì gộp thành một hình chữ nhật bao
+
+// Vị trí và kích thước mà cửa sổ chưa được quản lý tự chọn (CreateNotify, ConfigureRequest),
+// dùng làm kích thước của cửa sổ nổi khi nó được map
+struct Geometry {
+    int x = 0, y = 0;
+    int width = 0, height = 0;
+};
+std::unordered_map<Window, Geometry> requested_geometry;
+
+// Trang trạng thái chia sẻ (memfd + seqlock), xem wmstate.h
+int state_fd = -1;
+WmStatePage* state_page = nullptr;
+bool state_dirty = true;
+
+// Các biến cho giao diện điều khiển qua Unix socket (IPC)
+const uint32_t ipc_max_frame = 64 * 1024; // Kích thước tối đa của một gói lệnh
+const size_t ipc_event_ring_size = 256; // Số sự kiện tối đa xếp hàng cho mỗi subscriber
+const size_t ipc_out_high_water = 4096; // Chỉ lấy thêm sự kiện từ ring khi bộ đệm gửi nhỏ hơn mức này
+enum IpcEventKind { EVENT_WINDOW_ADDED, EVENT_WINDOW_REMOVED, EVENT_FOCUS, EVENT_LAYOUT, EVENT_KIND_COUNT };
+const char* const ipc_event_names[EVENT_KIND_COUNT] = { "window_added", "window_removed", "focus", "layout" };
+struct IpcEvent {
+    IpcEventKind kind;
+    unsigned long value;
+};
+struct IpcClient {
+    int fd;
+    std::string in;  // Dữ liệu đã nhận nhưng chưa đủ một gói
+    std::string out; // Dữ liệu đang chờ gửi đi
+    bool closed;
+    int send_fd = -1; // File descriptor sẽ gửi kèm (SCM_RIGHTS) với lần gửi tiếp theo
+    // Trạng thái subscriber: mỗi client có ring buffer riêng, client đọc chậm chỉ làm mất sự kiện của chính nó
+    unsigned subscriptions = 0; // Bitmask các IpcEventKind đã đăng ký
+    std::vector<IpcEvent> ring;
+    size_t ring_head = 0;
+    size_t ring_count = 0;
+    uint64_t dropped = 0;
+};
+int ipc_listen_fd = -1;
+std::string ipc_socket_path;
+std::vector<IpcClient> ipc_clients;
+
+// Ghi lại các khoảng thời gian (span) xử lý vào ring buffer, xuất ra dạng Chrome trace-event JSON
+// (bật bằng --trace). Mở file trong chrome://tracing hoặc ui.perfetto.dev.
+struct TraceSpanRecord {
+    const char* name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    unsigned long window;
+};
+const size_t trace_ring_size = 65536;
+bool tracing_enabled = false;
+std::vector<TraceSpanRecord> trace_ring;
+size_t trace_next = 0;
+size_t trace_count = 0;
+
+// Watchdog: một thread riêng theo dõi nhịp (heartbeat) của vòng lặp sự kiện. Nếu một lần xử lý
+// kéo dài quá ngưỡng (NOTHINGWM_WATCHDOG_MS, mặc định 500ms), nó ghi loại sự kiện, cửa sổ và
+// backtrace của thread chính vào log (NOTHINGWM_WATCHDOG_LOG, mặc định stderr).
+std::atomic<uint64_t> watchdog_dispatch_start{0}; // 0 = vòng lặp đang rảnh
+std::atomic<int> watchdog_event_type{0};
+std::atomic<unsigned long> watchdog_window{0};
+uint64_t watchdog_threshold_ns = 500 * 1000000ull;
+int watchdog_log_fd = STDERR_FILENO;
+pthread_t main_thread;
+
+// Ghi lại mọi XEvent vào file trace (bật bằng --record <file>), xem wmtrace.h
+FILE* trace_file = nullptr;
+uint64_t trace_start_ns = 0;
+uint64_t trace_records = 0;
+
+// Đo thời gian xử lý từng loại sự kiện bằng histogram log-linear: mỗi lũy thừa của 2
+// được chia thành 8 bucket, nên sai số tương đối luôn dưới 12.5% mà chỉ tốn một phép cộng
+const int hist_sub_bits = 3;
+const int hist_buckets = 64 << hist_sub_bits;
+struct LatencyHistogram {
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+    uint32_t buckets[hist_buckets] = {};
+};
+LatencyHistogram event_latency[LASTEvent];
+struct Metrics {
+    uint64_t relayouts = 0;       // Số lần gọi tile_windows
+    uint64_t configures_sent = 0; // Số yêu cầu đổi vị trí/kích thước gửi tới X server
+    uint64_t events_dropped = 0;  // Sự kiện IPC bị bỏ vì subscriber đọc không kịp
+    uint64_t frames_painted = 0;  // Số khung compositor đã vẽ (--composite)
+};
+Metrics metrics;
+
+// Đếm số lần phải chờ X server trả lời theo loại sự kiện đang xử lý.
+// Chỉ số LASTEvent dùng cho các lời gọi ngoài sự kiện X (khởi động, lệnh IPC).
+struct RoundTripStats {
+    uint64_t dispatches = 0;
+    uint64_t requests = 0;       // Tổng số yêu cầu gửi đi, kể cả bất đồng bộ
+    uint64_t round_trips = 0;
+    uint64_t reply_bytes = 0;
+    uint64_t multi_blocking = 0; // Số lần một handler phải chờ server nhiều hơn một lần
+    uint64_t budget_violations = 0;
+};
+RoundTripStats round_trip_stats[LASTEvent + 1];
+int round_trip_budget[LASTEvent]; // Số round trip tối đa cho mỗi sự kiện, -1 = không giới hạn
+int current_event_type = LASTEvent;
+int dispatch_round_trips = 0;
+unsigned long dispatch_first_request = 0;
+bool round_trip_strict = false; // NOTHINGWM_RT_STRICT=1: vượt ngân sách thì thoát với mã lỗi 3
+bool round_trip_budget_failed = false;
+
+// Self-pipe: signal handler chỉ ghi số hiệu signal, vòng lặp chính đọc và xử lý
+int signal_pipe[2] = { -1, -1 };
+
+// Xử lý lỗi X
+int x_error_handler(Display* display, XErrorEvent* error) {
+    char error_text[1024];
+    XGetErrorText(display, error->error_code, error_text, sizeof(error_text));
+    std::cerr << "X Error: " << error_text << " (Request: " << (int)error->request_code << ", Minor: " << (int)error->minor_code << ")" << std::endl;
+    return 0;
+}
+
+const char* event_type_name(int type) {
+    static const char* const names[LASTEvent] = {
+        "", "", "KeyPress", "KeyRelease", "ButtonPress", "ButtonRelease", "MotionNotify", "EnterNotify",
+        "LeaveNotify", "FocusIn", "FocusOut", "KeymapNotify", "Expose", "GraphicsExpose", "NoExpose",
+        "VisibilityNotify", "CreateNotify", "DestroyNotify", "UnmapNotify", "MapNotify", "MapRequest",
+        "ReparentNotify", "ConfigureNotify", "ConfigureRequest", "GravityNotify", "ResizeRequest",
+        "CirculateNotify", "CirculateRequest", "PropertyNotify", "SelectionClear", "SelectionRequest",
+        "SelectionNotify", "ColormapNotify", "ClientMessage", "MappingNotify", "GenericEvent"
+    };
+    return (type >= 0 && type < LASTEvent) ? names[type] : "Unknown";
+}
+
+uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void trace_span(const char* name, uint64_t start_ns, unsigned long window) {
+    if (!tracing_enabled) return;
+    trace_ring[trace_next] = { name, start_ns, monotonic_ns() - start_ns, window };
+    trace_next = (trace_next + 1) % trace_ring_size;
+    if (trace_count < trace_ring_size) ++trace_count;
+}
+
+// Ghi span cho toàn bộ phạm vi (scope) chứa nó
+struct ScopedTraceSpan {
+    const char* name;
+    unsigned long window;
+    uint64_t start_ns;
+    ScopedTraceSpan(const char* span_name, unsigned long span_window)
+        : name(span_name), window(span_window), start_ns(tracing_enabled ? monotonic_ns() : 0) {}
+    ~ScopedTraceSpan() { trace_span(name, start_ns, window); }
+};
+
+bool write_chrome_trace(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (file == nullptr) {
+        std::cerr << "Error: Could not write trace to " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":1,\"args\":{\"name\":\"nothingwm\"}}", (int)getpid());
+    size_t first = (trace_next + trace_ring_size - trace_count) % trace_ring_size;
+    for (size_t i = 0; i < trace_count; ++i) {
+        const TraceSpanRecord& span = trace_ring[(first + i) % trace_ring_size];
+        fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"wm\",\"ph\":\"X\",\"pid\":%d,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"window\":\"0x%lx\"}}",
+                span.name, (int)getpid(), span.start_ns / 1000.0, span.duration_ns / 1000.0, span.window);
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    std::cout << "Wrote " << trace_count << " trace spans to " << path << std::endl;
+    return true;
+}
+
+void watchdog_begin(int type, unsigned long window) {
+    watchdog_event_type.store(type, std::memory_order_relaxed);
+    watchdog_window.store(window, std::memory_order_relaxed);
+    watchdog_dispatch_start.store(monotonic_ns(), std::memory_order_release);
+}
+
+void watchdog_end() {
+    watchdog_dispatch_start.store(0, std::memory_order_release);
+}
+
+// Chạy trên thread chính khi watchdog gửi SIGRTMIN: in backtrace tại chỗ đang bị treo
+void watchdog_backtrace_handler(int) {
+    void* frames[64];
+    int n = backtrace(frames, 64);
+    backtrace_symbols_fd(frames, n, watchdog_log_fd);
+}
+
+void watchdog_loop() {
+    uint64_t reported_start = 0;
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(watchdog_threshold_ns / 4));
+        uint64_t start = watchdog_dispatch_start.load(std::memory_order_acquire);
+        if (start == 0 || start == reported_start) continue;
+        uint64_t elapsed = monotonic_ns() - start;
+        if (elapsed < watchdog_threshold_ns) continue;
+        reported_start = start;
+        int type = watchdog_event_type.load(std::memory_order_relaxed);
+        dprintf(watchdog_log_fd, "Watchdog: event loop stalled for %.1f ms in %s handler (window 0x%lx)\n",
+                elapsed / 1e6, type == LASTEvent ? "IPC command" : event_type_name(type), watchdog_window.load(std::memory_order_relaxed));
+        pthread_kill(main_thread, SIGRTMIN);
+    }
+}
+
+void setup_watchdog() {
+    const char* ms = getenv("NOTHINGWM_WATCHDOG_MS");
+    if (ms != nullptr && atoi(ms) > 0) {
+        watchdog_threshold_ns = (uint64_t)atoi(ms) * 1000000ull;
+    }
+    const char* log_path = getenv("NOTHINGWM_WATCHDOG_LOG");
+    if (log_path != nullptr && *log_path != '\0') {
+        int fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd >= 0) watchdog_log_fd = fd;
+    }
+    // Gọi backtrace() một lần trước để libgcc được nạp sẵn, trong signal handler nó không cần cấp phát bộ nhớ
+    void* frames[4];
+    backtrace(frames, 4);
+
+    main_thread = pthread_self();
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watchdog_backtrace_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGRTMIN, &sa, nullptr);
+
+    // Chặn các signal trong thread watchdog để chúng luôn được xử lý bởi thread chính
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    std::thread(watchdog_loop).detach();
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+// Mọi lần WM phải chờ X server trả lời (xem XBackend bên dưới) đều được đếm ở đây.
+// Số byte là kích thước reply (32 byte header + dữ liệu) mà WM phải nhận.
+void count_round_trip(int round_trips, uint64_t reply_bytes) {
+    RoundTripStats& stats = round_trip_stats[current_event_type];
+    stats.round_trips += round_trips;
+    stats.reply_bytes += reply_bytes;
+    dispatch_round_trips += round_trips;
+}
+
+// Cookie của một truy vấn đã gửi đi nhưng chưa lấy trả lời (giống xcb_*_cookie_t)
+struct QueryCookie {
+    unsigned int sequence = 0;
+};
+
+struct GeometryReply {
+    int x = 0, y = 0;
+    unsigned int width = 0, height = 0;
+};
+
+struct PropertyReply {
+    Atom type = None;
+    int format = 0;
+    std::string value; // Dữ liệu thô; với format 32 là các giá trị 32-bit liên tiếp
+
+    std::vector<uint32_t> values() const {
+        std::vector<uint32_t> result(format == 32 ? value.size() / 4 : 0);
+        if (!result.empty()) memcpy(result.data(), value.data(), result.size() * 4);
+        return result;
+    }
+    std::vector<Atom> atoms() const {
+        std::vector<uint32_t> list = values();
+        return std::vector<Atom>(list.begin(), list.end());
+    }
+};
+
+// Một cửa sổ trong khung compositor: vị trí và kích thước tính cả viền, độ trong suốt theo _NET_WM_WINDOW_OPACITY
+struct CompositeLayer {
+    Window window;
+    int x, y;
+    unsigned int width, height;
+    uint32_t opacity;
+};
+
+// Giao diện backend X: lõi WM (các handler, tile_windows, focus, close_window) chỉ nói chuyện
+// với X server qua đây. XcbBackend là bản thật; MockBackend giữ trạng thái trong bộ nhớ,
+// ghi lại mọi yêu cầu và tự sinh sự kiện, để benchmark và fuzz các handler mà không cần X server.
+struct XBackend {
+    virtual ~XBackend() {}
+    virtual unsigned long next_request() = 0; // Số thứ tự yêu cầu tiếp theo, dùng để đếm yêu cầu mỗi sự kiện
+    virtual bool pending() = 0;
+    virtual void next_event(XEvent* event) = 0;
+    virtual void flush() = 0;
+
+    // Các yêu cầu bất đồng bộ
+    virtual void select_input(Window window, long mask) = 0;
+    virtual void set_border_width(Window window, unsigned int width) = 0;
+    virtual void set_border(Window window, unsigned long pixel) = 0;
+    virtual void map_window(Window window) = 0;
+    virtual void unmap_window(Window window) = 0;
+    virtual void move_window(Window window, int x, int y) = 0;
+    virtual void move_resize_window(Window window, int x, int y, unsigned int width, unsigned int height) = 0;
+    virtual void configure_window(Window window, unsigned int value_mask, XWindowChanges* changes) = 0;
+    virtual void raise_window(Window window) = 0;
+    virtual void set_input_focus(Window window) = 0;
+    virtual void send_event(Window window, XEvent* event) = 0;
+    virtual void send_configure_notify(Window window, int x, int y, unsigned int width, unsigned int height, unsigned int border) = 0;
+    virtual void kill_client(Window window) = 0;
+    virtual void set_atom_property(Window window, Atom property, const std::vector<Atom>& atoms) = 0; // Kiểu ATOM, format 32
+    virtual void grab_pointer(Window window) = 0;
+    virtual void ungrab_pointer() = 0;
+    virtual void grab_keyboard(Window window) = 0;
+    virtual void ungrab_keyboard() = 0;
+    virtual void grab_server() = 0;
+    virtual void ungrab_server() = 0;
+    virtual void clear_window(Window window) = 0;
+    virtual void draw_string(Window window, int x, int y, const std::string& text) = 0;
+    // Vẽ khung XOR: vẽ lần thứ hai ở cùng chỗ thì khung biến mất
+    virtual void draw_outline(Window window, int x, int y, unsigned int width, unsigned int height) = 0;
+    // Alarm XSync báo (AlarmNotify) khi counter đạt tới value; set_sync_alarm bật lại alarm cho counter và giá trị mới
+    virtual XID create_sync_alarm(XID counter, uint64_t value) = 0;
+    virtual void set_sync_alarm(XID alarm, XID counter, uint64_t value) = 0;
+    // DAMAGE: với ReportNonEmpty, DamageNotify chỉ tới một lần sau mỗi subtract_damage, khi cửa sổ vẽ lại lần đầu;
+    // với ReportBoundingBox, mỗi khi hình chữ nhật bao của vùng damage lớn lên
+    virtual XID create_damage(Window window, int level) = 0;
+    virtual void destroy_damage(XID damage) = 0;
+    virtual void subtract_damage(XID damage) = 0;
+    // Chụp toàn bộ nội dung một cửa sổ đang hiện (kể cả phần bị che), 32 bit mỗi pixel, stride tính bằng pixel.
+    // Con trỏ trả về chỉ hợp lệ tới lần chụp tiếp theo. Phải chờ X server, tính là round trip.
+    virtual bool capture_window(Window window, const uint32_t*& pixels, int& width, int& height, int& stride) = 0;
+    virtual void put_image(Window window, int x, int y, int width, int height, const uint32_t* pixels) = 0;
+    // Compositor: composite_start redirect thủ công các cửa sổ con của root và trả về cửa sổ overlay;
+    // set_redirected(false) trả việc vẽ về cho X server và ẩn overlay. composite_paint vẽ các lớp (từ dưới
+    // lên) trong vùng region, rồi khung của chế độ --outline nếu có. composite_forget bỏ pixmap của cửa sổ khi nó không còn hợp lệ (unmap, đổi
+    // kích thước), destroyed = cửa sổ đã bị hủy.
+    virtual Window composite_start(Window root) = 0;
+    virtual void set_redirected(Window root, bool redirected) = 0;
+    virtual void composite_track(Window window) = 0; // Hỏi trước visual của cửa sổ mới, lấy trả lời lúc vẽ
+    virtual void composite_forget(Window window, bool destroyed) = 0;
+    virtual void composite_paint(const std::vector<XRectangle>& region, const std::vector<CompositeLayer>& layers, const XRectangle* outline) = 0;
+
+    // Các truy vấn theo kiểu cookie: hàm gửi trả về ngay, hàm *_reply mới chờ trả lời.
+    // Gửi hết các truy vấn cần thiết trước rồi mới lấy trả lời thì cả đợt chỉ tốn một round trip.
+    // Mỗi cookie phải được lấy trả lời đúng một lần.
+    virtual QueryCookie get_geometry(Window window) = 0;
+    virtual QueryCookie get_property(Window window, Atom property, Atom type, long max_length) = 0;
+    virtual QueryCookie query_tree(Window window) = 0;
+    virtual bool get_geometry_reply(QueryCookie cookie, GeometryReply& reply) = 0;
+    virtual bool get_property_reply(QueryCookie cookie, PropertyReply& reply) = 0;
+    virtual bool query_tree_reply(QueryCookie cookie, std::vector<Window>& children) = 0;
+    virtual void discard_reply(QueryCookie cookie) = 0; // Bỏ một truy vấn không còn cần trả lời
+    // Chuỗi văn bản (COMPOUND_TEXT hoặc encoding khác ngoài STRING và UTF8_STRING) sang UTF-8, không hỏi X server
+    virtual std::string text_to_utf8(const PropertyReply& reply) = 0;
+
+    // Lần chờ đầu tiên sau một đợt gửi mới thật sự phải chờ X server; khi nó trả lời thì
+    // trả lời của các truy vấn gửi cùng đợt cũng đã tới, nên không tính thêm round trip.
+    // Trả lời đã tới sẵn trước khi cần (arrived) thì không tốn round trip nào.
+    unsigned int issued_through = 0;
+    unsigned int synced_through = 0;
+
+    QueryCookie issued(unsigned int sequence) {
+        issued_through = sequence;
+        return { sequence };
+    }
+    void count_reply(QueryCookie cookie, uint64_t data_bytes, bool arrived) {
+        bool waited = !arrived && (int)(cookie.sequence - synced_through) > 0;
+        if (waited) synced_through = issued_through;
+        count_round_trip(waited ? 1 : 0, 32 + data_bytes);
+    }
+};
+
+// Backend thật: Xlib chỉ còn dùng để mở kết nối và đọc XEvent, mọi yêu cầu của lõi WM
+// được gửi bằng XCB trên cùng kết nối đó (XGetXCBConnection)
+struct XcbBackend : XBackend {
+    Display* display;
+    xcb_connection_t* connection;
+    xcb_gcontext_t text_gc;
+    xcb_gcontext_t outline_gc;
+    uint8_t root_depth;
+    unsigned int last_sequence = 0;
+    // Vùng nhớ chia sẻ với X server để chụp cửa sổ, chỉ lớn lên khi gặp cửa sổ lớn hơn
+    XShmSegmentInfo shm_segment;
+    size_t shm_size = 0;
+    // Compositor: back buffer cỡ màn hình, chép lên overlay sau khi ghép xong để không bị xé hình
+    Window composite_root = None;
+    Window overlay = None;
+    int overlay_width = 0, overlay_height = 0;
+    XRenderPictFormat* screen_format = nullptr;
+    Picture overlay_picture = None;
+    Picture back_picture = None;
+    struct WindowPicture {
+        QueryCookie attributes;
+        bool querying = false;
+        bool unsupported = false; // Visual không có định dạng XRender tương ứng
+        XRenderPictFormat* format = nullptr;
+        Pixmap pixmap = None;
+        Picture picture = None;
+    };
+    std::unordered_map<Window, WindowPicture> window_pictures;
+    std::unordered_map<uint32_t, Picture> alpha_pictures; // Mặt nạ 1x1 lặp lại cho mỗi mức độ trong suốt
+
+    XcbBackend(Display* d) : display(d), connection(XGetXCBConnection(d)) {
+        const xcb_setup_t* setup = xcb_get_setup(connection);
+        xcb_screen_t* screen = xcb_setup_roots_iterator(setup).data;
+        root_depth = screen->root_depth;
+        memset(&shm_segment, 0, sizeof(shm_segment));
+        shm_segment.shmid = -1;
+        text_gc = xcb_generate_id(connection);
+        uint32_t foreground = screen->white_pixel;
+        xcb_create_gc(connection, text_gc, screen->root, XCB_GC_FOREGROUND, &foreground);
+        // Khung đảo màu, vẽ đè lên cả các cửa sổ con của root
+        outline_gc = xcb_generate_id(connection);
+        uint32_t outline_values[] = { XCB_GX_INVERT, outline_line_width, XCB_SUBWINDOW_MODE_INCLUDE_INFERIORS };
+        xcb_create_gc(connection, outline_gc, screen->root, XCB_GC_FUNCTION | XCB_GC_LINE_WIDTH | XCB_GC_SUBWINDOW_MODE, outline_values);
+    }
+
+    void sent(xcb_void_cookie_t cookie) { last_sequence = cookie.sequence; }
+
+    unsigned long next_request() override { return last_sequence + 1; }
+    bool pending() override { return XPending(display) > 0; }
+    void next_event(XEvent* event) override { XNextEvent(display, event); }
+    void flush() override {
+        XFlush(display);
+        xcb_flush(connection);
+    }
+
+    void select_input(Window window, long mask) override {
+        uint32_t value = mask;
+        sent(xcb_change_window_attributes(connection, window, XCB_CW_EVENT_MASK, &value));
+    }
+    void set_border_width(Window window, unsigned int width) override {
+        uint32_t value = width;
+        sent(xcb_configure_window(connection, window, XCB_CONFIG_WINDOW_BORDER_WIDTH, &value));
+    }
+    void set_border(Window window, unsigned long pixel) override {
+        uint32_t value = pixel;
+        sent(xcb_change_window_attributes(connection, window, XCB_CW_BORDER_PIXEL, &value));
+    }
+    void map_window(Window window) override { sent(xcb_map_window(connection, window)); }
+    void unmap_window(Window window) override { sent(xcb_unmap_window(connection, window)); }
+    void move_window(Window window, int x, int y) override {
+        uint32_t values[] = { (uint32_t)x, (uint32_t)y };
+        sent(xcb_configure_window(connection, window, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y, values));
+    }
+    void move_resize_window(Window window, int x, int y, unsigned int width, unsigned int height) override {
+        uint32_t values[] = { (uint32_t)x, (uint32_t)y, width, height };
+        sent(xcb_configure_window(connection, window, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, values));
+    }
+    // Các bit CW* của Xlib trùng với XCB_CONFIG_WINDOW_*, giá trị phải theo đúng thứ tự bit
+    void configure_window(Window window, unsigned int value_mask, XWindowChanges* changes) override {
+        uint32_t values[7];
+        int count = 0;
+        if (value_mask & CWX) values[count++] = changes->x;
+        if (value_mask & CWY) values[count++] = changes->y;
+        if (value_mask & CWWidth) values[count++] = changes->width;
+        if (value_mask & CWHeight) values[count++] = changes->height;
+        if (value_mask & CWBorderWidth) values[count++] = changes->border_width;
+        if (value_mask & CWSibling) values[count++] = changes->sibling;
+        if (value_mask & CWStackMode) values[count++] = changes->stack_mode;
+        sent(xcb_configure_window(connection, window, value_mask & 0x7f, values));
+    }
+    void raise_window(Window window) override {
+        uint32_t value = XCB_STACK_MODE_ABOVE;
+        sent(xcb_configure_window(connection, window, XCB_CONFIG_WINDOW_STACK_MODE, &value));
+    }
+    void set_input_focus(Window window) override {
+        sent(xcb_set_input_focus(connection, XCB_INPUT_FOCUS_POINTER_ROOT, window, XCB_CURRENT_TIME));
+    }
+    // Chỉ dùng cho ClientMessage, dạng 32 byte trên đường truyền được dựng lại từ XClientMessageEvent
+    void send_event(Window window, XEvent* event) override {
+        xcb_client_message_event_t message;
+        memset(&message, 0, sizeof(message));
+        message.response_type = XCB_CLIENT_MESSAGE;
+        message.format = event->xclient.format;
+        message.window = event->xclient.window;
+        message.type = event->xclient.message_type;
+        for (int i = 0; i < 5; ++i) {
+            message.data.data32[i] = event->xclient.data.l[i];
+        }
+        sent(xcb_send_event(connection, 0, window, XCB_EVENT_MASK_NO_EVENT, (const char*)&message));
+    }
+    void send_configure_notify(Window window, int x, int y, unsigned int width, unsigned int height, unsigned int border) override {
+        xcb_configure_notify_event_t notify;
+        memset(&notify, 0, sizeof(notify));
+        notify.response_type = XCB_CONFIGURE_NOTIFY;
+        notify.event = window;
+        notify.window = window;
+        notify.above_sibling = XCB_NONE;
+        notify.x = x;
+        notify.y = y;
+        notify.width = width;
+        notify.height = height;
+        notify.border_width = border;
+        sent(xcb_send_event(connection, 0, window, XCB_EVENT_MASK_STRUCTURE_NOTIFY, (const char*)&notify));
+    }
+    void kill_client(Window window) override { sent(xcb_kill_client(connection, window)); }
+    void set_atom_property(Window window, Atom property, const std::vector<Atom>& atoms) override {
+        std::vector<uint32_t> values(atoms.begin(), atoms.end());
+        sent(xcb_change_property(connection, XCB_PROP_MODE_REPLACE, window, property, XA_ATOM, 32, values.size(), values.data()));
+    }
+    void grab_pointer(Window window) override {
+        xcb_grab_pointer_cookie_t cookie = xcb_grab_pointer(connection, 0, window,
+                                                            XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_BUTTON_RELEASE | XCB_EVENT_MASK_POINTER_MOTION,
+                                                            XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC, window, XCB_NONE, XCB_CURRENT_TIME);
+        // Không cần biết kết quả grab, bỏ trả lời để không phải chờ
+        xcb_discard_reply(connection, cookie.sequence);
+        last_sequence = cookie.sequence;
+    }
+    void ungrab_pointer() override { sent(xcb_ungrab_pointer(connection, XCB_CURRENT_TIME)); }
+    void grab_keyboard(Window window) override {
+        xcb_grab_keyboard_cookie_t cookie = xcb_grab_keyboard(connection, 0, window, XCB_CURRENT_TIME, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+        xcb_discard_reply(connection, cookie.sequence);
+        last_sequence = cookie.sequence;
+    }
+    void ungrab_keyboard() override { sent(xcb_ungrab_keyboard(connection, XCB_CURRENT_TIME)); }
+    void grab_server() override { sent(xcb_grab_server(connection)); }
+    void ungrab_server() override { sent(xcb_ungrab_server(connection)); }
+    void clear_window(Window window) override { sent(xcb_clear_area(connection, 0, window, 0, 0, 0, 0)); }
+    // PolyText8: mỗi mục gồm độ dài, delta rồi tối đa 254 ký tự
+    void draw_string(Window window, int x, int y, const std::string& text) override {
+        std::string items;
+        for (size_t offset = 0; offset < text.size(); offset += 254) {
+            size_t len = std::min<size_t>(254, text.size() - offset);
+            items += (char)len;
+            items += (char)0;
+            items.append(text, offset, len);
+        }
+        sent(xcb_poly_text_8(connection, window, text_gc, x, y, items.size(), (const uint8_t*)items.data()));
+    }
+    void draw_outline(Window window, int x, int y, unsigned int width, unsigned int height) override {
+        xcb_rectangle_t rectangle = { (int16_t)(x + 1), (int16_t)(y + 1), (uint16_t)std::max(1, (int)width - 2), (uint16_t)std::max(1, (int)height - 2) };
+        sent(xcb_poly_rectangle(connection, window, outline_gc, 1, &rectangle));
+    }
+    // SYNC đi qua Xlib (libXext) thay vì XCB: Xlib phải biết extension thì mới giải mã được AlarmNotify
+    XSyncAlarmAttributes alarm_attributes(XID counter, uint64_t value) {
+        XSyncAlarmAttributes attributes;
+        attributes.trigger.counter = counter;
+        attributes.trigger.value_type = XSyncAbsolute;
+        XSyncIntsToValue(&attributes.trigger.wait_value, value & 0xffffffff, (int)(value >> 32));
+        attributes.trigger.test_type = XSyncPositiveComparison;
+        // delta = 0: alarm tự tắt sau khi báo, tới khi set_sync_alarm bật lại
+        XSyncIntToValue(&attributes.delta, 0);
+        attributes.events = True;
+        return attributes;
+    }
+    XID create_sync_alarm(XID counter, uint64_t value) override {
+        XSyncAlarmAttributes attributes = alarm_attributes(counter, value);
+        XID alarm = XSyncCreateAlarm(display, XSyncCACounter | XSyncCAValueType | XSyncCAValue | XSyncCATestType | XSyncCADelta | XSyncCAEvents, &attributes);
+        last_sequence = NextRequest(display) - 1;
+        return alarm;
+    }
+    void set_sync_alarm(XID alarm, XID counter, uint64_t value) override {
+        XSyncAlarmAttributes attributes = alarm_attributes(counter, value);
+        XSyncChangeAlarm(display, alarm, XSyncCACounter | XSyncCAValueType | XSyncCAValue | XSyncCATestType | XSyncCADelta, &attributes);
+        last_sequence = NextRequest(display) - 1;
+    }
+    // DAMAGE, COMPOSITE và MIT-SHM cũng đi qua Xlib, cùng lý do với SYNC (DamageNotify)
+#if HAVE_XDAMAGE
+    XID create_damage(Window window, int level) override {
+        Damage damage = XDamageCreate(display, window, level);
+        last_sequence = NextRequest(display) - 1;
+        return damage;
+    }
+    void destroy_damage(XID damage) override {
+        XDamageDestroy(display, damage);
+        last_sequence = NextRequest(display) - 1;
+    }
+    void subtract_damage(XID damage) override {
+        XDamageSubtract(display, damage, None, None);
+        last_sequence = NextRequest(display) - 1;
+    }
+#else
+    // Không bao giờ được gọi: damage_event_base luôn là 0 nên ảnh thu nhỏ và compositor đã bị tắt
+    XID create_damage(Window, int) override { return None; }
+    void destroy_damage(XID) override {}
+    void subtract_damage(XID) override {}
+#endif
+    bool reserve_shm(size_t size) {
+        if (size <= shm_size) return true;
+        if (shm_segment.shmid >= 0) {
+            XShmDetach(display, &shm_segment);
+            shmdt(shm_segment.shmaddr);
+            shm_segment.shmid = -1;
+            shm_size = 0;
+        }
+        shm_segment.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+        if (shm_segment.shmid < 0) return false;
+        shm_segment.shmaddr = (char*)shmat(shm_segment.shmid, nullptr, 0);
+        shm_segment.readOnly = False;
+        bool attached = shm_segment.shmaddr != (char*)-1 && XShmAttach(display, &shm_segment);
+        // X server phải attach xong trước khi segment được đánh dấu xóa
+        if (attached) XSync(display, False);
+        shmctl(shm_segment.shmid, IPC_RMID, nullptr);
+        if (!attached) {
+            if (shm_segment.shmaddr != (char*)-1) shmdt(shm_segment.shmaddr);
+            shm_segment.shmid = -1;
+            return false;
+        }
+        count_round_trip(1, 32);
+        shm_size = size;
+        return true;
+    }
+    // Pixmap do COMPOSITE giữ nội dung cửa sổ (root được redirect tự động lúc khởi động), nên chụp được
+    // cả cửa sổ đang bị che; XShmGetImage ghi thẳng vào vùng nhớ chia sẻ, không chép qua socket
+    bool capture_window(Window window, const uint32_t*& pixels, int& width, int& height, int& stride) override {
+        XWindowAttributes attributes;
+        bool viewable = XGetWindowAttributes(display, window, &attributes) && attributes.map_state == IsViewable;
+        count_round_trip(2, 44 + 32); // XGetWindowAttributes gồm GetWindowAttributes và GetGeometry
+        if (!viewable || attributes.width <= 0 || attributes.height <= 0
+            || !reserve_shm((size_t)attributes.width * attributes.height * 4)) {
+            last_sequence = NextRequest(display) - 1;
+            return false;
+        }
+        Pixmap pixmap = XCompositeNameWindowPixmap(display, window);
+        XImage* image = XShmCreateImage(display, attributes.visual, attributes.depth, ZPixmap, shm_segment.shmaddr,
+                                        &shm_segment, attributes.width, attributes.height);
+        bool ok = image != nullptr && image->bits_per_pixel == 32 && XShmGetImage(display, pixmap, image, 0, 0, AllPlanes);
+        XFreePixmap(display, pixmap);
+        last_sequence = NextRequest(display) - 1;
+        count_round_trip(1, 32);
+        if (ok) {
+            pixels = (const uint32_t*)shm_segment.shmaddr;
+            width = attributes.width;
+            height = attributes.height;
+            stride = image->bytes_per_line / 4;
+        }
+        if (image != nullptr) {
+            image->data = nullptr; // Dữ liệu thuộc về segment, XDestroyImage không được giải phóng nó
+            XDestroyImage(image);
+        }
+        return ok;
+    }
+    // Giả định ZPixmap của root là 32 bit mỗi pixel (đúng với mọi server depth 24/32 thông dụng).
+    // Ảnh được chia thành nhiều PutImage nếu vượt quá độ dài yêu cầu tối đa.
+    void put_image(Window window, int x, int y, int width, int height, const uint32_t* pixels) override {
+        if (width <= 0 || height <= 0) return;
+        const size_t max_bytes = (size_t)xcb_get_maximum_request_length(connection) * 4 - 32;
+        const int rows = std::max<int>(1, std::min<size_t>(height, max_bytes / (width * 4)));
+        for (int row = 0; row < height; row += rows) {
+            const int count = std::min(rows, height - row);
+            sent(xcb_put_image(connection, XCB_IMAGE_FORMAT_Z_PIXMAP, window, text_gc, width, count, x, y + row, 0, root_depth,
+                               width * count * 4, (const uint8_t*)(pixels + (size_t)row * width)));
+        }
+    }
+    // XRender, XFixes và COMPOSITE qua Xlib; chỉ chạy lúc khởi động nên các round trip ở đây không đáng kể
+    Window composite_start(Window root) override {
+        composite_root = root;
+        XCompositeRedirectSubwindows(display, root, CompositeRedirectManual);
+        overlay = XCompositeGetOverlayWindow(display, root);
+        // Overlay không nhận input: chuột và bàn phím đi thẳng tới các cửa sổ bên dưới
+        XserverRegion empty = XFixesCreateRegion(display, nullptr, 0);
+        XFixesSetWindowShapeRegion(display, overlay, ShapeInput, 0, 0, empty);
+        XFixesDestroyRegion(display, empty);
+        const int screen = DefaultScreen(display);
+        overlay_width = DisplayWidth(display, screen);
+        overlay_height = DisplayHeight(display, screen);
+        screen_format = XRenderFindVisualFormat(display, DefaultVisual(display, screen));
+        XRenderPictureAttributes attributes;
+        attributes.subwindow_mode = IncludeInferiors;
+        overlay_picture = XRenderCreatePicture(display, overlay, screen_format, CPSubwindowMode, &attributes);
+        Pixmap back_pixmap = XCreatePixmap(display, root, overlay_width, overlay_height, DefaultDepth(display, screen));
+        back_picture = XRenderCreatePicture(display, back_pixmap, screen_format, 0, nullptr);
+        XFreePixmap(display, back_pixmap); // Picture giữ pixmap sống
+        last_sequence = NextRequest(display) - 1;
+        count_round_trip(2, 64);
+        return overlay;
+    }
+    void set_redirected(Window root, bool redirected) override {
+        // Pixmap của các cửa sổ đổi khi redirect lại, phải lấy lại lúc vẽ
+        for (auto& entry : window_pictures) {
+            release_picture(entry.second);
+        }
+        if (redirected) {
+            XCompositeRedirectSubwindows(display, root, CompositeRedirectManual);
+            XMapWindow(display, overlay);
+        } else {
+            XUnmapWindow(display, overlay);
+            XCompositeUnredirectSubwindows(display, root, CompositeRedirectManual);
+        }
+        last_sequence = NextRequest(display) - 1;
+    }
+    void composite_track(Window window) override {
+        WindowPicture& picture = window_pictures[window];
+        if (picture.querying || picture.format != nullptr) return;
+        picture.attributes = issued(xcb_get_window_attributes(connection, window).sequence);
+        picture.querying = true;
+    }
+    void release_picture(WindowPicture& picture) {
+        if (picture.picture != None) XRenderFreePicture(display, picture.picture);
+        if (picture.pixmap != None) XFreePixmap(display, picture.pixmap);
+        picture.picture = None;
+        picture.pixmap = None;
+    }
+    void composite_forget(Window window, bool destroyed) override {
+        auto it = window_pictures.find(window);
+        if (it == window_pictures.end()) return;
+        release_picture(it->second);
+        if (destroyed) {
+            if (it->second.querying) discard_reply(it->second.attributes);
+            window_pictures.erase(it);
+        }
+        last_sequence = NextRequest(display) - 1;
+    }
+    // Picture của nội dung cửa sổ (kể cả viền), tạo lúc cần vẽ lần đầu sau mỗi lần map hoặc đổi kích thước
+    WindowPicture* window_picture(Window window) {
+        WindowPicture& picture = window_pictures[window];
+        if (picture.picture != None) return &picture;
+        if (picture.unsupported) return nullptr;
+        if (picture.format == nullptr) {
+            if (!picture.querying) composite_track(window);
+            picture.querying = false;
+            bool arrived;
+            xcb_get_window_attributes_reply_t* reply = (xcb_get_window_attributes_reply_t*)wait_reply(picture.attributes, arrived);
+            count_reply(picture.attributes, reply != nullptr ? 12 : 0, arrived);
+            if (reply == nullptr) return nullptr;
+            XVisualInfo visual_template;
+            visual_template.visualid = reply->visual;
+            free(reply);
+            int count = 0;
+            XVisualInfo* visual = XGetVisualInfo(display, VisualIDMask, &visual_template, &count);
+            if (visual != nullptr) {
+                picture.format = XRenderFindVisualFormat(display, visual->visual);
+                XFree(visual);
+            }
+            if (picture.format == nullptr) {
+                picture.unsupported = true;
+                return nullptr;
+            }
+        }
+        picture.pixmap = XCompositeNameWindowPixmap(display, window);
+        XRenderPictureAttributes attributes;
+        attributes.subwindow_mode = IncludeInferiors;
+        picture.picture = XRenderCreatePicture(display, picture.pixmap, picture.format, CPSubwindowMode, &attributes);
+        return &picture;
+    }
+    Picture alpha_picture(uint32_t level) {
+        Picture& picture = alpha_pictures[level];
+        if (picture != None) return picture;
+        Pixmap pixmap = XCreatePixmap(display, composite_root, 1, 1, 8);
+        XRenderPictureAttributes attributes;
+        attributes.repeat = RepeatNormal;
+        picture = XRenderCreatePicture(display, pixmap, XRenderFindStandardFormat(display, PictStandardA8), CPRepeat, &attributes);
+        XRenderColor color = { 0, 0, 0, (unsigned short)(level * 257) };
+        XRenderFillRectangle(display, PictOpSrc, picture, &color, 0, 0, 1, 1);
+        XFreePixmap(display, pixmap);
+        return picture;
+    }
+    void composite_paint(const std::vector<XRectangle>& region, const std::vector<CompositeLayer>& layers, const XRectangle* outline) override {
+        XRenderSetPictureClipRectangles(display, back_picture, 0, 0, region.data(), region.size());
+        XRenderColor background = { 0x1000, 0x1000, 0x1000, 0xffff };
+        XRenderFillRectangle(display, PictOpSrc, back_picture, &background, 0, 0, overlay_width, overlay_height);
+        for (const CompositeLayer& layer : layers) {
+            WindowPicture* picture = window_picture(layer.window);
+            if (picture == nullptr) continue;
+            const uint32_t level = layer.opacity >> 24;
+            const Picture mask = level < 0xff ? alpha_picture(level) : None;
+            const bool has_alpha = picture->format->type == PictTypeDirect && picture->format->direct.alphaMask != 0;
+            XRenderComposite(display, (has_alpha || mask != None) ? PictOpOver : PictOpSrc, picture->picture, mask, back_picture,
+                             0, 0, 0, 0, layer.x, layer.y, layer.width, layer.height);
+        }
+        if (outline != nullptr) {
+            const short line = outline_line_width;
+            const XRectangle edges[] = {
+                { outline->x, outline->y, outline->width, (unsigned short)line },
+                { outline->x, (short)(outline->y + outline->height - line), outline->width, (unsigned short)line },
+                { outline->x, outline->y, (unsigned short)line, outline->height },
+                { (short)(outline->x + outline->width - line), outline->y, (unsigned short)line, outline->height },
+            };
+            XRenderColor white = { 0xffff, 0xffff, 0xffff, 0xffff };
+            XRenderFillRectangles(display, PictOpSrc, back_picture, &white, edges, 4);
+        }
+        XRenderSetPictureClipRectangles(display, overlay_picture, 0, 0, region.data(), region.size());
+        XRenderComposite(display, PictOpSrc, back_picture, None, overlay_picture, 0, 0, 0, 0, 0, 0, overlay_width, overlay_height);
+        last_sequence = NextRequest(display) - 1;
+    }
+
+    QueryCookie get_geometry(Window window) override {
+        return issued(xcb_get_geometry(connection, window).sequence);
+    }
+    QueryCookie get_property(Window window, Atom property, Atom type, long max_length) override {
+        return issued(xcb_get_property(connection, 0, window, property, type, 0, max_length).sequence);
+    }
+    QueryCookie query_tree(Window window) override {
+        return issued(xcb_query_tree(connection, window).sequence);
+    }
+
+    // Nếu trả lời đã tới (ví dụ truy vấn lấy trước lúc CreateNotify) thì lấy ngay, không phải chờ.
+    // Lỗi (ví dụ BadWindow khi cửa sổ vừa bị hủy) được trả về qua error thay vì hàng đợi sự kiện.
+    void* wait_reply(QueryCookie cookie, bool& arrived) {
+        void* reply = nullptr;
+        xcb_generic_error_t* error = nullptr;
+        arrived = xcb_poll_for_reply(connection, cookie.sequence, &reply, &error);
+        if (!arrived) reply = xcb_wait_for_reply(connection, cookie.sequence, &error);
+        free(error);
+        return reply;
+    }
+
+    bool get_geometry_reply(QueryCookie cookie, GeometryReply& reply) override {
+        bool arrived;
+        xcb_get_geometry_reply_t* r = (xcb_get_geometry_reply_t*)wait_reply(cookie, arrived);
+        count_reply(cookie, r != nullptr ? 12 : 0, arrived);
+        if (r == nullptr) return false;
+        reply.x = r->x;
+        reply.y = r->y;
+        reply.width = r->width;
+        reply.height = r->height;
+        free(r);
+        return true;
+    }
+    bool get_property_reply(QueryCookie cookie, PropertyReply& reply) override {
+        bool arrived;
+        xcb_get_property_reply_t* r = (xcb_get_property_reply_t*)wait_reply(cookie, arrived);
+        int length = r != nullptr ? xcb_get_property_value_length(r) : 0;
+        count_reply(cookie, length, arrived);
+        if (r == nullptr) return false;
+        reply.type = r->type;
+        reply.format = r->format;
+        reply.value.assign((const char*)xcb_get_property_value(r), length);
+        free(r);
+        return true;
+    }
+    bool query_tree_reply(QueryCookie cookie, std::vector<Window>& children) override {
+        bool arrived;
+        xcb_query_tree_reply_t* r = (xcb_query_tree_reply_t*)wait_reply(cookie, arrived);
+        int count = r != nullptr ? xcb_query_tree_children_length(r) : 0;
+        count_reply(cookie, count * 4, arrived);
+        if (r == nullptr) return false;
+        xcb_window_t* list = xcb_query_tree_children(r);
+        children.assign(list, list + count);
+        free(r);
+        return true;
+    }
+    void discard_reply(QueryCookie cookie) override { xcb_discard_reply(connection, cookie.sequence); }
+    // Bảng chuyển đổi của Xlib theo locale hiện tại; không chuyển được thì giữ nguyên dữ liệu thô
+    std::string text_to_utf8(const PropertyReply& reply) override {
+        XTextProperty text;
+        text.value = (unsigned char*)reply.value.data();
+        text.encoding = reply.type;
+        text.format = reply.format;
+        text.nitems = reply.value.size();
+        char** list = nullptr;
+        int count = 0;
+        if (Xutf8TextPropertyToTextList(display, &text, &list, &count) < Success || list == nullptr) return reply.value;
+        std::string result;
+        for (int i = 0; i < count; ++i) result += list[i];
+        XFreeStringList(list);
+        return result;
+    }
+};
+
+// Backend giả lập trong bộ nhớ. Các truy vấn được trả lời từ trạng thái giả lập nhưng vẫn được
+// đếm như round trip, nên ngân sách round trip cũng kiểm tra được khi chạy với mock.
+struct MockWindow {
+    int x = 0, y = 0;
+    unsigned int width = 1, height = 1;
+    unsigned int border = 0;
+    bool mapped = false;
+    std::vector<Atom> protocols;
+    std::string title;
+    std::unordered_map<Atom, PropertyReply> properties; // Các thuộc tính khác (WM_CLASS, WM_TRANSIENT_FOR, ...)
+};
+
+struct MockRequest {
+    const char* op;
+    Window window;
+    long a, b, c, d;
+};
+
+struct MockBackend : XBackend {
+    std::unordered_map<Window, MockWindow> windows;
+    std::vector<Window> stacking; // Thứ tự từ dưới lên trên
+    std::vector<XEvent> queue;
+    size_t queue_head = 0;
+    std::vector<MockRequest> requests;
+    bool record_requests = true; // Tắt khi benchmark để không tốn bộ nhớ
+    unsigned long serial = 1;
+    unsigned long flushed_through = 0; // Trả lời của các truy vấn đã flush coi như đã tới
+    Window focus = None;
+    bool structure_notify = false; // Sinh MapNotify/UnmapNotify/ConfigureNotify như X server (cần cho compositor)
+
+    void request(const char* op, Window window, long a = 0, long b = 0, long c = 0, long d = 0) {
+        ++serial;
+        if (record_requests) requests.push_back({op, window, a, b, c, d});
+    }
+
+    unsigned long next_request() override { return serial; }
+    bool pending() override { return queue_head < queue.size(); }
+    void flush() override { flushed_through = serial; }
+    void next_event(XEvent* event) override {
+        *event = queue[queue_head++];
+        if (queue_head == queue.size()) {
+            queue.clear();
+            queue_head = 0;
+        }
+    }
+
+    void select_input(Window window, long mask) override { request("SelectInput", window, mask); }
+    void set_border_width(Window window, unsigned int width) override {
+        request("SetBorderWidth", window, width);
+        windows[window].border = width;
+        configure_notify(window);
+    }
+    void set_border(Window window, unsigned long pixel) override { request("SetBorder", window, pixel); }
+    void map_window(Window window) override {
+        request("MapWindow", window);
+        MockWindow& w = windows[window];
+        if (structure_notify && !w.mapped) push(MapNotify, window).xmap.window = window;
+        w.mapped = true;
+    }
+    void unmap_window(Window window) override {
+        request("UnmapWindow", window);
+        MockWindow& w = windows[window];
+        if (structure_notify && w.mapped) push(UnmapNotify, window).xunmap.window = window;
+        w.mapped = false;
+    }
+    void move_window(Window window, int x, int y) override {
+        request("MoveWindow", window, x, y);
+        MockWindow& w = windows[window];
+        w.x = x;
+        w.y = y;
+        configure_notify(window);
+    }
+    void move_resize_window(Window window, int x, int y, unsigned int width, unsigned int height) override {
+        request("MoveResizeWindow", window, x, y, width, height);
+        MockWindow& w = windows[window];
+        w.x = x;
+        w.y = y;
+        w.width = width;
+        w.height = height;
+        configure_notify(window);
+    }
+    void configure_window(Window window, unsigned int value_mask, XWindowChanges* changes) override {
+        request("ConfigureWindow", window, value_mask, changes->x, changes->y, changes->width);
+        MockWindow& w = windows[window];
+        if (value_mask & CWX) w.x = changes->x;
+        if (value_mask & CWY) w.y = changes->y;
+        if (value_mask & CWWidth) w.width = changes->width;
+        if (value_mask & CWHeight) w.height = changes->height;
+        if (value_mask & CWStackMode) restack(window, (value_mask & CWSibling) ? changes->sibling : None, changes->stack_mode);
+        configure_notify(window);
+    }
+    // Chỉ hỗ trợ Above và Below; sibling không tồn tại thì X server báo lỗi và không đổi gì
+    void restack(Window window, Window sibling, int stack_mode) {
+        auto it = std::find(stacking.begin(), stacking.end(), window);
+        if (it == stacking.end() || sibling == window) return;
+        if (sibling != None && std::find(stacking.begin(), stacking.end(), sibling) == stacking.end()) return;
+        stacking.erase(it);
+        if (sibling == None) {
+            stacking.insert(stack_mode == Below ? stacking.begin() : stacking.end(), window);
+        } else {
+            auto position = std::find(stacking.begin(), stacking.end(), sibling);
+            stacking.insert(stack_mode == Below ? position : position + 1, window);
+        }
+    }
+    void raise_window(Window window) override {
+        request("RaiseWindow", window);
+        // Cửa sổ chưa tạo hoặc đã hủy thì X server báo BadWindow, thứ tự xếp chồng không đổi
+        auto it = std::find(stacking.begin(), stacking.end(), window);
+        if (it == stacking.end()) return;
+        stacking.erase(it);
+        stacking.push_back(window);
+        configure_notify(window);
+    }
+    void set_input_focus(Window window) override {
+        request("SetInputFocus", window);
+        focus = window;
+    }
+    void send_event(Window window, XEvent* event) override { request("SendEvent", window, event->type); }
+    void send_configure_notify(Window window, int x, int y, unsigned int width, unsigned int height, unsigned int) override {
+        request("ConfigureNotify", window, x, y, width, height);
+    }
+    void kill_client(Window window) override { request("KillClient", window); }
+    void set_atom_property(Window window, Atom property, const std::vector<Atom>& atoms) override {
+        request("ChangeProperty", window, property, atoms.size());
+        PropertyReply& reply = windows[window].properties[property];
+        reply.type = XA_ATOM;
+        reply.format = 32;
+        reply.value.clear();
+        for (Atom atom : atoms) {
+            uint32_t value = atom;
+            reply.value.append((const char*)&value, 4);
+        }
+    }
+    void grab_pointer(Window window) override { request("GrabPointer", window); }
+    void ungrab_pointer() override { request("UngrabPointer", None); }
+    void grab_keyboard(Window window) override { request("GrabKeyboard", window); }
+    void ungrab_keyboard() override { request("UngrabKeyboard", None); }
+    bool server_grabbed = false;
+    void grab_server() override {
+        request("GrabServer", None);
+        server_grabbed = true;
+    }
+    void ungrab_server() override {
+        request("UngrabServer", None);
+        server_grabbed = false;
+    }
+    void clear_window(Window window) override { request("ClearWindow", window); }
+    void draw_string(Window window, int x, int y, const std::string& text) override { request("DrawString", window, x, y, text.size()); }
+    void draw_outline(Window window, int x, int y, unsigned int width, unsigned int height) override {
+        request("DrawOutline", window, x, y, width, height);
+    }
+    XID next_alarm = 0x900000;
+    XID create_sync_alarm(XID counter, uint64_t value) override {
+        request("SyncCreateAlarm", counter, value);
+        return next_alarm++;
+    }
+    void set_sync_alarm(XID alarm, XID counter, uint64_t value) override { request("SyncChangeAlarm", alarm, counter, value); }
+    XID next_damage = 0xa00000;
+    std::unordered_map<Window, std::vector<XID>> damages; // Mỗi cửa sổ có thể có nhiều đối tượng damage
+    XID create_damage(Window window, int level) override {
+        request("DamageCreate", window, level);
+        damages[window].push_back(next_damage);
+        return next_damage++;
+    }
+    void destroy_damage(XID damage) override {
+        request("DamageDestroy", damage);
+        for (auto& entry : damages) {
+            entry.second.erase(std::remove(entry.second.begin(), entry.second.end(), damage), entry.second.end());
+        }
+    }
+    void subtract_damage(XID damage) override { request("DamageSubtract", damage); }
+    // Nội dung giả lập của mỗi cửa sổ là một màu đồng nhất suy ra từ ID, xem mock_window_pixel
+    std::vector<uint32_t> capture_buffer;
+    bool capture_window(Window window, const uint32_t*& pixels, int& width, int& height, int& stride) override {
+        request("CaptureWindow", window);
+        count_round_trip(2, 64);
+        auto it = windows.find(window);
+        if (it == windows.end() || !it->second.mapped || it->second.width == 0 || it->second.height == 0) return false;
+        // Mọi hàng giống nhau nên chỉ cần một hàng, dùng chung cho cả ảnh (stride 0)
+        width = it->second.width;
+        height = it->second.height;
+        stride = 0;
+        capture_buffer.assign(width, mock_window_pixel(window));
+        pixels = capture_buffer.data();
+        return true;
+    }
+    static uint32_t mock_window_pixel(Window window) { return 0xff000000 | (uint32_t)(window * 2654435761u >> 8); }
+    void put_image(Window window, int x, int y, int width, int height, const uint32_t*) override {
+        request("PutImage", window, x, y, width, height);
+    }
+    bool redirected = false;
+    std::vector<XRectangle> painted_region; // Vùng của khung vẽ gần nhất, để fuzz kiểm tra
+    bool outline_painted = false;           // Khung --outline có trong khung hình vẽ gần nhất không, và ở đâu
+    XRectangle painted_outline;
+    Window composite_start(Window) override {
+        request("CompositeStart", None);
+        redirected = true;
+        return 4;
+    }
+    void set_redirected(Window, bool value) override {
+        request(value ? "CompositeRedirect" : "CompositeUnredirect", None);
+        redirected = value;
+    }
+    void composite_track(Window window) override { request("CompositeTrack", window); }
+    void composite_forget(Window window, bool destroyed) override { request("CompositeForget", window, destroyed); }
+    void composite_paint(const std::vector<XRectangle>& region, const std::vector<CompositeLayer>& layers, const XRectangle* outline) override {
+        request("CompositePaint", None, region.size(), layers.size());
+        painted_region = region;
+        outline_painted = outline != nullptr;
+        if (outline != nullptr) painted_outline = *outline;
+    }
+
+    // Trả lời được tính ngay lúc gửi và giữ lại tới khi lấy bằng *_reply
+    std::unordered_map<unsigned int, GeometryReply> geometry_replies;
+    std::unordered_map<unsigned int, PropertyReply> property_replies;
+    std::unordered_map<unsigned int, std::vector<Window>> tree_replies;
+
+    QueryCookie get_geometry(Window window) override {
+        request("GetGeometry", window);
+        auto it = windows.find(window);
+        if (it != windows.end()) {
+            geometry_replies[serial] = { it->second.x, it->second.y, it->second.width, it->second.height };
+        }
+        return issued(serial);
+    }
+    QueryCookie get_property(Window window, Atom property, Atom type, long max_length) override {
+        request("GetProperty", window, property);
+        auto it = windows.find(window);
+        if (it != windows.end()) {
+            PropertyReply& reply = property_replies[serial];
+            if (property == WM_PROTOCOLS) {
+                reply.type = XA_ATOM;
+                reply.format = 32;
+                for (Atom atom : it->second.protocols) {
+                    uint32_t value = atom;
+                    reply.value.append((const char*)&value, 4);
+                }
+            } else if (property == NET_WM_NAME || property == XA_WM_NAME) {
+                reply.type = property == NET_WM_NAME ? UTF8_STRING : XA_STRING;
+                reply.format = 8;
+                reply.value = it->second.title.substr(0, max_length * 4);
+            }
+            if (it->second.properties.count(property)) {
+                reply = it->second.properties[property];
+            }
+            // Như X server: thuộc tính khác kiểu được hỏi thì chỉ trả về kiểu, không có dữ liệu
+            if (type != AnyPropertyType && reply.type != None && reply.type != type) {
+                reply.value.clear();
+            }
+        }
+        return issued(serial);
+    }
+    QueryCookie query_tree(Window window) override {
+        request("QueryTree", window);
+        tree_replies[serial] = stacking;
+        return issued(serial);
+    }
+
+    template <typename Reply>
+    bool take_reply(std::unordered_map<unsigned int, Reply>& replies, QueryCookie cookie, Reply& reply, uint64_t (*size)(const Reply&)) {
+        auto it = replies.find(cookie.sequence);
+        bool arrived = cookie.sequence <= flushed_through;
+        if (!arrived) flushed_through = serial; // Chờ trả lời thì mọi yêu cầu trước đó cũng được gửi đi
+        count_reply(cookie, it != replies.end() ? size(it->second) : 0, arrived);
+        if (it == replies.end()) return false;
+        reply = std::move(it->second);
+        replies.erase(it);
+        return true;
+    }
+    bool get_geometry_reply(QueryCookie cookie, GeometryReply& reply) override {
+        return take_reply<GeometryReply>(geometry_replies, cookie, reply, [](const GeometryReply&) -> uint64_t { return 12; });
+    }
+    bool get_property_reply(QueryCookie cookie, PropertyReply& reply) override {
+        return take_reply<PropertyReply>(property_replies, cookie, reply, [](const PropertyReply& r) -> uint64_t { return r.value.size(); });
+    }
+    bool query_tree_reply(QueryCookie cookie, std::vector<Window>& children) override {
+        return take_reply<std::vector<Window>>(tree_replies, cookie, children, [](const std::vector<Window>& c) -> uint64_t { return c.size() * 4; });
+    }
+    void discard_reply(QueryCookie cookie) override {
+        geometry_replies.erase(cookie.sequence);
+        property_replies.erase(cookie.sequence);
+        tree_replies.erase(cookie.sequence);
+    }
+    // Kịch bản chỉ dùng COMPOUND_TEXT thuần ASCII, phần đó giống hệt UTF-8
+    std::string text_to_utf8(const PropertyReply& reply) override { return reply.value; }
+
+    // Sinh sự kiện như một client thật sẽ gây ra
+    XEvent& push(int type, Window window) {
+        XEvent event;
+        memset(&event, 0, sizeof(event));
+        event.type = type;
+        event.xany.window = window;
+        queue.push_back(event);
+        return queue.back();
+    }
+    void create(Window root, Window window, int x, int y, int width, int height, bool supports_delete) {
+        // ID bị dùng lại: như một cửa sổ mới, chưa map và nằm trên cùng
+        stacking.erase(std::remove(stacking.begin(), stacking.end(), window), stacking.end());
+        MockWindow& w = windows[window];
+        w.mapped = false;
+        w.border = 0;
+        w.x = x;
+        w.y = y;
+        w.width = width;
+        w.height = height;
+        w.title = "mock-" + std::to_string(window);
+        if (supports_delete) w.protocols.push_back(WM_DELETE_WINDOW);
+        stacking.push_back(window);
+        XEvent& e = push(CreateNotify, root);
+        e.xcreatewindow.parent = root;
+        e.xcreatewindow.window = window;
+        e.xcreatewindow.x = x;
+        e.xcreatewindow.y = y;
+        e.xcreatewindow.width = width;
+        e.xcreatewindow.height = height;
+    }
+    void request_map(Window root, Window window) {
+        XEvent& e = push(MapRequest, root);
+        e.xmaprequest.parent = root;
+        e.xmaprequest.window = window;
+    }
+    void request_configure(Window root, Window window, int x, int y, int width, int height) {
+        XEvent& e = push(ConfigureRequest, root);
+        e.xconfigurerequest.parent = root;
+        e.xconfigurerequest.window = window;
+        e.xconfigurerequest.x = x;
+        e.xconfigurerequest.y = y;
+        e.xconfigurerequest.width = width;
+        e.xconfigurerequest.height = height;
+        e.xconfigurerequest.value_mask = CWX | CWY | CWWidth | CWHeight;
+    }
+    void enter(Window window) {
+        XEvent& e = push(EnterNotify, window);
+        e.xcrossing.window = window;
+    }
+    void motion(Window root, int x, int y) {
+        XEvent& e = push(MotionNotify, root);
+        e.xmotion.x_root = x;
+        e.xmotion.y_root = y;
+    }
+    void button(Window root, int type, Window subwindow, unsigned int button, int x, int y, unsigned int state = 0) {
+        XEvent& e = push(type, root);
+        e.xbutton.state = state;
+        e.xbutton.subwindow = subwindow;
+        e.xbutton.button = button;
+        e.xbutton.x_root = x;
+        e.xbutton.y_root = y;
+    }
+    void key(Window root, KeyCode keycode, unsigned int state, int type = KeyPress) {
+        XEvent& e = push(type, root);
+        e.xkey.keycode = keycode;
+        e.xkey.state = state;
+    }
+    // Client đã vẽ xong và tăng counter: alarm báo về như X server thật
+    void alarm_notify(XID alarm) {
+        XEvent& e = push(sync_event_base + XSyncAlarmNotify, None);
+        ((XSyncAlarmNotifyEvent*)&e)->alarm = alarm;
+    }
+    // Client vẽ lại một vùng của cửa sổ: X server báo qua từng đối tượng damage của cửa sổ đó
+    void damage_notify(Window window, int x, int y, int width, int height) {
+        for (XID damage : damages[window]) {
+            XEvent& e = push(damage_event_base + XDamageNotify, window);
+            XDamageNotifyEvent* notify = (XDamageNotifyEvent*)&e;
+            notify->drawable = window;
+            notify->damage = damage;
+            notify->area.x = x;
+            notify->area.y = y;
+            notify->area.width = width;
+            notify->area.height = height;
+        }
+    }
+    void configure_notify(Window window) {
+        if (!structure_notify) return;
+        const MockWindow& w = windows[window];
+        auto it = std::find(stacking.begin(), stacking.end(), window);
+        XEvent& e = push(ConfigureNotify, window);
+        e.xconfigure.window = window;
+        e.xconfigure.x = w.x;
+        e.xconfigure.y = w.y;
+        e.xconfigure.width = w.width;
+        e.xconfigure.height = w.height;
+        e.xconfigure.border_width = w.border;
+        e.xconfigure.above = (it == stacking.end() || it == stacking.begin()) ? None : *(it - 1);
+    }
+    void unmap(Window root, Window window) {
+        windows[window].mapped = false;
+        XEvent& e = push(UnmapNotify, root);
+        e.xunmap.event = root;
+        e.xunmap.window = window;
+    }
+    void destroy(Window root, Window window) {
+        windows.erase(window);
+        damages.erase(window);
+        stacking.erase(std::remove(stacking.begin(), stacking.end(), window), stacking.end());
+        XEvent& e = push(DestroyNotify, root);
+        e.xdestroywindow.event = root;
+        e.xdestroywindow.window = window;
+    }
+};
+
+void init_round_trip_budget() {
+    for (int type = 0; type < LASTEvent; ++type) {
+        round_trip_budget[type] = -1;
+    }
+    // Các đường xử lý nóng không được chờ X server
+    round_trip_budget[MapRequest] = 0;
+    round_trip_budget[ConfigureRequest] = 0;
+    round_trip_budget[EnterNotify] = 0;
+    round_trip_budget[MotionNotify] = 0;
+    const char* strict = getenv("NOTHINGWM_RT_STRICT");
+    round_trip_strict = strict != nullptr && strcmp(strict, "1") == 0;
+}
+
+void begin_dispatch(XBackend* backend, int type) {
+    current_event_type = (type >= 0 && type < LASTEvent) ? type : LASTEvent;
+    dispatch_round_trips = 0;
+    dispatch_first_request = backend->next_request();
+}
+
+void end_dispatch(XBackend* backend, Window window) {
+    RoundTripStats& stats = round_trip_stats[current_event_type];
+    ++stats.dispatches;
+    stats.requests += backend->next_request() - dispatch_first_request;
+    if (dispatch_round_trips > 1) {
+        if (stats.multi_blocking++ == 0) {
+            std::cerr << "Warning: " << event_type_name(current_event_type) << " handler blocked on the X server " << dispatch_round_trips << " times (window " << window << ")" << std::endl;
+        }
+    }
+    if (current_event_type < LASTEvent && round_trip_budget[current_event_type] >= 0 && dispatch_round_trips > round_trip_budget[current_event_type]) {
+        ++stats.budget_violations;
+        round_trip_budget_failed = true;
+        // Chỉ in ở lần vi phạm thứ 1, 2, 4, 8, ... để log không bị ngập
+        if ((stats.budget_violations & (stats.budget_violations - 1)) == 0) std::cerr << "Round-trip budget exceeded: " << event_type_name(current_event_type) << " made " << dispatch_round_trips
+                  << " round trips (budget " << round_trip_budget[current_event_type] << ", window " << window
+                  << ", " << stats.budget_violations << " violations so far)" << std::endl;
+    }
+    current_event_type = LASTEvent;
+}
+
+// Chạy một lệnh trong một process con mới
+void execute_command(const std::vector<std::string>& command_args) {
+    ScopedTraceSpan span("spawn", None);
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        std::vector<char*> argv_c;
+        for (const auto& arg : command_args) {
+            argv_c.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv_c.push_back(nullptr);
+
+        execvp(argv_c[0], argv_c.data());
+        std::cerr << "Error: Could not execute command: " << command_args[0] << std::endl;
+        _exit(1);
+    } else if (pid > 0) {
+        // Parent process
+    } else {
+        std::cerr << "Error: Could not create child process." << std::endl;
+    }
+}
+
+bool is_managed(Window window) {
+    return std::find(managed_windows.begin(), managed_windows.end(), window) != managed_windows.end();
+}
+
+// Đọc WM_NORMAL_HINTS dạng 32-bit: flags, 4 giá trị cũ bỏ qua, min, max, inc, aspect, base, gravity
+SizeHints parse_size_hints(const std::vector<uint32_t>& raw) {
+    SizeHints hints;
+    if (raw.size() < 15) return hints;
+    const uint32_t flags = raw[0];
+    auto value = [&](size_t i) { return std::max(0, (int)raw[i]); };
+    if (flags & PMinSize) {
+        hints.min_width = value(5);
+        hints.min_height = value(6);
+    }
+    if (flags & PMaxSize) {
+        hints.max_width = value(7);
+        hints.max_height = value(8);
+    }
+    if (flags & PResizeInc) {
+        hints.inc_width = value(9);
+        hints.inc_height = value(10);
+    }
+    // Tỉ lệ min lớn hơn max thì không kích thước nào thỏa mãn được, bỏ qua
+    if ((flags & PAspect) && value(12) > 0 && value(14) > 0 && (float)value(11) / value(12) <= (float)value(13) / value(14)) {
+        hints.min_aspect = (float)value(11) / value(12);
+        hints.max_aspect = (float)value(13) / value(14);
+    }
+    if ((flags & PBaseSize) && raw.size() >= 17) {
+        hints.base_width = value(15);
+        hints.base_height = value(16);
+    } else {
+        // ICCCM: không có base thì dùng min làm base, và ngược lại
+        hints.base_width = hints.min_width;
+        hints.base_height = hints.min_height;
+    }
+    if (!(flags & PMinSize)) {
+        hints.min_width = hints.base_width;
+        hints.min_height = hints.base_height;
+    }
+    return hints;
+}
+
+// Thu kích thước về giá trị gần nhất mà client chấp nhận, theo thứ tự của ICCCM 4.1.2.3: min, max, bước
+// tăng, rồi tỉ lệ (làm tròn theo bước tăng có thể lại làm lệch tỉ lệ nên được kiểm tra lại). Kết quả
+// không vượt quá limit_width x limit_height (0 = không giới hạn), thường là ô mà layout dành cho cửa sổ,
+// kể cả khi min lớn hơn ô. Áp dụng lại với chính kết quả làm giới hạn thì không đổi gì, nên client nhận
+// đúng kích thước nó muốn ngay lần đầu và không gửi ConfigureRequest để sửa lại.
+void apply_size_hints(const SizeHints& hints, int& width, int& height, int limit_width = 0, int limit_height = 0) {
+    width = std::max(width, hints.min_width);
+    height = std::max(height, hints.min_height);
+    if (hints.max_width > 0) width = std::min(width, hints.max_width);
+    if (hints.max_height > 0) height = std::min(height, hints.max_height);
+    if (limit_width > 0) width = std::min(width, limit_width);
+    if (limit_height > 0) height = std::min(height, limit_height);
+    auto round_width = [&]() {
+        if (hints.inc_width > 1 && width > hints.base_width) width -= (width - hints.base_width) % hints.inc_width;
+    };
+    auto round_height = [&]() {
+        if (hints.inc_height > 1 && height > hints.base_height) height -= (height - hints.base_height) % hints.inc_height;
+    };
+    round_width();
+    round_height();
+    width = std::max(1, width);
+    height = std::max(1, height);
+    // Cạnh quá dài so với tỉ lệ được thu lại. Làm tròn theo bước tăng có thể làm lệch tỉ lệ theo chiều kia
+    // nên phải kiểm tra lại; mỗi lần chỉ thu nhỏ một cạnh nên vòng lặp luôn dừng.
+    while (true) {
+        const int previous_width = width, previous_height = height;
+        if (hints.max_aspect > 0 && width > height * hints.max_aspect) {
+            width = std::max(1, (int)(height * hints.max_aspect));
+            round_width();
+        } else if (hints.min_aspect > 0 && width < height * hints.min_aspect) {
+            height = std::max(1, (int)(width / hints.min_aspect));
+            round_height();
+        }
+        if (width == previous_width && height == previous_height) break;
+    }
+}
+
+// Bộ đệm thuộc tính ICCCM/EWMH của từng client. Mọi thuộc tính được lấy trước ngay lúc CreateNotify:
+// cookie được gửi đi và flush ngay, X server trả lời trong lúc client còn đang chuẩn bị map, nên khi
+// MapRequest tới thì trả lời thường đã nằm sẵn trong bộ đệm và MapRequest không phải chờ round trip nào.
+// Sau đó mỗi thuộc tính chỉ được lấy lại khi có PropertyNotify cho đúng atom đó.
+enum PrefetchProperty {
+    PREFETCH_CLASS, PREFETCH_NAME, PREFETCH_NET_NAME, PREFETCH_HINTS, PREFETCH_NORMAL_HINTS,
+    PREFETCH_TRANSIENT_FOR, PREFETCH_WINDOW_TYPE, PREFETCH_PROTOCOLS,
+    PREFETCH_SYNC_COUNTER, PREFETCH_OPACITY, PREFETCH_STATE, PREFETCH_COUNT
+};
+const unsigned prefetch_all = (1u << PREFETCH_COUNT) - 1;
+struct Prefetch {
+    QueryCookie cookies[PREFETCH_COUNT];
+    unsigned pending = 0; // Bitmask các thuộc tính đã gửi truy vấn nhưng chưa lấy trả lời
+};
+std::unordered_map<Window, Prefetch> prefetches;
+bool size_hints_changed = false;
+
+// Thuộc tính tương ứng với một atom, -1 nếu WM không lưu thuộc tính này
+int prefetch_index(Atom atom) {
+    if (atom == XA_WM_CLASS) return PREFETCH_CLASS;
+    if (atom == XA_WM_NAME) return PREFETCH_NAME;
+    if (atom == NET_WM_NAME) return PREFETCH_NET_NAME;
+    if (atom == XA_WM_HINTS) return PREFETCH_HINTS;
+    if (atom == XA_WM_NORMAL_HINTS) return PREFETCH_NORMAL_HINTS;
+    if (atom == XA_WM_TRANSIENT_FOR) return PREFETCH_TRANSIENT_FOR;
+    if (atom == NET_WM_WINDOW_TYPE) return PREFETCH_WINDOW_TYPE;
+    if (atom == WM_PROTOCOLS) return PREFETCH_PROTOCOLS;
+    if (atom == NET_WM_SYNC_REQUEST_COUNTER) return PREFETCH_SYNC_COUNTER;
+    if (atom == NET_WM_WINDOW_OPACITY) return PREFETCH_OPACITY;
+    if (atom == NET_WM_STATE) return PREFETCH_STATE;
+    return -1;
+}
+
+void discard_prefetch(XBackend* backend, Window window) {
+    auto it = prefetches.find(window);
+    if (it == prefetches.end()) return;
+    for (int i = 0; i < PREFETCH_COUNT; ++i) {
+        if (it->second.pending & (1u << i)) backend->discard_reply(it->second.cookies[i]);
+    }
+    prefetches.erase(it);
+}
+
+// Gửi truy vấn cho các thuộc tính trong mask; truy vấn cũ của cùng thuộc tính (nếu còn) bị bỏ
+void prefetch_properties(XBackend* backend, Window window, unsigned mask = prefetch_all) {
+    Prefetch& prefetch = prefetches[window];
+    for (int i = 0; i < PREFETCH_COUNT; ++i) {
+        if (!(mask & (1u << i))) continue;
+        if (prefetch.pending & (1u << i)) backend->discard_reply(prefetch.cookies[i]);
+        QueryCookie& cookie = prefetch.cookies[i];
+        switch (i) {
+            case PREFETCH_CLASS: cookie = backend->get_property(window, XA_WM_CLASS, XA_STRING, 64); break;
+            // WM_NAME có thể là STRING, UTF8_STRING hoặc COMPOUND_TEXT: hỏi đúng một kiểu thì kiểu khác trả về rỗng
+            case PREFETCH_NAME: cookie = backend->get_property(window, XA_WM_NAME, AnyPropertyType, WMSTATE_TITLE_LEN); break;
+            case PREFETCH_NET_NAME: cookie = backend->get_property(window, NET_WM_NAME, UTF8_STRING, WMSTATE_TITLE_LEN); break;
+            case PREFETCH_HINTS: cookie = backend->get_property(window, XA_WM_HINTS, XA_WM_HINTS, 9); break;
+            case PREFETCH_NORMAL_HINTS: cookie = backend->get_property(window, XA_WM_NORMAL_HINTS, XA_WM_SIZE_HINTS, 18); break;
+            case PREFETCH_TRANSIENT_FOR: cookie = backend->get_property(window, XA_WM_TRANSIENT_FOR, XA_WINDOW, 1); break;
+            case PREFETCH_WINDOW_TYPE: cookie = backend->get_property(window, NET_WM_WINDOW_TYPE, XA_ATOM, 32); break;
+            case PREFETCH_PROTOCOLS: cookie = backend->get_property(window, WM_PROTOCOLS, XA_ATOM, 32); break;
+            case PREFETCH_SYNC_COUNTER: cookie = backend->get_property(window, NET_WM_SYNC_REQUEST_COUNTER, XA_CARDINAL, 1); break;
+            case PREFETCH_OPACITY: cookie = backend->get_property(window, NET_WM_WINDOW_OPACITY, XA_CARDINAL, 1); break;
+            case PREFETCH_STATE: cookie = backend->get_property(window, NET_WM_STATE, XA_ATOM, 32); break;
+        }
+    }
+    prefetch.pending |= mask;
+}
+
+// Thuộc tính văn bản sang UTF-8 theo kiểu thật của nó: STRING là Latin-1, UTF8_STRING giữ nguyên,
+// các kiểu khác (COMPOUND_TEXT) nhờ Xlib chuyển
+std::string text_property_to_utf8(XBackend* backend, const PropertyReply& reply) {
+    if (reply.format != 8 || reply.value.empty()) return "";
+    if (reply.type == UTF8_STRING) return reply.value;
+    if (reply.type == XA_STRING) {
+        std::string result;
+        for (unsigned char c : reply.value) {
+            if (c < 0x80) {
+                result += (char)c;
+            } else {
+                result += (char)(0xc0 | (c >> 6));
+                result += (char)(0x80 | (c & 0x3f));
+            }
+        }
+        return result;
+    }
+    return backend->text_to_utf8(reply);
+}
+
+// Lấy trả lời của các truy vấn đang chờ vào client. Cửa sổ chưa từng được prefetch (có từ trước
+// khi WM chạy) thì gửi mọi truy vấn ngay lúc này; chúng vẫn chỉ tốn chung một round trip.
+void load_properties(XBackend* backend, Window window, Client& client) {
+    auto it = prefetches.find(window);
+    if (it == prefetches.end()) {
+        prefetch_properties(backend, window);
+        it = prefetches.find(window);
+    }
+    Prefetch prefetch = it->second;
+    prefetches.erase(it);
+
+    for (int i = 0; i < PREFETCH_COUNT; ++i) {
+        if (!(prefetch.pending & (1u << i))) continue;
+        // Thuộc tính bị xóa hoặc cửa sổ không còn thì trả lời rỗng, giá trị cũ cũng bị xóa theo
+        PropertyReply reply;
+        backend->get_property_reply(prefetch.cookies[i], reply);
+        switch (i) {
+            case PREFETCH_CLASS: client.wm_class = reply.value; break;
+            case PREFETCH_NAME: client.wm_name = text_property_to_utf8(backend, reply); break;
+            case PREFETCH_NET_NAME: client.net_wm_name = reply.value; break;
+            case PREFETCH_HINTS: client.wm_hints = reply.values(); break;
+            case PREFETCH_NORMAL_HINTS:
+                client.size_hints = parse_size_hints(reply.values());
+                // Cửa sổ đã được xếp chỗ thì phải xếp lại theo ràng buộc mới
+                if (client.width > 0) size_hints_changed = true;
+                break;
+            case PREFETCH_TRANSIENT_FOR: {
+                std::vector<uint32_t> parent = reply.values();
+                client.transient_for = parent.empty() ? None : parent[0];
+                break;
+            }
+            case PREFETCH_WINDOW_TYPE: client.window_type = reply.atoms(); break;
+            case PREFETCH_PROTOCOLS: client.protocols = reply.atoms(); break;
+            case PREFETCH_SYNC_COUNTER: {
+                std::vector<uint32_t> counter = reply.values();
+                client.sync_counter = counter.empty() ? None : counter[0];
+                break;
+            }
+            case PREFETCH_OPACITY: {
+                std::vector<uint32_t> opacity = reply.values();
+                const uint32_t value = opacity.empty() ? 0xffffffff : opacity[0];
+                if (value != client.opacity && composite_enabled) comp_dirty_windows.push_back(window);
+                client.opacity = value;
+                break;
+            }
+            case PREFETCH_STATE: client.net_wm_state = reply.atoms(); break;
+        }
+    }
+    // Ưu tiên _NET_WM_NAME (UTF-8), nếu không có thì dùng WM_NAME
+    client.title = !client.net_wm_name.empty() ? client.net_wm_name : client.wm_name;
+    state_dirty = true;
+}
+
+// Client đã được quản lý, với mọi thuộc tính đang được làm mới đã lấy xong
+Client& client_properties(XBackend* backend, Window window) {
+    Client& client = clients[window];
+    if (prefetches.find(window) != prefetches.end()) {
+        load_properties(backend, window, client);
+    }
+    return client;
+}
+
+// Gửi yêu cầu đóng cửa sổ một cách lịch sự
+void close_window(XBackend* backend, Window window) {
+    // WM_PROTOCOLS của cửa sổ được quản lý đã có trong bộ đệm, chỉ hỏi X server với cửa sổ lạ
+    std::vector<Atom> protocols;
+    PropertyReply reply;
+    if (is_managed(window)) {
+        protocols = client_properties(backend, window).protocols;
+    } else if (backend->get_property_reply(backend->get_property(window, WM_PROTOCOLS, XA_ATOM, 32), reply)) {
+        protocols = reply.atoms();
+    }
+    bool delete_supported = std::find(protocols.begin(), protocols.end(), WM_DELETE_WINDOW) != protocols.end();
+    
+    if (delete_supported) {
+        XClientMessageEvent cm;
+        memset(&cm, 0, sizeof(cm));
+
+        cm.type = ClientMessage;
+        cm.window = window;
+        cm.message_type = WM_PROTOCOLS;
+        cm.format = 32;
+        cm.data.l[0] = WM_DELETE_WINDOW;
+        cm.data.l[1] = CurrentTime;
+
+        backend->send_event(window, (XEvent*)&cm);
+        std::cout << "Sent polite close request to window " << window << std::endl;
+    } else {
+        std::cerr << "Window " << window << " does not support WM_DELETE_WINDOW. Attempting forceful kill." << std::endl;
+        backend->kill_client(window);
+    }
+}
+
+// Chỉ mục không gian: màn hình được chia thành lưới ô grid_cell x grid_cell, mỗi ô giữ danh sách các cửa sổ
+// được quản lý (tiling và nổi) chạm vào nó. Được cập nhật mỗi khi vị trí hoặc kích thước của client thay đổi,
+// nên tìm cửa sổ dưới con trỏ hay cửa sổ kế bên theo một hướng chỉ phải xem vài ô thay vì mọi cửa sổ.
+const int grid_cell = 128;
+int grid_cols = 0, grid_rows = 0;
+std::vector<std::vector<Window>> grid_cells;
+
+std::vector<Window>& grid_at(int col, int row) {
+    return grid_cells[row * grid_cols + col];
+}
+
+void grid_remove(Window window, Client& client) {
+    for (int row = client.grid_row0; row <= client.grid_row1; ++row) {
+        for (int col = client.grid_col0; col <= client.grid_col1; ++col) {
+            std::vector<Window>& cell = grid_at(col, row);
+            auto it = std::find(cell.begin(), cell.end(), window);
+            if (it != cell.end()) {
+                *it = cell.back();
+                cell.pop_back();
+            }
+        }
+    }
+    client.grid_col1 = client.grid_row1 = -1;
+}
+
+// Các ô mà hình chữ nhật của client (kể cả viền) chạm tới; phần nằm ngoài màn hình thuộc về ô ở mép
+void grid_span(const Client& client, int& col0, int& row0, int& col1, int& row1) {
+    auto clamp_cell = [](int value, int count) { return std::max(0, std::min(count - 1, value / grid_cell)); };
+    col0 = clamp_cell(client.x, grid_cols);
+    row0 = clamp_cell(client.y, grid_rows);
+    col1 = clamp_cell(client.x + client.width + 2*border_width - 1, grid_cols);
+    row1 = clamp_cell(client.y + client.height + 2*border_width - 1, grid_rows);
+}
+
+void grid_update(Window window, Client& client) {
+    if (grid_cells.empty()) {
+        grid_cols = std::max(1, (screen_width + grid_cell - 1) / grid_cell);
+        grid_rows = std::max(1, (screen_height + grid_cell - 1) / grid_cell);
+        grid_cells.resize(grid_cols * grid_rows);
+    }
+    int col0, row0, col1, row1;
+    grid_span(client, col0, row0, col1, row1);
+    if (col0 == client.grid_col0 && row0 == client.grid_row0 && col1 == client.grid_col1 && row1 == client.grid_row1) return;
+    grid_remove(window, client);
+    for (int row = row0; row <= row1; ++row) {
+        for (int col = col0; col <= col1; ++col) {
+            grid_at(col, row).push_back(window);
+        }
+    }
+    client.grid_col0 = col0;
+    client.grid_row0 = row0;
+    client.grid_col1 = col1;
+    client.grid_row1 = row1;
+}
+
+// Cửa sổ được quản lý nằm trên cùng tại điểm (x, y) trên root, None nếu không có
+Window window_at(long x, long y) {
+    if (x < 0 || y < 0 || x >= screen_width || y >= screen_height) return None;
+    auto contains = [&](const Client& client) {
+        return x >= client.x && y >= client.y && x < client.x + client.width + 2*border_width && y < client.y + client.height + 2*border_width;
+    };
+    // Cửa sổ fullscreen che mọi thứ, trừ dialog của chính nó
+    if (fullscreen_window != None) {
+        for (auto it = floating_windows.rbegin(); it != floating_windows.rend(); ++it) {
+            const Client& client = clients[*it];
+            if (*it != fullscreen_window && client.transient_for == fullscreen_window && contains(client)) return *it;
+        }
+        return fullscreen_window;
+    }
+    if (grid_cells.empty()) return None;
+    // Trong monocle các cửa sổ tiling chồng lên nhau: cửa sổ tiling trên cùng là cửa sổ raise_client
+    // đưa lên sau cùng, không nhất thiết là cửa sổ đang focus
+    const Window top_tiled = current_layout == LAYOUT_MONOCLE ? top_tiled_window : focused_window;
+    Window best = None;
+    int best_rank = -1; // Cửa sổ nổi theo thứ tự xếp chồng, rồi tới cửa sổ tiling trên cùng, rồi các cửa sổ tiling khác
+    for (Window window : grid_at(x / grid_cell, y / grid_cell)) {
+        const Client& client = clients[window];
+        if (!contains(client)) continue;
+        int rank = 0;
+        if (client.floating) {
+            rank = 2 + (std::find(floating_windows.begin(), floating_windows.end(), window) - floating_windows.begin());
+        } else if (window == top_tiled) {
+            rank = 1;
+        }
+        if (rank > best_rank) {
+            best = window;
+            best_rank = rank;
+        }
+    }
+    return best;
+}
+
+enum Direction { DIR_LEFT, DIR_RIGHT, DIR_UP, DIR_DOWN };
+
+// Cửa sổ gần nhất theo một hướng, tính từ tâm cửa sổ from: tâm của nó phải nằm hẳn về hướng đó, điểm là
+// khoảng cách theo hướng cộng hai lần độ lệch theo chiều vuông góc. Duyệt từng dải ô từ gần ra xa và dừng
+// khi dải tiếp theo chắc chắn không thể cho điểm tốt hơn, nên chỉ xem các ô quanh from.
+Window window_in_direction(Window from, Direction direction, bool tiled_only) {
+    if (!is_managed(from) || grid_cells.empty()) return None;
+    const Client& origin = clients[from];
+    const int from_x = origin.x + origin.width / 2 + border_width;
+    const int from_y = origin.y + origin.height / 2 + border_width;
+    const bool horizontal = direction == DIR_LEFT || direction == DIR_RIGHT;
+    const int step = (direction == DIR_RIGHT || direction == DIR_DOWN) ? 1 : -1;
+    const int bands = horizontal ? grid_cols : grid_rows;
+    const int across = horizontal ? grid_rows : grid_cols;
+    const int from_pos = horizontal ? from_x : from_y;
+    const int start = std::max(0, std::min(bands - 1, from_pos / grid_cell));
+
+    Window best = None;
+    long best_score = 0;
+    for (int band = start; band >= 0 && band < bands; band += step) {
+        // Cửa sổ chỉ nằm từ dải này trở đi có tâm cách from ít nhất bằng khoảng tới mép gần của dải
+        if (best != None && band != start) {
+            long bound = step > 0 ? (long)band * grid_cell - from_pos : from_pos - (long)(band + 1) * grid_cell;
+            if (bound > best_score) break;
+        }
+        for (int i = 0; i < across; ++i) {
+            for (Window window : horizontal ? grid_at(band, i) : grid_at(i, band)) {
+                const Client& client = clients[window];
+                if (window == from || window == None || (tiled_only && client.floating)) continue;
+                const int x = client.x + client.width / 2 + border_width;
+                const int y = client.y + client.height / 2 + border_width;
+                const long along = step * (long)(horizontal ? x - from_x : y - from_y);
+                if (along <= 0) continue;
+                const long score = along + 2 * std::abs((long)(horizontal ? y - from_y : x - from_x));
+                if (best == None || score < best_score || (score == best_score && window < best)) {
+                    best = window;
+                    best_score = score;
+                }
+            }
+        }
+    }
+    return best;
+}
+
+// Đặt vị trí và kích thước cửa sổ, đồng thời ghi nhớ để công bố ra trang trạng thái
+void move_resize_client(XBackend* backend, Window window, int x, int y, int width, int height) {
+    backend->move_resize_window(window, x, y, width, height);
+    ++metrics.configures_sent;
+    Client& client = clients[window];
+    client.x = x;
+    client.y = y;
+    client.width = width;
+    client.height = height;
+    state_dirty = true;
+    snap_edges_dirty = true;
+    grid_update(window, client);
+}
+
+// Dựng lại mảng mép cho lần kéo cửa sổ moving (mép của chính nó không được tính)
+void build_snap_edges(Window moving) {
+    snap_edges_x = { 0, screen_width };
+    snap_edges_y = { statusbar_height, screen_height };
+    for (Window window : managed_windows) {
+        if (window == moving) continue;
+        const Client& client = clients[window];
+        snap_edges_x.push_back(client.x);
+        snap_edges_x.push_back(client.x + client.width + 2*border_width);
+        snap_edges_y.push_back(client.y);
+        snap_edges_y.push_back(client.y + client.height + 2*border_width);
+    }
+    for (std::vector<int>* edges : { &snap_edges_x, &snap_edges_y }) {
+        std::sort(edges->begin(), edges->end());
+        edges->erase(std::unique(edges->begin(), edges->end()), edges->end());
+    }
+    snap_edges_dirty = false;
+}
+
+// Độ dời nhỏ nhất đưa mép thấp (low) hoặc mép cao (high) của cửa sổ về một mép trong edges,
+// 0 nếu không có mép nào trong phạm vi snap_threshold
+int snap_offset(const std::vector<int>& edges, int low, int high) {
+    int best = snap_threshold + 1;
+    for (int edge : { low, high }) {
+        auto it = std::lower_bound(edges.begin(), edges.end(), edge);
+        if (it != edges.end() && *it - edge < std::abs(best)) best = *it - edge;
+        if (it != edges.begin() && edge - *(it - 1) < std::abs(best)) best = *(it - 1) - edge;
+    }
+    return std::abs(best) <= snap_threshold ? best : 0;
+}
+
+// Dialog của cửa sổ fullscreen là cửa sổ duy nhất được nằm trên nó
+bool is_fullscreen_dialog(Window window) {
+    auto it = clients.find(window);
+    return fullscreen_window != None && window != fullscreen_window && it != clients.end()
+           && it->second.floating && it->second.transient_for == fullscreen_window;
+}
+
+// Đưa cửa sổ lên trên cùng lớp của nó: cửa sổ nổi lên trên hết, cửa sổ tiling chỉ lên tới
+// ngay dưới cửa sổ nổi thấp nhất, nên dialog không bao giờ bị che. Khi có cửa sổ fullscreen,
+// nó và dialog của nó là lớp trên cùng; floating_windows luôn giữ đúng thứ tự xếp chồng thật.
+void raise_client(XBackend* backend, Window window) {
+    auto it = clients.find(window);
+    const bool floating = it != clients.end() && it->second.floating;
+    if (floating) {
+        floating_windows.erase(std::remove(floating_windows.begin(), floating_windows.end(), window), floating_windows.end());
+    }
+    XWindowChanges changes;
+    changes.stack_mode = Below;
+    if (window != None && window == fullscreen_window) {
+        if (floating) floating_windows.push_back(window);
+        std::stable_partition(floating_windows.begin(), floating_windows.end(), [](Window w) { return !is_fullscreen_dialog(w); });
+        backend->raise_window(window);
+        for (Window dialog : floating_windows) {
+            if (is_fullscreen_dialog(dialog)) backend->raise_window(dialog);
+        }
+    } else if (floating && fullscreen_window != None && !is_fullscreen_dialog(window)) {
+        // Lên trên các cửa sổ nổi khác nhưng vẫn dưới cửa sổ fullscreen
+        auto position = std::find_if(floating_windows.begin(), floating_windows.end(),
+                                     [](Window w) { return w == fullscreen_window || is_fullscreen_dialog(w); });
+        floating_windows.insert(position, window);
+        changes.sibling = fullscreen_window;
+        backend->configure_window(window, CWSibling | CWStackMode, &changes);
+    } else if (floating) {
+        floating_windows.push_back(window);
+        backend->raise_window(window);
+    } else {
+        if (it != clients.end()) top_tiled_window = window;
+        changes.sibling = floating_windows.empty() ? None : floating_windows.front();
+        if (fullscreen_window != None && (changes.sibling == None || is_fullscreen_dialog(changes.sibling))) {
+            changes.sibling = fullscreen_window;
+        }
+        if (changes.sibling != None) {
+            backend->configure_window(window, CWSibling | CWStackMode, &changes);
+        } else {
+            backend->raise_window(window);
+        }
+    }
+}
+
+// Dialog, splash và cửa sổ transient nằm trong lớp nổi
+bool wants_floating(const Client& client) {
+    if (client.transient_for != None) return true;
+    for (Atom type : client.window_type) {
+        if (type == NET_WM_WINDOW_TYPE_DIALOG || type == NET_WM_WINDOW_TYPE_SPLASH) return true;
+    }
+    return false;
+}
+
+// Đặt cửa sổ nổi ở giữa cửa sổ cha (hoặc giữa màn hình) với kích thước nó tự chọn.
+// Chỉ cửa sổ này bị đụng tới, các cửa sổ tiling giữ nguyên.
+void place_floating(XBackend* backend, Window window, Client& client) {
+    Geometry geometry;
+    auto requested = requested_geometry.find(window);
+    if (requested != requested_geometry.end()) {
+        geometry = requested->second;
+    } else {
+        // Cửa sổ có từ trước khi WM chạy: phải hỏi X server
+        GeometryReply reply;
+        backend->get_geometry_reply(backend->get_geometry(window), reply);
+        geometry = { reply.x, reply.y, (int)reply.width, (int)reply.height };
+    }
+    int width = geometry.width, height = geometry.height;
+    apply_size_hints(client.size_hints, width, height, screen_width - 2*border_width, screen_height - statusbar_height - 2*border_width);
+
+    int area_x = 0, area_y = statusbar_height, area_width = screen_width, area_height = screen_height - statusbar_height;
+    auto parent = clients.find(client.transient_for);
+    if (parent != clients.end() && parent->first != window) {
+        area_x = parent->second.x;
+        area_y = parent->second.y;
+        area_width = parent->second.width + 2*border_width;
+        area_height = parent->second.height + 2*border_width;
+    }
+    int x = area_x + (area_width - width - 2*border_width) / 2;
+    int y = area_y + (area_height - height - 2*border_width) / 2;
+    x = std::max(0, std::min(x, screen_width - width - 2*border_width));
+    y = std::max(statusbar_height, std::min(y, screen_height - height - 2*border_width));
+    move_resize_client(backend, window, x, y, width, height);
+    raise_client(backend, window);
+}
+
+// Đặt cửa sổ vào một ô của layout, thu nhỏ theo WM_NORMAL_HINTS nhưng không bao giờ tràn ra ngoài ô.
+// Trả về kích thước thật đã dùng (kể cả viền) để phần còn thừa của ô được nhường cho các cửa sổ kế bên.
+void place_client(XBackend* backend, Window window, int x, int y, int cell_width, int cell_height, int& used_width, int& used_height) {
+    int width = std::max(1, cell_width - 2*border_width);
+    int height = std::max(1, cell_height - 2*border_width);
+    apply_size_hints(clients[window].size_hints, width, height, width, height);
+    move_resize_client(backend, window, x, y, width, height);
+    used_width = width + 2*border_width;
+    used_height = height + 2*border_width;
+}
+
+// Hàm tiling chính. Mỗi cửa sổ nhận kích thước đã thỏa size hints ngay lần đầu, nên một lần
+// relayout là xong, không có vòng ConfigureRequest qua lại với client.
+void tile_windows(XBackend* backend) {
+    // Các cửa sổ tiling đang bị cửa sổ fullscreen che hết: không gửi gì, xếp lại một lần khi thoát fullscreen
+    if (fullscreen_window != None) {
+        relayout_pending = true;
+        return;
+    }
+    relayout_pending = false;
+    std::vector<Window> tiled;
+    for (Window window : managed_windows) {
+        if (!clients[window].floating) tiled.push_back(window);
+    }
+    if (tiled.empty()) return;
+    ScopedTraceSpan span("relayout", None);
+    ++metrics.relayouts;
+
+    const int num_windows = tiled.size();
+    const int area_height = screen_height - statusbar_height;
+    int used_width, used_height;
+
+    if (num_windows == 1 || current_layout == LAYOUT_MONOCLE) {
+        // Chế độ monocle: mọi cửa sổ chiếm toàn bộ màn hình, cửa sổ đang focus nằm trên cùng
+        for (int i = 0; i < num_windows; ++i) {
+            place_client(backend, tiled[i], 0, statusbar_height, screen_width, area_height, used_width, used_height);
+        }
+        if (num_windows > 1) {
+            // Cửa sổ tiling được focus lên trên; nếu focus đang ở lớp nổi thì giữ cửa sổ tiling đang hiện
+            Window top = focused_window;
+            if (!is_managed(top) || clients[top].floating) top = top_tiled_window;
+            if (!is_managed(top) || clients[top].floating) top = tiled.back();
+            raise_client(backend, top);
+        }
+        return;
+    }
+
+    // Chiều rộng mà cửa sổ chính không dùng hết (ví dụ vì max size hoặc bước tăng) được nhường cho cột bên phải
+    place_client(backend, tiled[0], 0, statusbar_height, screen_width * master_ratio, area_height, used_width, used_height);
+    const int stack_x = used_width;
+    const int stack_width = screen_width - stack_x;
+
+    // Chiều cao thừa của mỗi ô được chia đều cho các cửa sổ còn lại bên dưới. Khi cột phụ hết chỗ, các cửa
+    // sổ còn lại chồng lên ô cuối cùng thay vì thành những cửa sổ cao 1 px.
+    int y = statusbar_height;
+    int remaining_height = area_height;
+    int last_y = y, last_height = area_height;
+    for (int i = 1; i < num_windows; ++i) {
+        const int cell_height = remaining_height / (num_windows - i);
+        if (cell_height <= 2*border_width) {
+            place_client(backend, tiled[i], stack_x, last_y, stack_width, last_height, used_width, used_height);
+            continue;
+        }
+        place_client(backend, tiled[i], stack_x, y, stack_width, cell_height, used_width, used_height);
+        last_y = y;
+        last_height = cell_height;
+        y += used_height;
+        remaining_height -= used_height;
+    }
+}
+
+// Gọi sau khi xử lý hết một đợt sự kiện: các thuộc tính được làm mới do PropertyNotify trong đợt
+// đó được lấy về cùng lúc, một round trip cho cả đợt thay vì một cho mỗi PropertyNotify
+void refresh_properties(XBackend* backend) {
+    std::vector<Window> windows;
+    for (const auto& entry : prefetches) {
+        if (is_managed(entry.first)) windows.push_back(entry.first);
+    }
+    for (Window window : windows) {
+        load_properties(backend, window, clients[window]);
+    }
+    if (size_hints_changed) {
+        size_hints_changed = false;
+        tile_windows(backend);
+    }
+}
+
+// Hàm đặt màu viền cho cửa sổ
+void set_window_border(XBackend* backend, Window window, bool is_focused) {
+    if (is_focused) {
+        backend->set_border(window, focused_border_color);
+    } else {
+        backend->set_border(window, unfocused_border_color);
+    }
+}
+
+// Lấy lại nội dung thanh taskbar từ thuộc tính _NET_WM_NAME của cửa sổ gốc, chỉ khi nó thay đổi
+void update_status_text(XBackend* backend, Window root_window) {
+    PropertyReply reply;
+    backend->get_property_reply(backend->get_property(root_window, NET_WM_NAME, UTF8_STRING, 1024), reply);
+    status_text = reply.value;
+}
+
+// Hàm vẽ lại thanh taskbar
+void draw_statusbar(XBackend* backend) {
+    ScopedTraceSpan span("statusbar", statusbar_window);
+    backend->clear_window(statusbar_window);
+    if (!status_text.empty()) {
+        backend->draw_string(statusbar_window, 5, 15, status_text);
+    }
+}
+
+// Đưa một sự kiện vào ring của từng subscriber. Không bao giờ chặn: khi ring đầy thì
+// sự kiện cũ nhất bị bỏ, và các sự kiện trạng thái (focus, layout) liên tiếp được gộp lại.
+void ipc_emit(IpcEventKind kind, unsigned long value) {
+    for (auto& client : ipc_clients) {
+        if (client.closed || !(client.subscriptions & (1u << kind))) continue;
+        if (client.ring_count > 0 && (kind == EVENT_FOCUS || kind == EVENT_LAYOUT)) {
+            IpcEvent& newest = client.ring[(client.ring_head + client.ring_count - 1) % ipc_event_ring_size];
+            if (newest.kind == kind) {
+                newest.value = value;
+                continue;
+            }
+        }
+        if (client.ring_count == ipc_event_ring_size) {
+            client.ring_head = (client.ring_head + 1) % ipc_event_ring_size;
+            --client.ring_count;
+            ++client.dropped;
+            ++metrics.events_dropped;
+        }
+        client.ring[(client.ring_head + client.ring_count) % ipc_event_ring_size] = {kind, value};
+        ++client.ring_count;
+    }
+}
+
+void mru_unlink(Client& client) {
+    if (!client.in_mru) return;
+    (client.mru_prev != nullptr ? client.mru_prev->mru_next : mru_head) = client.mru_next;
+    (client.mru_next != nullptr ? client.mru_next->mru_prev : mru_tail) = client.mru_prev;
+    client.mru_prev = client.mru_next = nullptr;
+    client.in_mru = false;
+}
+
+// Cửa sổ vừa được focus lên đầu lịch sử
+void mru_push_front(Client& client) {
+    mru_unlink(client);
+    client.mru_next = mru_head;
+    (mru_head != nullptr ? mru_head->mru_prev : mru_tail) = &client;
+    mru_head = &client;
+    client.in_mru = true;
+}
+
+// Cửa sổ mới được quản lý nhưng chưa từng được focus nằm ở cuối lịch sử
+void mru_push_back(Client& client) {
+    mru_unlink(client);
+    client.mru_prev = mru_tail;
+    (mru_tail != nullptr ? mru_tail->mru_next : mru_head) = &client;
+    mru_tail = &client;
+    client.in_mru = true;
+}
+
+// Chuyển focus sang một cửa sổ và cập nhật màu viền
+void focus_window(XBackend* backend, Window window) {
+    if (focused_window != None && focused_window != window) {
+        set_window_border(backend, focused_window, false);
+    }
+    backend->set_input_focus(window);
+    set_window_border(backend, window, true);
+    focused_window = window;
+    state_dirty = true;
+    if (is_managed(window)) {
+        mru_push_front(clients[window]);
+    }
+    if (current_layout == LAYOUT_MONOCLE) {
+        raise_client(backend, window);
+    }
+    ipc_emit(EVENT_FOCUS, window);
+}
+
+// Chuyển cửa sổ giữa lớp tiling và lớp nổi (kéo chuột hoặc Super+Space). Cửa sổ chuyển sang
+// nổi giữ nguyên vị trí và kích thước hiện tại; chỉ các cửa sổ tiling được sắp xếp lại.
+void set_floating(XBackend* backend, Window window, bool floating) {
+    Client& client = clients[window];
+    if (client.floating == floating) return;
+    client.floating = floating;
+    if (!floating) {
+        floating_windows.erase(std::remove(floating_windows.begin(), floating_windows.end(), window), floating_windows.end());
+    }
+    // Cửa sổ chuyển lớp: lên đầu lớp nổi, hoặc xuống dưới lớp nổi (và dưới cửa sổ fullscreen)
+    raise_client(backend, window);
+    state_dirty = true;
+    tile_windows(backend);
+}
+
+// Thêm một hình chữ nhật (tọa độ root) vào vùng cần vẽ lại ở khung sau, cắt theo màn hình
+void comp_add_damage(int x, int y, int width, int height) {
+    const int x0 = std::max(0, x), y0 = std::max(0, y);
+    const int x1 = std::min(screen_width, x + width), y1 = std::min(screen_height, y + height);
+    if (x0 >= x1 || y0 >= y1) return;
+    if (comp_damage.size() < comp_damage_max_rects) {
+        comp_damage.push_back({ (short)x0, (short)y0, (unsigned short)(x1 - x0), (unsigned short)(y1 - y0) });
+        return;
+    }
+    // Quá nhiều mảnh nhỏ: vẽ lại hình chữ nhật bao của tất cả sẽ rẻ hơn gửi từng mảnh
+    int bx0 = x0, by0 = y0, bx1 = x1, by1 = y1;
+    for (const XRectangle& r : comp_damage) {
+        bx0 = std::min<int>(bx0, r.x);
+        by0 = std::min<int>(by0, r.y);
+        bx1 = std::max<int>(bx1, r.x + r.width);
+        by1 = std::max<int>(by1, r.y + r.height);
+    }
+    comp_damage.assign(1, { (short)bx0, (short)by0, (unsigned short)(bx1 - bx0), (unsigned short)(by1 - by0) });
+}
+
+// Vùng màn hình của bốn cạnh khung, để compositor vẽ lại đúng chỗ khung hiện ra hoặc biến mất
+void comp_damage_outline(int x, int y, int width, int height) {
+    comp_add_damage(x, y, width, outline_line_width);
+    comp_add_damage(x, y + height - outline_line_width, width, outline_line_width);
+    comp_add_damage(x, y, outline_line_width, height);
+    comp_add_damage(x + width - outline_line_width, y, outline_line_width, height);
+}
+
+void hide_outline(XBackend* backend, Window root_window) {
+    if (!outline_shown) return;
+    if (outline_composited) {
+        comp_damage_outline(outline_x, outline_y, outline_width, outline_height);
+    } else {
+        backend->draw_outline(root_window, outline_x, outline_y, outline_width, outline_height);
+        backend->ungrab_server();
+    }
+    outline_shown = false;
+}
+
+// Vẽ khung ở vị trí và kích thước mới (chưa tính viền). Khi compositor đang vẽ màn hình, root nằm dưới
+// overlay nên khung được vẽ vào back buffer ở khung hình sau. Nếu không thì khung được vẽ XOR lên root:
+// xóa khung cũ bằng cách vẽ lại nó. Server bị grab suốt lúc khung XOR còn trên màn hình, vì client vẽ lại
+// vào giữa hai lần vẽ sẽ làm lần XOR xóa để lại rác.
+void show_outline(XBackend* backend, Window root_window, int x, int y, int width, int height) {
+    width += 2*border_width;
+    height += 2*border_width;
+    const bool composited = composite_enabled && composite_redirected;
+    if (outline_shown && composited != outline_composited) {
+        hide_outline(backend, root_window);
+    }
+    if (outline_shown) {
+        if (x == outline_x && y == outline_y && width == outline_width && height == outline_height) return;
+        if (composited) {
+            comp_damage_outline(outline_x, outline_y, outline_width, outline_height);
+        } else {
+            backend->draw_outline(root_window, outline_x, outline_y, outline_width, outline_height);
+        }
+    } else if (!composited) {
+        backend->grab_server();
+    }
+    if (composited) {
+        comp_damage_outline(x, y, width, height);
+    } else {
+        backend->draw_outline(root_window, x, y, width, height);
+    }
+    outline_x = x;
+    outline_y = y;
+    outline_width = width;
+    outline_height = height;
+    outline_shown = true;
+    outline_composited = composited;
+}
+
+// Cửa sổ đang bị kéo hoặc thay đổi kích thước không còn kéo được nữa: kết thúc thao tác, ButtonRelease sẽ thả grab
+void cancel_drag(XBackend* backend, Window root_window, Window window) {
+    if (current_moving_window == window || current_resizing_window == window) {
+        hide_outline(backend, root_window);
+    }
+    if (current_moving_window == window) {
+        is_moving = false;
+        current_moving_window = None;
+    }
+    if (current_resizing_window == window) {
+        is_resizing = false;
+        current_resizing_window = None;
+        sync_waiting = false;
+    }
+}
+
+// Ghi lại _NET_WM_STATE của client với trạng thái fullscreen hiện tại, giữ nguyên các trạng thái khác
+void write_net_wm_state(XBackend* backend, Window window, Client& client) {
+    std::vector<Atom>& state = client.net_wm_state;
+    state.erase(std::remove(state.begin(), state.end(), NET_WM_STATE_FULLSCREEN), state.end());
+    if (client.fullscreen) state.push_back(NET_WM_STATE_FULLSCREEN);
+    backend->set_atom_property(window, NET_WM_STATE, state);
+}
+
+// Trả cửa sổ fullscreen về như cũ: viền, vị trí đã lưu (cửa sổ nổi) hoặc ô trong layout (cửa sổ tiling)
+void leave_fullscreen(XBackend* backend, Window window) {
+    Client& client = clients[window];
+    client.fullscreen = false;
+    backend->set_border_width(window, border_width);
+    if (client.floating) {
+        move_resize_client(backend, window, client.saved_x, client.saved_y, client.saved_width, client.saved_height);
+    } else {
+        relayout_pending = true;
+    }
+    write_net_wm_state(backend, window, client);
+}
+
+// EWMH _NET_WM_STATE_FULLSCREEN: cửa sổ phủ cả màn hình, không viền, nằm trên thanh taskbar. Mỗi lúc chỉ có
+// một cửa sổ fullscreen; cửa sổ fullscreen cũ được trả về chỗ mà các cửa sổ tiling vẫn chưa bị xếp lại.
+// Với --composite, cửa sổ này là cửa sổ trên cùng phủ kín màn hình nên compositor tự bỏ qua nó.
+void set_fullscreen(XBackend* backend, Window root_window, Window window, bool fullscreen) {
+    if (window == None) return; // None là giá trị "không có cửa sổ fullscreen"
+    Client& client = clients[window];
+    if (client.fullscreen == fullscreen) return;
+    if (fullscreen) {
+        const Window previous = fullscreen_window;
+        fullscreen_window = window;
+        if (previous != None) {
+            leave_fullscreen(backend, previous);
+        }
+        cancel_drag(backend, root_window, window);
+        client.fullscreen = true;
+        client.saved_x = client.x;
+        client.saved_y = client.y;
+        client.saved_width = client.width;
+        client.saved_height = client.height;
+        backend->set_border_width(window, 0);
+        move_resize_client(backend, window, 0, 0, screen_width, screen_height);
+        raise_client(backend, window);
+        // Cửa sổ fullscreen cũ về lại lớp của nó, dưới cửa sổ fullscreen mới
+        if (is_managed(previous)) raise_client(backend, previous);
+        write_net_wm_state(backend, window, client);
+    } else {
+        fullscreen_window = None;
+        leave_fullscreen(backend, window);
+        raise_client(backend, window);
+    }
+    state_dirty = true;
+    if (relayout_pending) {
+        tile_windows(backend);
+    }
+}
+
+// Gửi kích thước mới nhất cho cửa sổ đang được thay đổi kích thước. Với client hỗ trợ sync, kèm theo
+// một _NET_WM_SYNC_REQUEST và đặt alarm để biết khi nào client vẽ xong kích thước này.
+void send_resize(XBackend* backend) {
+    const Window window = current_resizing_window;
+    // Áp size hints lúc gửi chứ không phải lúc chuột di chuyển, vì chúng có thể đổi trong lúc chờ client
+    if (is_managed(window)) {
+        apply_size_hints(clients[window].size_hints, resize_width, resize_height);
+    }
+    if (resize_width == resize_sent_width && resize_height == resize_sent_height) return;
+    if (resize_sync) {
+        const Client& client = clients[window];
+        ++sync_serial;
+        XEvent message;
+        memset(&message, 0, sizeof(message));
+        message.xclient.type = ClientMessage;
+        message.xclient.window = window;
+        message.xclient.message_type = WM_PROTOCOLS;
+        message.xclient.format = 32;
+        message.xclient.data.l[0] = NET_WM_SYNC_REQUEST;
+        message.xclient.data.l[1] = CurrentTime;
+        message.xclient.data.l[2] = sync_serial & 0xffffffff;
+        message.xclient.data.l[3] = sync_serial >> 32;
+        backend->send_event(window, &message);
+        if (resize_alarm == None) {
+            resize_alarm = backend->create_sync_alarm(client.sync_counter, sync_serial);
+        } else {
+            backend->set_sync_alarm(resize_alarm, client.sync_counter, sync_serial);
+        }
+        sync_waiting = true;
+    }
+    if (is_managed(window)) {
+        move_resize_client(backend, window, start_win_x, start_win_y, resize_width, resize_height);
+    } else {
+        backend->move_resize_window(window, start_win_x, start_win_y, resize_width, resize_height);
+        ++metrics.configures_sent;
+    }
+    resize_sent_width = resize_width;
+    resize_sent_height = resize_height;
+    resize_sent_ns = monotonic_ns();
+}
+
+// Gửi kích thước đang chờ nếu client đã sẵn sàng: client sync phải vẽ xong kích thước trước
+// (hoặc quá hạn sync_timeout_ns), client khác theo nhịp resize_interval_ns
+void pump_resize(XBackend* backend) {
+    if (!is_resizing || outline_mode || (resize_width == resize_sent_width && resize_height == resize_sent_height)) return;
+    const uint64_t elapsed = monotonic_ns() - resize_sent_ns;
+    if (resize_sync ? (sync_waiting && elapsed < sync_timeout_ns) : elapsed < resize_interval_ns) return;
+    send_resize(backend);
+}
+
+// Thời gian vòng lặp chính được ngủ trong poll() trước khi pump_resize phải chạy lại (-1 = không giới hạn)
+int resize_poll_timeout() {
+    if (!is_resizing || outline_mode || (resize_width == resize_sent_width && resize_height == resize_sent_height)) return -1;
+    const uint64_t due = resize_sent_ns + (resize_sync ? sync_timeout_ns : resize_interval_ns);
+    const uint64_t now = monotonic_ns();
+    return due > now ? (int)((due - now) / 1000000) + 1 : 0;
+}
+
+// Cộng từng kênh 8-bit của một hàng pixel vào bộ tích lũy 32-bit (4 phần tử mỗi pixel). Đây là phần tốn
+// nhất khi thu nhỏ vì mọi pixel nguồn đều đi qua, nên có bản SSE2 (4 pixel mỗi vòng) và AVX2 (8 pixel).
+void accumulate_row_scalar(const uint32_t* row, uint32_t* acc, int width) {
+    const uint8_t* bytes = (const uint8_t*)row;
+    for (int i = 0; i < width * 4; ++i) {
+        acc[i] += bytes[i];
+    }
+}
+
+#if defined(__SSE2__)
+void accumulate_row_sse2(const uint32_t* row, uint32_t* acc, int width) {
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(row + x));
+        __m128i low = _mm_unpacklo_epi8(pixels, zero);  // Pixel 0, 1 thành 16-bit
+        __m128i high = _mm_unpackhi_epi8(pixels, zero); // Pixel 2, 3
+        __m128i* a = (__m128i*)(acc + 4 * x);
+        _mm_storeu_si128(a + 0, _mm_add_epi32(_mm_loadu_si128(a + 0), _mm_unpacklo_epi16(low, zero)));
+        _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1), _mm_unpackhi_epi16(low, zero)));
+        _mm_storeu_si128(a + 2, _mm_add_epi32(_mm_loadu_si128(a + 2), _mm_unpacklo_epi16(high, zero)));
+        _mm_storeu_si128(a + 3, _mm_add_epi32(_mm_loadu_si128(a + 3), _mm_unpackhi_epi16(high, zero)));
+    }
+    accumulate_row_scalar(row + x, acc + 4 * x, width - x);
+}
+
+__attribute__((target("avx2")))
+void accumulate_row_avx2(const uint32_t* row, uint32_t* acc, int width) {
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i first = _mm_loadu_si128((const __m128i*)(row + x));
+        __m128i second = _mm_loadu_si128((const __m128i*)(row + x + 4));
+        __m256i* a = (__m256i*)(acc + 4 * x);
+        // Mỗi lần mở rộng 2 pixel (8 byte) thành 8 giá trị 32-bit
+        _mm256_storeu_si256(a + 0, _mm256_add_epi32(_mm256_loadu_si256(a + 0), _mm256_cvtepu8_epi32(first)));
+        _mm256_storeu_si256(a + 1, _mm256_add_epi32(_mm256_loadu_si256(a + 1), _mm256_cvtepu8_epi32(_mm_srli_si128(first, 8))));
+        _mm256_storeu_si256(a + 2, _mm256_add_epi32(_mm256_loadu_si256(a + 2), _mm256_cvtepu8_epi32(second)));
+        _mm256_storeu_si256(a + 3, _mm256_add_epi32(_mm256_loadu_si256(a + 3), _mm256_cvtepu8_epi32(_mm_srli_si128(second, 8))));
+    }
+    accumulate_row_sse2(row + x, acc + 4 * x, width - x);
+}
+#endif
+
+// Chọn bản nhanh nhất mà CPU hỗ trợ, một lần lúc dùng đầu tiên
+void (*select_accumulate_row())(const uint32_t*, uint32_t*, int) {
+#if defined(__SSE2__)
+    if (__builtin_cpu_supports("avx2")) return accumulate_row_avx2;
+    return accumulate_row_sse2;
+#else
+    return accumulate_row_scalar;
+#endif
+}
+
+// Trung bình của các cột [col0, col1) trong bộ tích lũy, đóng gói lại thành một pixel
+inline uint32_t average_columns(const uint32_t* acc, int col0, int col1, uint32_t area) {
+#if defined(__SSE2__)
+    __m128i sum = _mm_setzero_si128();
+    for (int col = col0; col < col1; ++col) {
+        sum = _mm_add_epi32(sum, _mm_loadu_si128((const __m128i*)(acc + 4 * col)));
+    }
+    __m128i average = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(sum), _mm_set1_ps(1.0f / area)));
+    average = _mm_packs_epi32(average, average);
+    return _mm_cvtsi128_si32(_mm_packus_epi16(average, average));
+#else
+    uint32_t sum[4] = { 0, 0, 0, 0 };
+    for (int col = col0; col < col1; ++col) {
+        for (int c = 0; c < 4; ++c) sum[c] += acc[4 * col + c];
+    }
+    uint32_t pixel = 0;
+    for (int c = 0; c < 4; ++c) {
+        pixel |= ((sum[c] + area / 2) / area) << (8 * c);
+    }
+    return pixel;
+#endif
+}
+
+// Thu nhỏ bằng bộ lọc hộp: mỗi pixel đích là trung bình của khối pixel nguồn mà nó phủ. Các hàng nguồn
+// của một hàng đích được cộng dồn trước (theo chiều dọc), rồi mới cộng theo chiều ngang.
+void downscale_box(const uint32_t* src, int src_width, int src_height, int src_stride,
+                   uint32_t* dst, int dst_width, int dst_height) {
+    static void (*accumulate_row)(const uint32_t*, uint32_t*, int) = select_accumulate_row();
+    static std::vector<uint32_t> acc;
+    static std::vector<int> column_start;
+    acc.resize((size_t)src_width * 4);
+    column_start.resize(dst_width + 1);
+    for (int x = 0; x <= dst_width; ++x) {
+        column_start[x] = (int)((int64_t)x * src_width / dst_width);
+    }
+    for (int y = 0; y < dst_height; ++y) {
+        const int row0 = (int)((int64_t)y * src_height / dst_height);
+        const int row1 = std::max(row0 + 1, (int)((int64_t)(y + 1) * src_height / dst_height));
+        std::fill(acc.begin(), acc.end(), 0);
+        for (int row = row0; row < row1; ++row) {
+            accumulate_row(src + (size_t)row * src_stride, acc.data(), src_width);
+        }
+        for (int x = 0; x < dst_width; ++x) {
+            const int col0 = column_start[x];
+            const int col1 = std::max(col0 + 1, column_start[x + 1]);
+            dst[(size_t)y * dst_width + x] = average_columns(acc.data(), col0, col1, (uint32_t)(col1 - col0) * (row1 - row0));
+        }
+    }
+}
+
+// Làm mới ảnh thu nhỏ của một client, chỉ chụp lại khi cửa sổ đã vẽ lại kể từ lần chụp trước.
+// Damage được trừ trước khi chụp, nên lần vẽ nào sau lúc chụp cũng sẽ báo DamageNotify.
+void update_thumbnail(XBackend* backend, Client& client) {
+    if (!client.thumbnail_stale && !client.thumbnail.empty()) return;
+    if (client.damage != None) {
+        backend->subtract_damage(client.damage);
+    }
+    const uint32_t* pixels;
+    int width, height, stride;
+    if (!backend->capture_window(client.window, pixels, width, height, stride)) {
+        return; // Giữ ảnh cũ (nếu có), thử lại lần sau
+    }
+    const double scale = std::min(1.0, std::min((double)thumbnail_max_width / width, (double)thumbnail_max_height / height));
+    client.thumbnail_width = std::max(1, (int)(width * scale));
+    client.thumbnail_height = std::max(1, (int)(height * scale));
+    client.thumbnail.resize((size_t)client.thumbnail_width * client.thumbnail_height);
+    downscale_box(pixels, width, height, stride, client.thumbnail.data(), client.thumbnail_width, client.thumbnail_height);
+    client.thumbnail_stale = false;
+}
+
+// Hiện ảnh của cửa sổ đang chọn giữa màn hình; cửa sổ popup chỉ đổi kích thước khi ảnh đổi kích thước
+void show_switcher(XBackend* backend, Client& client) {
+    if (!thumbnails_enabled || switcher_window == None) return;
+    update_thumbnail(backend, client);
+    const int width = std::max(client.thumbnail_width, 1) + 2 * switcher_padding;
+    const int height = std::max(client.thumbnail_height, 1) + 2 * switcher_padding;
+    if (!switcher_shown || width != switcher_width || height != switcher_height) {
+        backend->move_resize_window(switcher_window, (screen_width - width) / 2, (screen_height - height) / 2, width, height);
+        switcher_width = width;
+        switcher_height = height;
+    }
+    if (!switcher_shown) {
+        backend->map_window(switcher_window);
+        backend->raise_window(switcher_window);
+        switcher_shown = true;
+    }
+    backend->clear_window(switcher_window);
+    backend->put_image(switcher_window, switcher_padding, switcher_padding, client.thumbnail_width, client.thumbnail_height,
+                       client.thumbnail.data());
+}
+
+void hide_switcher(XBackend* backend) {
+    if (!switcher_shown) return;
+    backend->unmap_window(switcher_window);
+    switcher_shown = false;
+}
+
+void comp_damage_window(const CompWindow& window) {
+    if (window.mapped) {
+        comp_add_damage(window.x, window.y, window.width + 2 * window.border, window.height + 2 * window.border);
+    }
+}
+
+// Đặt cửa sổ ngay trên sibling `above` (None = dưới cùng), như trong ConfigureNotify
+void comp_restack(Window window, Window above) {
+    auto it = std::find(comp_stack.begin(), comp_stack.end(), window);
+    if (it == comp_stack.end()) return;
+    comp_stack.erase(it);
+    if (above == None) {
+        comp_stack.insert(comp_stack.begin(), window);
+        return;
+    }
+    auto sibling = std::find(comp_stack.begin(), comp_stack.end(), above);
+    comp_stack.insert(sibling == comp_stack.end() ? sibling : sibling + 1, window);
+}
+
+// Cửa sổ mới (CreateNotify) nằm trên cùng, chưa được map
+void comp_add_window(XBackend* backend, Window window, int x, int y, int width, int height, int border) {
+    if (comp_windows.count(window)) {
+        comp_damage_window(comp_windows[window]);
+        comp_stack.erase(std::find(comp_stack.begin(), comp_stack.end(), window));
+        backend->composite_forget(window, false);
+    }
+    CompWindow& comp = comp_windows[window];
+    comp = CompWindow();
+    comp.x = x;
+    comp.y = y;
+    comp.width = std::max(1, width);
+    comp.height = std::max(1, height);
+    comp.border = border;
+    comp.damage = backend->create_damage(window, XDamageReportBoundingBox);
+    comp_stack.push_back(window);
+    backend->composite_track(window);
+}
+
+// Cửa sổ bị hủy: X server đã tự hủy đối tượng damage của nó
+void comp_remove_window(XBackend* backend, Window window) {
+    auto it = comp_windows.find(window);
+    if (it == comp_windows.end()) return;
+    comp_damage_window(it->second);
+    comp_windows.erase(it);
+    comp_stack.erase(std::find(comp_stack.begin(), comp_stack.end(), window));
+    comp_damaged.erase(std::remove(comp_damaged.begin(), comp_damaged.end(), window), comp_damaged.end());
+    backend->composite_forget(window, true);
+}
+
+// Cửa sổ trên cùng nếu nó phủ kín màn hình và không trong suốt, khi đó không cần compositor
+Window comp_fullscreen_window() {
+    for (auto it = comp_stack.rbegin(); it != comp_stack.rend(); ++it) {
+        const CompWindow& comp = comp_windows[*it];
+        if (!comp.mapped) continue;
+        auto client = clients.find(*it);
+        const bool opaque = client == clients.end() || client->second.opacity == 0xffffffff;
+        const bool covers = comp.x <= 0 && comp.y <= 0 && comp.x + comp.width + 2 * comp.border >= screen_width
+                            && comp.y + comp.height + 2 * comp.border >= screen_height;
+        return (opaque && covers) ? *it : None;
+    }
+    return None;
+}
+
+// Vẽ một khung nếu có vùng cần vẽ lại và đã qua composite_interval_ns kể từ khung trước. Trước đó quyết
+// định có bỏ qua compositor không: cửa sổ fullscreen trên cùng được X server vẽ thẳng, không tốn gì thêm.
+void composite_frame(XBackend* backend, Window root_window) {
+    if (!composite_enabled) return;
+    const bool bypass = comp_fullscreen_window() != None;
+    if (bypass == composite_redirected) {
+        composite_redirected = !bypass;
+        backend->set_redirected(root_window, composite_redirected);
+        comp_damage.clear();
+        if (composite_redirected) {
+            comp_add_damage(0, 0, screen_width, screen_height);
+        }
+    }
+    if (!composite_redirected) {
+        // Damage vẫn được ghi nhận nhưng không trừ, nên X server gần như không gửi thêm DamageNotify
+        comp_damage.clear();
+        comp_dirty_windows.clear();
+        return;
+    }
+    for (Window window : comp_dirty_windows) {
+        auto it = comp_windows.find(window);
+        if (it != comp_windows.end()) comp_damage_window(it->second);
+    }
+    comp_dirty_windows.clear();
+    if (comp_damage.empty()) return;
+    const uint64_t now = monotonic_ns();
+    if (now - comp_last_frame_ns < composite_interval_ns) return;
+
+    // Trừ damage trước khi vẽ: client vẽ thêm trong lúc này sẽ được báo cho khung sau
+    for (Window window : comp_damaged) {
+        CompWindow& comp = comp_windows[window];
+        comp.damaged = false;
+        backend->subtract_damage(comp.damage);
+    }
+    comp_damaged.clear();
+    std::vector<CompositeLayer> layers;
+    for (Window window : comp_stack) {
+        const CompWindow& comp = comp_windows[window];
+        if (!comp.mapped) continue;
+        auto client = clients.find(window);
+        layers.push_back({ window, comp.x, comp.y, (unsigned int)(comp.width + 2 * comp.border), (unsigned int)(comp.height + 2 * comp.border),
+                           client != clients.end() ? client->second.opacity : 0xffffffff });
+    }
+    XRectangle outline = { (short)outline_x, (short)outline_y, (unsigned short)outline_width, (unsigned short)outline_height };
+    backend->composite_paint(comp_damage, layers, outline_shown && outline_composited ? &outline : nullptr);
+    comp_damage.clear();
+    comp_last_frame_ns = now;
+    ++metrics.frames_painted;
+}
+
+// Thời gian vòng lặp chính được ngủ trước khi khung tiếp theo được phép vẽ (-1 = không có gì để vẽ)
+int composite_poll_timeout() {
+    if (!composite_enabled || !composite_redirected || (comp_damage.empty() && comp_dirty_windows.empty())) return -1;
+    const uint64_t due = comp_last_frame_ns + composite_interval_ns;
+    const uint64_t now = monotonic_ns();
+    return due > now ? (int)((due - now) / 1000000) + 1 : 0;
+}
+
+// Chọn cửa sổ tiếp theo (hoặc trước đó, với Shift) trong lịch sử focus và tô viền nó như cửa sổ đang focus
+void switch_step(XBackend* backend, Window root_window, bool backwards) {
+    if (mru_head == nullptr) return;
+    Client* previous = switch_target;
+    if (!switching) {
+        switching = true;
+        backend->grab_keyboard(root_window); // Để nhận được KeyRelease của Alt
+        // Lần nhấn đầu tiên chọn cửa sổ được dùng ngay trước cửa sổ hiện tại
+        switch_target = backwards ? mru_tail : (mru_head->mru_next != nullptr ? mru_head->mru_next : mru_head);
+    } else if (switch_target == nullptr) {
+        switch_target = mru_head;
+    } else if (backwards) {
+        switch_target = switch_target->mru_prev != nullptr ? switch_target->mru_prev : mru_tail;
+    } else {
+        switch_target = switch_target->mru_next != nullptr ? switch_target->mru_next : mru_head;
+    }
+    if (previous != nullptr && previous != switch_target) {
+        set_window_border(backend, previous->window, previous->window == focused_window);
+    }
+    set_window_border(backend, switch_target->window, true);
+    show_switcher(backend, *switch_target);
+}
+
+// Nhả Alt: chỉ lúc này mới focus và raise cửa sổ đã chọn
+void switch_commit(XBackend* backend) {
+    switching = false;
+    backend->ungrab_keyboard();
+    hide_switcher(backend);
+    Client* target = switch_target;
+    switch_target = nullptr;
+    if (target != nullptr) {
+        focus_window(backend, target->window);
+        raise_client(backend, target->window);
+    }
+}
+
+// Bỏ quản lý một cửa sổ bị hủy hoặc bị ẩn. Chỉ sắp xếp lại khi nó là cửa sổ tiling.
+void unmanage_window(XBackend* backend, Window root_window, Window window) {
+    bool was_tiled = false;
+    bool was_lowest_floating = false;
+    if (is_managed(window)) {
+        was_tiled = !clients[window].floating;
+        was_lowest_floating = !floating_windows.empty() && floating_windows.front() == window;
+        managed_windows.erase(std::remove(managed_windows.begin(), managed_windows.end(), window), managed_windows.end());
+        floating_windows.erase(std::remove(floating_windows.begin(), floating_windows.end(), window), floating_windows.end());
+        Client& client = clients[window];
+        // Cửa sổ bị ẩn có thể được map lại (dialog hiện lại): giữ kích thước cuối để MapRequest không phải hỏi X server
+        requested_geometry[window] = { client.x, client.y, client.width, client.height };
+        grid_remove(window, client);
+        mru_unlink(client);
+        if (client.damage != None) {
+            backend->destroy_damage(client.damage);
+        }
+        if (switch_target == &client) {
+            switch_target = nullptr;
+        }
+        clients.erase(window);
+        snap_edges_dirty = true;
+        state_dirty = true;
+        ipc_emit(EVENT_WINDOW_REMOVED, window);
+    }
+    if (top_tiled_window == window) {
+        top_tiled_window = None;
+    }
+    // Cửa sổ fullscreen biến mất: các cửa sổ tiling bị nó che được xếp lại (nếu có gì thay đổi trong lúc đó).
+    // Phải bỏ nó trước khi focus lại, để raise_client không xếp cửa sổ khác dưới một cửa sổ đã mất.
+    if (fullscreen_window == window) {
+        fullscreen_window = None;
+    }
+    // Focus quay về cửa sổ được dùng gần nhất trước đó, không phải chờ người dùng rê chuột
+    if (focused_window == window) {
+        focused_window = None;
+        if (mru_head != nullptr) {
+            focus_window(backend, mru_head->window);
+        } else {
+            ipc_emit(EVENT_FOCUS, None);
+        }
+    }
+    // Cửa sổ tiling trên cùng được xếp ngay dưới cửa sổ nổi thấp nhất; nếu cửa sổ đó đã bị hủy trước khi
+    // WM kịp biết thì lệnh xếp chồng ấy bị X server từ chối, nên xếp lại theo cửa sổ nổi mới
+    if (was_lowest_floating && top_tiled_window != None) {
+        raise_client(backend, top_tiled_window);
+    }
+    cancel_drag(backend, root_window, window);
+    if (was_tiled || relayout_pending) {
+        tile_windows(backend);
+    }
+}
+
+// Tạo vùng nhớ memfd cho trang trạng thái. Người đọc nhận fd qua lệnh IPC "state".
+bool setup_state_page() {
+    state_fd = memfd_create("nothingwm-state", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (state_fd < 0 || ftruncate(state_fd, sizeof(WmStatePage)) < 0) {
+        std::cerr << "Error: Could not create state page: " << strerror(errno) << std::endl;
+        return false;
+    }
+    void* map = mmap(nullptr, sizeof(WmStatePage), PROT_READ | PROT_WRITE, MAP_SHARED, state_fd, 0);
+    if (map == MAP_FAILED) {
+        std::cerr << "Error: Could not map state page: " << strerror(errno) << std::endl;
+        close(state_fd);
+        state_fd = -1;
+        return false;
+    }
+    state_page = new (map) WmStatePage();
+    state_page->magic = WMSTATE_MAGIC;
+    state_page->version = WMSTATE_VERSION;
+    // Khóa kích thước và chặn mọi ánh xạ ghi mới: chỉ ánh xạ của WM được phép ghi
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+#ifdef F_SEAL_FUTURE_WRITE
+    seals |= F_SEAL_FUTURE_WRITE;
+#endif
+    fcntl(state_fd, F_ADD_SEALS, seals);
+    return true;
+}
+
+// Ghi bảng client vào trang trạng thái; gọi tối đa một lần cho mỗi vòng lặp sự kiện
+void publish_state() {
+    if (state_page == nullptr || !state_dirty) return;
+    state_dirty = false;
+
+    wmstate_write_begin(state_page);
+    uint32_t count = 0;
+    for (Window window : managed_windows) {
+        if (count == (uint32_t)WMSTATE_MAX_CLIENTS) break;
+        const Client& client = clients[window];
+        WmStateClient& entry = state_page->clients[count++];
+        entry.window = window;
+        entry.x = client.x;
+        entry.y = client.y;
+        entry.width = client.width;
+        entry.height = client.height;
+        entry.workspace = 0;
+        entry.flags = ((window == focused_window) ? WMSTATE_FLAG_FOCUSED : 0) | (client.floating ? WMSTATE_FLAG_FLOATING : 0)
+                      | (client.fullscreen ? WMSTATE_FLAG_FULLSCREEN : 0);
+        strncpy(entry.title, client.title.c_str(), WMSTATE_TITLE_LEN - 1);
+        entry.title[WMSTATE_TITLE_LEN - 1] = '\0';
+    }
+    state_page->count = count;
+    state_page->focused = focused_window;
+    state_page->layout = current_layout;
+    wmstate_write_end(state_page);
+}
+
+void signal_handler(int sig) {
+    int saved_errno = errno;
+    char c = (char)sig;
+    if (write(signal_pipe[1], &c, 1) < 0) {
+        // Pipe đầy: đã có signal đang chờ xử lý
+    }
+    errno = saved_errno;
+}
+
+void setup_signals() {
+    if (pipe2(signal_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        std::cerr << "Error: Could not create signal pipe: " << strerror(errno) << std::endl;
+        return;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    sigaction(SIGUSR1, &sa, nullptr);
+    sigaction(SIGUSR2, &sa, nullptr);
+}
+
+int histogram_bucket(uint64_t ns) {
+    if (ns < (1u << hist_sub_bits)) return (int)ns;
+    int exponent = 63 - __builtin_clzll(ns);
+    int sub = (ns >> (exponent - hist_sub_bits)) & ((1 << hist_sub_bits) - 1);
+    return ((exponent - hist_sub_bits + 1) << hist_sub_bits) + sub;
+}
+
+// Giá trị nhỏ nhất thuộc về bucket
+uint64_t histogram_bucket_floor(int bucket) {
+    if (bucket < (1 << hist_sub_bits)) return bucket;
+    int exponent = (bucket >> hist_sub_bits) + hist_sub_bits - 1;
+    uint64_t sub = bucket & ((1 << hist_sub_bits) - 1);
+    return ((1ull << hist_sub_bits) + sub) << (exponent - hist_sub_bits);
+}
+
+void record_latency(int type, uint64_t ns) {
+    if (type < 0 || type >= LASTEvent) return;
+    LatencyHistogram& h = event_latency[type];
+    ++h.count;
+    h.total_ns += ns;
+    if (ns > h.max_ns) h.max_ns = ns;
+    ++h.buckets[histogram_bucket(ns)];
+}
+
+uint64_t histogram_percentile(const LatencyHistogram& h, double p) {
+    uint64_t target = (uint64_t)(p * h.count);
+    uint64_t seen = 0;
+    for (int i = 0; i < hist_buckets; ++i) {
+        seen += h.buckets[i];
+        if (seen > target) return std::min(histogram_bucket_floor(i + 1), h.max_ns);
+    }
+    return h.max_ns;
+}
+
+// Bảng số liệu dạng văn bản, dùng cho lệnh IPC "metrics" và khi nhận SIGUSR1
+std::string format_metrics() {
+    std::ostringstream out;
+    out << "relayouts " << metrics.relayouts << "\n";
+    out << "configures_sent " << metrics.configures_sent << "\n";
+    out << "events_dropped " << metrics.events_dropped << "\n";
+    out << "frames_painted " << metrics.frames_painted << "\n";
+    out << std::fixed;
+    out.precision(1);
+    for (int type = 0; type < LASTEvent; ++type) {
+        const LatencyHistogram& h = event_latency[type];
+        if (h.count == 0) continue;
+        out << "event " << event_type_name(type) << " count " << h.count
+            << " mean_us " << h.total_ns / 1000.0 / h.count
+            << " p50_us " << histogram_percentile(h, 0.50) / 1000.0
+            << " p99_us " << histogram_percentile(h, 0.99) / 1000.0
+            << " p999_us " << histogram_percentile(h, 0.999) / 1000.0
+            << " max_us " << h.max_ns / 1000.0 << "\n";
+    }
+    return out.str();
+}
+
+// Bảng round trip theo loại sự kiện, dùng cho lệnh IPC "roundtrips" (có thể kiểm tra trong CI)
+std::string format_round_trips() {
+    std::ostringstream out;
+    out << "budget " << (round_trip_budget_failed ? "violated" : "ok") << "\n";
+    for (int type = 0; type <= LASTEvent; ++type) {
+        const RoundTripStats& stats = round_trip_stats[type];
+        if (stats.dispatches == 0 && stats.round_trips == 0) continue;
+        out << "event " << (type == LASTEvent ? "Other" : event_type_name(type))
+            << " dispatches " << stats.dispatches
+            << " requests " << stats.requests
+            << " round_trips " << stats.round_trips
+            << " reply_bytes " << stats.reply_bytes
+            << " multi_blocking " << stats.multi_blocking
+            << " budget " << (type < LASTEvent ? round_trip_budget[type] : -1)
+            << " violations " << stats.budget_violations << "\n";
+    }
+    return out.str();
+}
+
+bool start_recording(const char* path) {
+    trace_file = fopen(path, "wb");
+    if (trace_file == nullptr) {
+        std::cerr << "Error: Could not open trace file " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    // Bộ đệm lớn để việc ghi trace không tạo thêm syscall cho mỗi sự kiện
+    setvbuf(trace_file, nullptr, _IOFBF, 1 << 20);
+    WmTraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WMTRACE_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(WmTraceRecord);
+    fwrite(&header, sizeof(header), 1, trace_file);
+    trace_start_ns = monotonic_ns();
+    std::cout << "Recording X events to " << path << std::endl;
+    return true;
+}
+
+void stop_recording() {
+    if (trace_file == nullptr) return;
+    fclose(trace_file);
+    trace_file = nullptr;
+    std::cout << "Recorded " << trace_records << " X events." << std::endl;
+}
+
+void record_event(const XEvent& event) {
+    WmTraceRecord record;
+    memset(&record, 0, sizeof(record));
+    record.time_ns = monotonic_ns() - trace_start_ns;
+    record.type = event.type;
+    record.window = event.xany.window;
+    switch (event.type) {
+        case CreateNotify:
+            record.window = event.xcreatewindow.window;
+            record.x = event.xcreatewindow.x;
+            record.y = event.xcreatewindow.y;
+            record.width = event.xcreatewindow.width;
+            record.height = event.xcreatewindow.height;
+            break;
+        case MapRequest:
+            record.window = event.xmaprequest.window;
+            break;
+        case ConfigureRequest:
+            record.window = event.xconfigurerequest.window;
+            record.x = event.xconfigurerequest.x;
+            record.y = event.xconfigurerequest.y;
+            record.width = event.xconfigurerequest.width;
+            record.height = event.xconfigurerequest.height;
+            record.reserved = event.xconfigurerequest.value_mask;
+            record.detail = event.xconfigurerequest.detail;
+            break;
+        case DestroyNotify:
+            record.window = event.xdestroywindow.window;
+            break;
+        case MotionNotify:
+            record.x = event.xmotion.x_root;
+            record.y = event.xmotion.y_root;
+            break;
+        case ButtonPress:
+        case ButtonRelease:
+            record.window = event.xbutton.subwindow;
+            record.x = event.xbutton.x_root;
+            record.y = event.xbutton.y_root;
+            record.detail = event.xbutton.button;
+            break;
+        case KeyPress:
+            record.detail = event.xkey.keycode;
+            record.width = event.xkey.state;
+            break;
+        default:
+            break;
+    }
+    fwrite(&record, sizeof(record), 1, trace_file);
+    ++trace_records;
+}
+
+// Đường dẫn socket IPC: $NOTHINGWM_SOCKET hoặc /tmp/nothingwm-<display>.sock
+std::string ipc_default_socket_path(const char* display_name) {
+    const char* env = getenv("NOTHINGWM_SOCKET");
+    if (env != nullptr && *env != '\0') {
+        return env;
+    }
+    std::string name = display_name != nullptr ? display_name : "";
+    for (char& c : name) {
+        if (!isalnum((unsigned char)c)) c = '_';
+    }
+    return "/tmp/nothingwm-" + name + ".sock";
+}
+
+// Mở socket lắng nghe, không chặn (non-blocking) để không bao giờ làm treo vòng lặp sự kiện
+bool setup_ipc(Display* display) {
+    ipc_socket_path = ipc_default_socket_path(DisplayString(display));
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (ipc_socket_path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "IPC socket path too long: " << ipc_socket_path << std::endl;
+        return false;
+    }
+    strncpy(addr.sun_path, ipc_socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    ipc_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ipc_listen_fd < 0) {
+        std::cerr << "Error: Could not create IPC socket: " << strerror(errno) << std::endl;
+        return false;
+    }
+    unlink(ipc_socket_path.c_str());
+    if (bind(ipc_listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(ipc_listen_fd, 8) < 0) {
+        std::cerr << "Error: Could not listen on " << ipc_socket_path << ": " << strerror(errno) << std::endl;
+        close(ipc_listen_fd);
+        ipc_listen_fd = -1;
+        return false;
+    }
+    chmod(ipc_socket_path.c_str(), 0600);
+    std::cout << "IPC listening on " << ipc_socket_path << std::endl;
+    return true;
+}
+
+void shutdown_ipc() {
+    for (auto& client : ipc_clients) {
+        close(client.fd);
+    }
+    ipc_clients.clear();
+    if (ipc_listen_fd >= 0) {
+        close(ipc_listen_fd);
+        unlink(ipc_socket_path.c_str());
+        ipc_listen_fd = -1;
+    }
+}
+
+// Mỗi gói gồm 4 byte độ dài (little-endian) theo sau là nội dung
+void ipc_append_frame(std::string& out, const std::string& payload) {
+    uint32_t len = payload.size();
+    char header[4] = { (char)(len & 0xff), (char)((len >> 8) & 0xff), (char)((len >> 16) & 0xff), (char)((len >> 24) & 0xff) };
+    out.append(header, 4);
+    out += payload;
+}
+
+bool ipc_parse_window(const std::string& text, Window& window) {
+    char* end = nullptr;
+    window = strtoul(text.c_str(), &end, 0);
+    return end != nullptr && *end == '\0' && window != None;
+}
+
+struct IpcCommand {
+    std::string verb;
+    std::vector<std::string> args;
+    Window window;
+};
+
+// Kiểm tra một lệnh trước khi áp dụng; trả về thông báo lỗi hoặc chuỗi rỗng
+std::string ipc_validate(IpcCommand& cmd) {
+    cmd.window = None;
+    const std::string& v = cmd.verb;
+    if (v == "focus" || v == "close" || v == "move") {
+        size_t expected = (v == "move") ? 2 : 1;
+        if (cmd.args.size() != expected) return v + " expects " + std::to_string(expected) + " argument(s)";
+        if (!ipc_parse_window(cmd.args[0], cmd.window)) return "bad window id '" + cmd.args[0] + "'";
+        if (!is_managed(cmd.window)) return "window " + cmd.args[0] + " is not managed";
+        if (v == "move") {
+            char* end = nullptr;
+            long index = strtol(cmd.args[1].c_str(), &end, 10);
+            if (*end != '\0' || index < 0 || index >= (long)managed_windows.size()) return "bad index '" + cmd.args[1] + "'";
+        }
+    } else if (v == "window_at") {
+        if (cmd.args.size() != 2) return "window_at expects x and y";
+        for (const auto& arg : cmd.args) {
+            char* end = nullptr;
+            strtol(arg.c_str(), &end, 10);
+            if (arg.empty() || *end != '\0') return "bad coordinate '" + arg + "'";
+        }
+    } else if (v == "layout") {
+        if (cmd.args.size() != 1 || (cmd.args[0] != "tile" && cmd.args[0] != "monocle")) return "layout expects 'tile' or 'monocle'";
+    } else if (v == "spawn") {
+        if (cmd.args.empty()) return "spawn expects a command";
+    } else if (v == "trace") {
+        if (cmd.args.size() != 1) return "trace expects an output path";
+        if (!tracing_enabled) return "tracing is disabled (start with --trace)";
+    } else if (v == "tree" || v == "state" || v == "metrics" || v == "roundtrips") {
+        if (!cmd.args.empty()) return v + " takes no arguments";
+        if (v == "state" && state_fd < 0) return "state page unavailable";
+    } else if (v == "subscribe") {
+        for (const auto& name : cmd.args) {
+            if (std::find(ipc_event_names, ipc_event_names + EVENT_KIND_COUNT, name) == ipc_event_names + EVENT_KIND_COUNT) {
+                return "unknown event '" + name + "'";
+            }
+        }
+    } else {
+        return "unknown command '" + v + "'";
+    }
+    return "";
+}
+
+// Thực hiện một gói lệnh: kiểm tra toàn bộ trước, sau đó áp dụng và chỉ tile lại một lần
+std::string ipc_execute_batch(XBackend* backend, IpcClient& client, const std::string& payload) {
+    std::vector<IpcCommand> commands;
+    std::istringstream lines(payload);
+    std::string line;
+    int line_no = 0;
+    while (std::getline(lines, line)) {
+        ++line_no;
+        std::istringstream words(line);
+        IpcCommand cmd;
+        if (!(words >> cmd.verb)) continue;
+        std::string arg;
+        while (words >> arg) cmd.args.push_back(arg);
+        std::string error = ipc_validate(cmd);
+        if (!error.empty()) {
+            return "error: line " + std::to_string(line_no) + ": " + error + "\n";
+        }
+        commands.push_back(cmd);
+    }
+
+    std::string reply;
+    bool needs_relayout = false;
+    bool failed = false;
+    for (const auto& cmd : commands) {
+        if (cmd.verb == "focus") {
+            focus_window(backend, cmd.window);
+        } else if (cmd.verb == "close") {
+            close_window(backend, cmd.window);
+        } else if (cmd.verb == "move") {
+            managed_windows.erase(std::remove(managed_windows.begin(), managed_windows.end(), cmd.window), managed_windows.end());
+            managed_windows.insert(managed_windows.begin() + std::stol(cmd.args[1]), cmd.window);
+            needs_relayout = true;
+        } else if (cmd.verb == "layout") {
+            Layout layout = (cmd.args[0] == "monocle") ? LAYOUT_MONOCLE : LAYOUT_TILE;
+            if (layout != current_layout) {
+                current_layout = layout;
+                ipc_emit(EVENT_LAYOUT, layout);
+            }
+            needs_relayout = true;
+        } else if (cmd.verb == "spawn") {
+            execute_command(cmd.args);
+        } else if (cmd.verb == "tree") {
+            std::ostringstream tree;
+            tree << "layout " << (current_layout == LAYOUT_MONOCLE ? "monocle" : "tile") << "\n";
+            for (size_t i = 0; i < managed_windows.size(); ++i) {
+                tree << i << " 0x" << std::hex << managed_windows[i] << std::dec
+                     << (clients[managed_windows[i]].floating ? " floating" : "")
+                     << (clients[managed_windows[i]].fullscreen ? " fullscreen" : "")
+                     << (managed_windows[i] == focused_window ? " focused" : "") << "\n";
+            }
+            reply += tree.str();
+        } else if (cmd.verb == "window_at") {
+            // Tra chỉ mục không gian, không hỏi X server
+            Window window = window_at(strtol(cmd.args[0].c_str(), nullptr, 10), strtol(cmd.args[1].c_str(), nullptr, 10));
+            std::ostringstream line;
+            if (window != None) {
+                line << "0x" << std::hex << window << "\n";
+            } else {
+                line << "none\n";
+            }
+            reply += line.str();
+        } else if (cmd.verb == "metrics") {
+            reply += format_metrics();
+        } else if (cmd.verb == "trace") {
+            if (!write_chrome_trace(cmd.args[0])) {
+                reply += "error: could not write " + cmd.args[0] + "\n";
+                failed = true;
+            }
+        } else if (cmd.verb == "roundtrips") {
+            reply += format_round_trips();
+        } else if (cmd.verb == "state") {
+            client.send_fd = state_fd;
+        } else if (cmd.verb == "subscribe") {
+            // Không có tham số nghĩa là đăng ký tất cả các loại sự kiện
+            unsigned mask = 0;
+            for (int kind = 0; kind < EVENT_KIND_COUNT; ++kind) {
+                if (cmd.args.empty() || std::find(cmd.args.begin(), cmd.args.end(), ipc_event_names[kind]) != cmd.args.end()) {
+                    mask |= 1u << kind;
+                }
+            }
+            client.subscriptions |= mask;
+            client.ring.resize(ipc_event_ring_size);
+        }
+    }
+    // Lệnh hỏng giữa chừng (chỉ có thể là ghi file) không hủy các lệnh khác, nhưng client không nhận "ok"
+    if (needs_relayout) {
+        tile_windows(backend);
+    }
+    return failed ? reply : reply + "ok\n";
+}
+
+void ipc_accept_clients() {
+    while (true) {
+        int fd = accept4(ipc_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) break;
+        IpcClient client;
+        client.fd = fd;
+        client.closed = false;
+        ipc_clients.push_back(client);
+    }
+}
+
+// Gửi phần dữ liệu còn tồn; không bao giờ chặn, phần còn lại sẽ gửi khi socket ghi được
+void ipc_flush_client(IpcClient& client) {
+    // Chỉ chuyển sự kiện từ ring sang bộ đệm gửi khi bộ đệm còn nhỏ, để bộ nhớ của mỗi subscriber luôn bị giới hạn
+    while (client.out.size() < ipc_out_high_water && (client.ring_count > 0 || client.dropped > 0)) {
+        if (client.dropped > 0) {
+            ipc_append_frame(client.out, "dropped " + std::to_string(client.dropped) + "\n");
+            client.dropped = 0;
+            continue;
+        }
+        const IpcEvent& event = client.ring[client.ring_head];
+        std::ostringstream line;
+        line << ipc_event_names[event.kind] << " ";
+        if (event.kind == EVENT_LAYOUT) {
+            line << (event.value == LAYOUT_MONOCLE ? "monocle" : "tile");
+        } else {
+            line << "0x" << std::hex << event.value;
+        }
+        line << "\n";
+        ipc_append_frame(client.out, line.str());
+        client.ring_head = (client.ring_head + 1) % ipc_event_ring_size;
+        --client.ring_count;
+    }
+    while (!client.out.empty()) {
+        ssize_t n;
+        if (client.send_fd >= 0) {
+            // Gửi kèm file descriptor với byte đầu tiên của phản hồi
+            iovec iov = { &client.out[0], client.out.size() };
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &client.send_fd, sizeof(int));
+            n = sendmsg(client.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n > 0) client.send_fd = -1;
+        } else {
+            n = send(client.fd, client.out.data(), client.out.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+        if (n > 0) {
+            client.out.erase(0, n);
+        } else {
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) client.closed = true;
+            break;
+        }
+    }
+}
+
+void ipc_read_client(XBackend* backend, IpcClient& client) {
+    char buffer[4096];
+    while (true) {
+        ssize_t n = recv(client.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (n > 0) {
+            client.in.append(buffer, n);
+        } else {
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) client.closed = true;
+            break;
+        }
+    }
+    while (client.in.size() >= 4) {
+        const unsigned char* p = (const unsigned char*)client.in.data();
+        uint32_t len = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        if (len > ipc_max_frame) {
+            client.closed = true;
+            return;
+        }
+        if (client.in.size() < 4 + (size_t)len) break;
+        std::string payload = client.in.substr(4, len);
+        client.in.erase(0, 4 + len);
+        watchdog_begin(LASTEvent, None);
+        ipc_append_frame(client.out, ipc_execute_batch(backend, client, payload));
+        watchdog_end();
+    }
+    ipc_flush_client(client);
+}
+
+// Xử lý một sự kiện X. Trả về false khi người dùng yêu cầu thoát WM.
+bool handle_event(XBackend* backend, Window root_window, XEvent& event) {
+    switch (event.type) {
+        case CreateNotify:
+            if (event.xcreatewindow.window == composite_overlay) break;
+            if (composite_enabled && event.xcreatewindow.parent == root_window) {
+                comp_add_window(backend, event.xcreatewindow.window, event.xcreatewindow.x, event.xcreatewindow.y,
+                                event.xcreatewindow.width, event.xcreatewindow.height, event.xcreatewindow.border_width);
+            }
+            if (event.xcreatewindow.window == switcher_window) break;
+            backend->select_input(event.xcreatewindow.window, StructureNotifyMask | ExposureMask | KeyPressMask | ButtonPressMask | EnterWindowMask | PropertyChangeMask);
+            backend->set_border_width(event.xcreatewindow.window, border_width);
+            set_window_border(backend, event.xcreatewindow.window, false);
+            // Cửa sổ override-redirect (menu, tooltip) không bao giờ gửi MapRequest
+            if (!event.xcreatewindow.override_redirect && event.xcreatewindow.window != statusbar_window) {
+                prefetch_properties(backend, event.xcreatewindow.window);
+                backend->flush();
+                requested_geometry[event.xcreatewindow.window] = { event.xcreatewindow.x, event.xcreatewindow.y,
+                                                                   event.xcreatewindow.width, event.xcreatewindow.height };
+            }
+            break;
+
+        case MapRequest: {
+            const Window window = event.xmaprequest.window;
+            if (!is_managed(window)) {
+                managed_windows.push_back(window);
+                Client& client = clients[window];
+                client.window = window;
+                mru_push_back(client);
+                load_properties(backend, window, client);
+                client.floating = wants_floating(client);
+                if (client.floating) {
+                    place_floating(backend, window, client);
+                }
+                requested_geometry.erase(window);
+                if (thumbnails_enabled) {
+                    client.damage = backend->create_damage(window, XDamageReportNonEmpty);
+                }
+                ipc_emit(EVENT_WINDOW_ADDED, window);
+                // Client muốn hiện fullscreen ngay từ đầu (EWMH: đặt _NET_WM_STATE trước khi map)
+                const std::vector<Atom>& state = client.net_wm_state;
+                if (std::find(state.begin(), state.end(), NET_WM_STATE_FULLSCREEN) != state.end()) {
+                    set_fullscreen(backend, root_window, window, true);
+                }
+            }
+            if (fullscreen_window != None && fullscreen_window != window && !clients[window].floating) {
+                // Cửa sổ tiling mới hiện ra dưới cửa sổ fullscreen và không lấy focus của nó; tạm thời nó
+                // chiếm cả vùng làm việc như trong monocle, chỗ thật trong layout được xếp khi thoát fullscreen
+                int used_width, used_height;
+                place_client(backend, window, 0, statusbar_height, screen_width, screen_height - statusbar_height, used_width, used_height);
+                raise_client(backend, window);
+                backend->map_window(window);
+                relayout_pending = true;
+                if (focused_window == window) {
+                    focus_window(backend, fullscreen_window);
+                }
+                break;
+            }
+            // Cửa sổ tiling mới được tạo ở trên cùng, phải xuống dưới lớp nổi để không che dialog
+            if (!clients[window].floating) {
+                raise_client(backend, window);
+            }
+            backend->map_window(window);
+            // Cửa sổ nổi không làm thay đổi layout của các cửa sổ tiling
+            if (!clients[window].floating) {
+                tile_windows(backend);
+            }
+
+            focus_window(backend, window);
+            break;
+        }
+
+        case ConfigureRequest:
+            if (fullscreen_window != None && event.xconfigurerequest.window == fullscreen_window) {
+                // Cửa sổ fullscreen giữ nguyên cả màn hình, chỉ được báo lại vị trí đó
+                backend->send_configure_notify(fullscreen_window, 0, 0, screen_width, screen_height, 0);
+                break;
+            }
+            if (is_managed(event.xconfigurerequest.window) && clients[event.xconfigurerequest.window].floating) {
+                // Cửa sổ nổi được tự chọn vị trí và kích thước, WM chỉ ghi nhớ lại
+                Client& client = clients[event.xconfigurerequest.window];
+                const unsigned long mask = event.xconfigurerequest.value_mask;
+                move_resize_client(backend, event.xconfigurerequest.window,
+                                   (mask & CWX) ? event.xconfigurerequest.x : client.x,
+                                   (mask & CWY) ? event.xconfigurerequest.y : client.y,
+                                   (mask & CWWidth) ? event.xconfigurerequest.width : client.width,
+                                   (mask & CWHeight) ? event.xconfigurerequest.height : client.height);
+                break;
+            }
+            if (is_managed(event.xconfigurerequest.window)) {
+                // Cửa sổ đang được tiling giữ vị trí WM đã gán: chỉ báo lại vị trí đó bằng một
+                // ConfigureNotify tổng hợp (ICCCM 4.1.5), không làm theo rồi bị tile_windows đẩy lại
+                const Client& client = clients[event.xconfigurerequest.window];
+                backend->send_configure_notify(event.xconfigurerequest.window, client.x, client.y, client.width, client.height, border_width);
+                break;
+            }
+            XWindowChanges changes;
+            changes.x = event.xconfigurerequest.x;
+            changes.y = event.xconfigurerequest.y;
+            changes.width = event.xconfigurerequest.width;
+            changes.height = event.xconfigurerequest.height;
+            changes.border_width = event.xconfigurerequest.border_width;
+            changes.sibling = event.xconfigurerequest.above;
+            changes.stack_mode = event.xconfigurerequest.detail;
+            backend->configure_window(event.xconfigurerequest.window, event.xconfigurerequest.value_mask, &changes);
+            ++metrics.configures_sent;
+            if (requested_geometry.count(event.xconfigurerequest.window)) {
+                Geometry& geometry = requested_geometry[event.xconfigurerequest.window];
+                if (event.xconfigurerequest.value_mask & CWX) geometry.x = event.xconfigurerequest.x;
+                if (event.xconfigurerequest.value_mask & CWY) geometry.y = event.xconfigurerequest.y;
+                if (event.xconfigurerequest.value_mask & CWWidth) geometry.width = event.xconfigurerequest.width;
+                if (event.xconfigurerequest.value_mask & CWHeight) geometry.height = event.xconfigurerequest.height;
+            }
+            break;
+    
+        case DestroyNotify:
+            discard_prefetch(backend, event.xdestroywindow.window);
+            // X server đã tự hủy đối tượng damage cùng với cửa sổ
+            if (is_managed(event.xdestroywindow.window)) {
+                clients[event.xdestroywindow.window].damage = None;
+            }
+            if (composite_enabled) {
+                comp_remove_window(backend, event.xdestroywindow.window);
+            }
+            unmanage_window(backend, root_window, event.xdestroywindow.window);
+            requested_geometry.erase(event.xdestroywindow.window);
+            break;
+
+        // Client tự ẩn cửa sổ (ICCCM withdraw): ngừng quản lý, nó sẽ gửi MapRequest mới khi hiện lại.
+        // Sự kiện tới hai lần (qua root và qua chính cửa sổ), lần thứ hai không làm gì.
+        case UnmapNotify: {
+            if (composite_enabled && comp_windows.count(event.xunmap.window) && comp_windows[event.xunmap.window].mapped) {
+                CompWindow& comp = comp_windows[event.xunmap.window];
+                comp_damage_window(comp);
+                comp.mapped = false;
+                backend->composite_forget(event.xunmap.window, false);
+            }
+            const bool was_managed = is_managed(event.xunmap.window);
+            unmanage_window(backend, root_window, event.xunmap.window);
+            // Cửa sổ vẫn còn và có thể được map lại: lấy trước thuộc tính như lúc CreateNotify
+            if (was_managed) {
+                prefetch_properties(backend, event.xunmap.window);
+                backend->flush();
+            }
+            break;
+        }
+
+        // Các sự kiện cấu trúc chỉ compositor cần: cửa sổ hiện ra, đổi chỗ, đổi kích thước hoặc đổi thứ tự xếp chồng.
+        // Mỗi sự kiện có thể tới hai lần (qua root và qua chính cửa sổ), lần thứ hai không đổi gì.
+        case MapNotify:
+            if (composite_enabled && comp_windows.count(event.xmap.window) && !comp_windows[event.xmap.window].mapped) {
+                CompWindow& comp = comp_windows[event.xmap.window];
+                comp.mapped = true;
+                comp_damage_window(comp);
+                backend->composite_forget(event.xmap.window, false); // Pixmap mới được cấp lúc map
+            }
+            break;
+
+        case ConfigureNotify:
+            if (composite_enabled && comp_windows.count(event.xconfigure.window)) {
+                CompWindow& comp = comp_windows[event.xconfigure.window];
+                const bool resized = comp.width != event.xconfigure.width || comp.height != event.xconfigure.height
+                                     || comp.border != event.xconfigure.border_width;
+                const bool moved = comp.x != event.xconfigure.x || comp.y != event.xconfigure.y;
+                auto it = std::find(comp_stack.begin(), comp_stack.end(), event.xconfigure.window);
+                const Window below = it == comp_stack.begin() ? None : *(it - 1);
+                if (!resized && !moved && below == event.xconfigure.above) break;
+                comp_damage_window(comp);
+                comp.x = event.xconfigure.x;
+                comp.y = event.xconfigure.y;
+                comp.width = std::max(1, event.xconfigure.width);
+                comp.height = std::max(1, event.xconfigure.height);
+                comp.border = event.xconfigure.border_width;
+                comp_restack(event.xconfigure.window, event.xconfigure.above);
+                comp_damage_window(comp);
+                if (resized) {
+                    backend->composite_forget(event.xconfigure.window, false);
+                }
+            }
+            break;
+
+        case CirculateNotify:
+            if (composite_enabled && comp_windows.count(event.xcirculate.window)) {
+                Window window = event.xcirculate.window;
+                comp_stack.erase(std::find(comp_stack.begin(), comp_stack.end(), window));
+                comp_stack.insert(event.xcirculate.place == PlaceOnTop ? comp_stack.end() : comp_stack.begin(), window);
+                comp_damage_window(comp_windows[window]);
+            }
+            break;
+
+        case ReparentNotify:
+            // Cửa sổ được chuyển vào trong một cửa sổ khác thì phần nội dung đó được vẽ cùng cửa sổ cha
+            if (composite_enabled && event.xreparent.parent != root_window) {
+                comp_remove_window(backend, event.xreparent.window);
+            }
+            break;
+    
+        // EWMH: client xin đổi trạng thái sau khi đã map. data.l[0] là hành động (0 bỏ, 1 thêm, 2 đảo),
+        // data.l[1] và data.l[2] là các trạng thái; WM chỉ hỗ trợ _NET_WM_STATE_FULLSCREEN
+        case ClientMessage:
+            if (event.xclient.message_type == NET_WM_STATE && event.xclient.format == 32 && is_managed(event.xclient.window)
+                && ((Atom)event.xclient.data.l[1] == NET_WM_STATE_FULLSCREEN || (Atom)event.xclient.data.l[2] == NET_WM_STATE_FULLSCREEN)) {
+                const long action = event.xclient.data.l[0];
+                if (action < 0 || action > 2) break;
+                set_fullscreen(backend, root_window, event.xclient.window, action == 1 || (action == 2 && !clients[event.xclient.window].fullscreen));
+            }
+            break;
+
+        case PropertyNotify:
+            if (event.xproperty.window == root_window && event.xproperty.atom == NET_WM_NAME) {
+                update_status_text(backend, root_window);
+                draw_statusbar(backend);
+            } else if (is_managed(event.xproperty.window) || prefetches.count(event.xproperty.window)) {
+                // Chỉ gửi truy vấn lại thuộc tính vừa đổi; trả lời được lấy trong refresh_properties()
+                // hoặc lúc MapRequest nếu cửa sổ chưa được map
+                int index = prefetch_index(event.xproperty.atom);
+                if (index >= 0) {
+                    prefetch_properties(backend, event.xproperty.window, 1u << index);
+                    // Cửa sổ chưa map: gửi ngay như lúc CreateNotify để MapRequest không phải chờ
+                    if (!is_managed(event.xproperty.window)) backend->flush();
+                }
+            }
+            break;
+    
+        case Expose:
+            if (event.xexpose.window == statusbar_window) {
+                draw_statusbar(backend);
+            } else if (event.xexpose.window == switcher_window && switching && switch_target != nullptr) {
+                show_switcher(backend, *switch_target);
+            }
+            break;
+
+        case ButtonPress: {
+            // Cửa sổ fullscreen không kéo hay thay đổi kích thước được
+            if (fullscreen_window != None && event.xbutton.subwindow == fullscreen_window) break;
+            if (event.xbutton.button == 3 && (event.xbutton.state & Mod4Mask) && event.xbutton.subwindow != None && !is_moving && !is_resizing) {
+                current_resizing_window = event.xbutton.subwindow;
+                auto it = clients.find(current_resizing_window);
+                if (it != clients.end()) {
+                    start_win_x = it->second.x;
+                    start_win_y = it->second.y;
+                    start_win_width = it->second.width;
+                    start_win_height = it->second.height;
+                } else {
+                    GeometryReply geometry;
+                    backend->get_geometry_reply(backend->get_geometry(current_resizing_window), geometry);
+                    start_win_x = geometry.x;
+                    start_win_y = geometry.y;
+                    start_win_width = geometry.width;
+                    start_win_height = geometry.height;
+                }
+                // Chỉ dùng sync khi client khai báo cả giao thức lẫn counter và server có extension SYNC
+                resize_sync = false;
+                if (!outline_mode && it != clients.end() && sync_event_base != 0 && it->second.sync_counter != None) {
+                    const std::vector<Atom>& protocols = it->second.protocols;
+                    resize_sync = std::find(protocols.begin(), protocols.end(), NET_WM_SYNC_REQUEST) != protocols.end();
+                }
+                is_resizing = true;
+                resize_width = resize_sent_width = start_win_width;
+                resize_height = resize_sent_height = start_win_height;
+                resize_sent_ns = 0;
+                sync_waiting = false;
+                start_x = event.xbutton.x_root;
+                start_y = event.xbutton.y_root;
+                backend->grab_pointer(root_window);
+            } else if (event.xbutton.button == 1 && !is_resizing) {
+                // Một lần nhấn mới bắt đầu lại thao tác kéo, khung của lần kéo trước (nếu còn) bị xóa. Cửa sổ tiling
+                // đã bị kéo đi ở lần trước (không có ButtonRelease) thì thành cửa sổ nổi như khi được thả.
+                hide_outline(backend, root_window);
+                if (is_moving && drag_moved && !outline_mode && is_managed(current_moving_window)) {
+                    set_floating(backend, current_moving_window, true);
+                }
+                is_moving = true;
+                current_moving_window = event.xbutton.subwindow;
+                if (current_moving_window == None) {
+                    is_moving = false;
+                    break;
+                }
+                if (is_managed(current_moving_window)) {
+                    // Vị trí cửa sổ được quản lý đã biết sẵn, không cần hỏi X server
+                    const Client& client = clients[current_moving_window];
+                    start_win_x = client.x;
+                    start_win_y = client.y;
+                    start_win_width = client.width;
+                    start_win_height = client.height;
+                } else {
+                    GeometryReply geometry;
+                    backend->get_geometry_reply(backend->get_geometry(current_moving_window), geometry);
+                    start_win_x = geometry.x;
+                    start_win_y = geometry.y;
+                    start_win_width = geometry.width;
+                    start_win_height = geometry.height;
+                }
+                start_x = event.xbutton.x_root;
+                start_y = event.xbutton.y_root;
+                drag_moved = false;
+                snap_edges_dirty = true;
+                backend->grab_pointer(root_window);
+            }
+            break;
+        }
+
+        case MotionNotify: {
+            if (is_resizing) {
+                resize_width = std::max(1, start_win_width + (event.xmotion.x_root - start_x));
+                resize_height = std::max(1, start_win_height + (event.xmotion.y_root - start_y));
+                if (outline_mode) {
+                    int width = resize_width, height = resize_height;
+                    auto it = clients.find(current_resizing_window);
+                    if (it != clients.end()) {
+                        apply_size_hints(it->second.size_hints, width, height);
+                    }
+                    show_outline(backend, root_window, start_win_x, start_win_y, width, height);
+                } else {
+                    pump_resize(backend);
+                }
+            } else if (is_moving && current_moving_window != None) {
+                int new_x = start_win_x + (event.xmotion.x_root - start_x);
+                int new_y = start_win_y + (event.xmotion.y_root - start_y);
+                if (snap_edges_dirty) {
+                    build_snap_edges(current_moving_window);
+                }
+                new_x += snap_offset(snap_edges_x, new_x, new_x + start_win_width + 2*border_width);
+                new_y += snap_offset(snap_edges_y, new_y, new_y + start_win_height + 2*border_width);
+                drag_moved = true;
+                if (outline_mode) {
+                    show_outline(backend, root_window, new_x, new_y, start_win_width, start_win_height);
+                    break;
+                }
+                backend->move_window(current_moving_window, new_x, new_y);
+                auto it = clients.find(current_moving_window);
+                if (it != clients.end()) {
+                    it->second.x = new_x;
+                    it->second.y = new_y;
+                    state_dirty = true;
+                    grid_update(current_moving_window, it->second);
+                }
+            }
+            break;
+        }
+
+        case ButtonRelease: {
+            if (is_resizing) {
+                // Kích thước cuối cùng luôn được gửi, không chờ client; cửa sổ tiling được đổi kích thước thì thành cửa sổ nổi
+                hide_outline(backend, root_window);
+                if (resize_width != resize_sent_width || resize_height != resize_sent_height) {
+                    send_resize(backend);
+                }
+                const Window window = current_resizing_window;
+                is_resizing = false;
+                current_resizing_window = None;
+                sync_waiting = false;
+                if (is_managed(window) && (resize_sent_width != start_win_width || resize_sent_height != start_win_height)) {
+                    set_floating(backend, window, true);
+                } else if (is_managed(window) && !clients[window].floating) {
+                    // Kích thước trở về như cũ nhưng layout có thể đã đổi trong lúc kéo: đưa cửa sổ về lại ô của nó
+                    tile_windows(backend);
+                }
+                backend->ungrab_pointer();
+                break;
+            }
+            // Cửa sổ tiling bị kéo đi thì trở thành cửa sổ nổi và nằm yên chỗ được thả: chỉ các cửa sổ
+            // tiling còn lại được sắp xếp lại một lần. Click không kéo, hoặc kéo cửa sổ nổi, không relayout.
+            if (is_moving && outline_shown) {
+                // Chế độ khung: cửa sổ chỉ di chuyển một lần, tới chỗ khung đang nằm
+                hide_outline(backend, root_window);
+                if (is_managed(current_moving_window)) {
+                    move_resize_client(backend, current_moving_window, outline_x, outline_y, start_win_width, start_win_height);
+                } else {
+                    backend->move_resize_window(current_moving_window, outline_x, outline_y, start_win_width, start_win_height);
+                    ++metrics.configures_sent;
+                }
+            }
+            if (is_moving && drag_moved && is_managed(current_moving_window)) {
+                set_floating(backend, current_moving_window, true);
+            }
+            is_moving = false;
+            current_moving_window = None;
+            backend->ungrab_pointer();
+            break;
+        }
 
-// Các biến toàn cục
-Atom WM_PROTOCOLS;
-Atom WM_DELETE_WINDOW;
-Atom NET_WM_NAME;
-Atom UTF8_STRING;
-// Các biến để quản lý việc di chuyển cửa sổ
-bool is_moving = false;
-int start_x, start_y;
-int start_win_x, start_win_y;
-Window current_moving_window = None;
+        case EnterNotify: {
+            if (event.xcrossing.window != root_window && event.xcrossing.window != focused_window) {
+                focus_window(backend, event.xcrossing.window);
+            }
+            break;
+        }
 
-// Các biến để quản lý layout và cửa sổ
-std::vector<Window> managed_windows;
-const float master_ratio = 0.6; // Cửa sổ chính chiếm 60% màn hình
-const int border_width = 2; // Chiều rộng viền cửa sổ
-const int statusbar_height = 20; // Chiều cao của thanh taskbar
-unsigned long focused_border_color;
-unsigned long unfocused_border_color;
-Window focused_window = None;
-Window statusbar_window = None;
+        case KeyRelease:
+            if (switching && (event.xkey.keycode == key_alt_l_keycode || event.xkey.keycode == key_alt_r_keycode)) {
+                switch_commit(backend);
+            }
+            break;
 
-// Xử lý lỗi X
-int x_error_handler(Display* display, XErrorEvent* error) {
-    char error_text[1024];
-    XGetErrorText(display, error->error_code, error_text, sizeof(error_text));
-    std::cerr << "X Error: " << error_text << " (Request: " << (int)error->request_code << ", Minor: " << (int)error->minor_code << ")" << std::endl;
-    return 0;
+        case KeyPress:
+            // Bàn phím đang bị grab: phím nào nhấn mà không còn giữ Alt nghĩa là Alt đã được nhả trước khi grab kịp
+            if (switching && !(event.xkey.state & Mod1Mask)) {
+                switch_commit(backend);
+            }
+            if (event.xkey.keycode == key_tab_keycode && (event.xkey.state & Mod1Mask)) {
+                switch_step(backend, root_window, event.xkey.state & ShiftMask);
+            } else if (event.xkey.keycode == key_enter_keycode && (event.xkey.state & Mod4Mask)) {
+                execute_command({"konsole"});
+            } else if (event.xkey.keycode == key_d_keycode && (event.xkey.state & Mod4Mask)) {
+                execute_command({"dmenu_run"});
+            } else if (event.xkey.keycode == key_e_keycode && (event.xkey.state & Mod4Mask)) {
+                execute_command({"dolphin"});
+            } else if (event.xkey.keycode == key_q_keycode && (event.xkey.state & Mod4Mask) && !(event.xkey.state & ShiftMask)) {
+                if (focused_window != None && focused_window != root_window) {
+                    close_window(backend, focused_window);
+                }
+            } else if (event.xkey.keycode == key_q_keycode && (event.xkey.state & Mod4Mask) && (event.xkey.state & ShiftMask)) {
+                if (focused_window != None && focused_window != root_window) {
+                    backend->kill_client(focused_window);
+                }
+            } else if (event.xkey.keycode == key_space_keycode && (event.xkey.state & Mod4Mask)) {
+                if (is_managed(focused_window) && focused_window != fullscreen_window) {
+                    set_floating(backend, focused_window, !clients[focused_window].floating);
+                }
+            } else if ((event.xkey.keycode == key_h_keycode || event.xkey.keycode == key_j_keycode
+                        || event.xkey.keycode == key_k_keycode || event.xkey.keycode == key_l_keycode) && (event.xkey.state & Mod4Mask)) {
+                // Super + H/J/K/L: focus cửa sổ kế bên theo hướng, thêm Shift: đổi chỗ với cửa sổ tiling kế bên
+                const Direction direction = event.xkey.keycode == key_h_keycode ? DIR_LEFT
+                                          : event.xkey.keycode == key_l_keycode ? DIR_RIGHT
+                                          : event.xkey.keycode == key_k_keycode ? DIR_UP : DIR_DOWN;
+                const bool swap = (event.xkey.state & ShiftMask) && is_managed(focused_window) && !clients[focused_window].floating;
+                Window neighbour = window_in_direction(focused_window, direction, swap);
+                if (neighbour == None) break;
+                if (swap) {
+                    std::iter_swap(std::find(managed_windows.begin(), managed_windows.end(), focused_window),
+                                   std::find(managed_windows.begin(), managed_windows.end(), neighbour));
+                    tile_windows(backend);
+                } else if (!(event.xkey.state & ShiftMask)) {
+                    focus_window(backend, neighbour);
+                    raise_client(backend, neighbour);
+                }
+            } else if (event.xkey.keycode == key_m_keycode && (event.xkey.state & Mod4Mask)) {
+                return false;
+            }
+            break;
+    
+        default:
+            // Client đã vẽ xong kích thước đang chờ: gửi ngay kích thước mới nhất (nếu có)
+            if (sync_event_base != 0 && event.type == sync_event_base + XSyncAlarmNotify) {
+                if (((XSyncAlarmNotifyEvent*)&event)->alarm == resize_alarm && sync_waiting) {
+                    sync_waiting = false;
+                    pump_resize(backend);
+                }
+            }
+            // Cửa sổ đã vẽ lại: ảnh thu nhỏ cũ hết hạn; nếu nó đang được hiện trong Alt+Tab thì chụp lại ngay.
+            // Với compositor, hình chữ nhật bao của vùng damage (tọa độ trong cửa sổ) được đưa vào khung sau.
+            if (damage_event_base != 0 && event.type == damage_event_base + XDamageNotify) {
+                const XDamageNotifyEvent* notify = (const XDamageNotifyEvent*)&event;
+                auto comp = comp_windows.find(notify->drawable);
+                if (comp != comp_windows.end() && comp->second.damage == notify->damage && notify->damage != None) {
+                    const CompWindow& w = comp->second;
+                    if (w.mapped) {
+                        comp_add_damage(w.x + w.border + notify->area.x, w.y + w.border + notify->area.y, notify->area.width, notify->area.height);
+                    }
+                    if (!w.damaged) {
+                        comp->second.damaged = true;
+                        comp_damaged.push_back(notify->drawable);
+                    }
+                }
+                auto it = clients.find(notify->drawable);
+                if (it != clients.end() && it->second.damage == notify->damage && notify->damage != None) {
+                    it->second.thumbnail_stale = true;
+                    if (switching && switch_target == &it->second) {
+                        show_switcher(backend, it->second);
+                    }
+                }
+            }
+            break;
+    }
+    return true;
 }
 
-// Chạy một lệnh trong một process con mới
-void execute_command(const std::vector<std::string>& command_args) {
-    pid_t pid = fork();
+// Cửa sổ mà sự kiện nói tới (với các sự kiện Substructure, xany.window là cửa sổ cha)
+Window event_window(const XEvent& event) {
+    switch (event.type) {
+        case CreateNotify: return event.xcreatewindow.window;
+        case MapRequest: return event.xmaprequest.window;
+        case ConfigureRequest: return event.xconfigurerequest.window;
+        case DestroyNotify: return event.xdestroywindow.window;
+        case UnmapNotify: return event.xunmap.window;
+        case ButtonPress:
+        case ButtonRelease: return event.xbutton.subwindow;
+        default: return event.xany.window;
+    }
+}
 
-    if (pid == 0) {
-        std::vector<char*> argv_c;
-        for (const auto& arg : command_args) {
-            argv_c.push_back(const_cast<char*>(arg.c_str()));
+// Bao quanh handle_event: ghi trace, đếm round trip, watchdog, histogram và span
+bool dispatch_event(XBackend* backend, Window root_window, XEvent& event) {
+    if (trace_file != nullptr) {
+        record_event(event);
+    }
+    const Window window = event_window(event);
+    const uint64_t dispatch_start = monotonic_ns();
+    begin_dispatch(backend, event.type);
+    watchdog_begin(event.type, window);
+    bool keep_running = handle_event(backend, root_window, event);
+    end_dispatch(backend, window);
+    watchdog_end();
+    record_latency(event.type, monotonic_ns() - dispatch_start);
+    trace_span(event_type_name(event.type), dispatch_start, window);
+    return keep_running;
+}
+
+// Chạy lõi WM trên MockBackend, không cần X server:
+//   --mock-bench <n>         đo thông lượng xử lý n sự kiện tổng hợp
+//   --mock-fuzz <n> [seed]   gửi n sự kiện ngẫu nhiên và kiểm tra các bất biến sau mỗi sự kiện
+//   --mock-test              chạy các kịch bản cố định
+const Window mock_root = 1;
+
+void setup_mock(MockBackend& mock) {
+    WM_PROTOCOLS = 100;
+    WM_DELETE_WINDOW = 101;
+    NET_WM_NAME = 102;
+    UTF8_STRING = 103;
+    COMPOUND_TEXT = 113;
+    NET_WM_WINDOW_TYPE = 104;
+    NET_WM_WINDOW_TYPE_DIALOG = 105;
+    NET_WM_WINDOW_TYPE_SPLASH = 106;
+    NET_WM_SYNC_REQUEST = 107;
+    NET_WM_SYNC_REQUEST_COUNTER = 108;
+    NET_WM_WINDOW_OPACITY = 109;
+    NET_WM_STATE = 110;
+    NET_WM_STATE_FULLSCREEN = 111;
+    NET_SUPPORTED = 112;
+    sync_event_base = 90;
+    focused_border_color = 0xffffff;
+    unfocused_border_color = 0x000000;
+    screen_width = 1920;
+    screen_height = 1080;
+    statusbar_window = 2;
+    switcher_window = 3;
+    damage_event_base = 95;
+    key_enter_keycode = 36;
+    key_d_keycode = 40;
+    key_e_keycode = 26;
+    key_q_keycode = 24;
+    key_m_keycode = 58;
+    key_space_keycode = 65;
+    key_h_keycode = 43;
+    key_j_keycode = 44;
+    key_k_keycode = 45;
+    key_l_keycode = 46;
+    key_tab_keycode = 23;
+    key_alt_l_keycode = 64;
+    key_alt_r_keycode = 108;
+    mock.windows[statusbar_window].mapped = true;
+}
+
+// Trả về mô tả lỗi nếu trạng thái của WM không nhất quán
+std::string check_invariants() {
+    for (size_t i = 0; i < managed_windows.size(); ++i) {
+        if (std::find(managed_windows.begin() + i + 1, managed_windows.end(), managed_windows[i]) != managed_windows.end()) {
+            return "window managed twice";
         }
-        argv_c.push_back(nullptr);
+        if (clients.find(managed_windows[i]) == clients.end()) {
+            return "managed window without client entry";
+        }
+    }
+    if (clients.size() != managed_windows.size()) {
+        return "client entry for unmanaged window";
+    }
+    for (Window window : managed_windows) {
+        const Client& client = clients[window];
+        int width = client.width, height = client.height;
+        apply_size_hints(client.size_hints, width, height, client.width, client.height);
+        // Cửa sổ nổi tự chọn kích thước qua ConfigureRequest, cửa sổ fullscreen luôn phủ cả màn hình,
+        // còn cửa sổ tiling bị nó che thì chỉ được xếp lại khi thoát fullscreen
+        if (!client.floating && !client.fullscreen && !relayout_pending && client.width > 0 && (width != client.width || height != client.height)) {
+            return "client size does not satisfy WM_NORMAL_HINTS";
+        }
+    }
+    // Lịch sử focus chứa đúng các cửa sổ được quản lý, liên kết hai chiều nhất quán
+    size_t mru_count = 0;
+    for (Client* c = mru_head; c != nullptr; c = c->mru_next) {
+        if (++mru_count > clients.size()) return "focus history has a cycle";
+        if (!is_managed(c->window) || &clients[c->window] != c) return "focus history holds an unmanaged window";
+        if ((c->mru_next != nullptr ? c->mru_next->mru_prev : mru_tail) != c) return "focus history links are inconsistent";
+    }
+    if (mru_count != managed_windows.size()) {
+        return "focus history does not cover every managed window";
+    }
+    if (focused_window != None && is_managed(focused_window) && mru_head != &clients[focused_window]) {
+        return "focused window is not at the head of the focus history";
+    }
+    if (!switching && switch_target != nullptr) {
+        return "switcher target left over after commit";
+    }
+    if (switcher_shown && !switching) {
+        return "switcher popup left on screen after commit";
+    }
+    for (Window window : managed_windows) {
+        const Client& client = clients[window];
+        if (thumbnails_enabled && client.damage == None) {
+            return "managed window without a damage object";
+        }
+        if (client.thumbnail.size() != (size_t)client.thumbnail_width * client.thumbnail_height
+            || client.thumbnail_width > thumbnail_max_width || client.thumbnail_height > thumbnail_max_height) {
+            return "thumbnail has the wrong size";
+        }
+    }
+    // Chỉ mục không gian phải khớp với vị trí và kích thước của từng client
+    size_t grid_entries = 0;
+    for (const auto& cell : grid_cells) grid_entries += cell.size();
+    size_t expected_entries = 0;
+    for (Window window : managed_windows) {
+        const Client& client = clients[window];
+        if (client.grid_col1 < 0) continue;
+        int col0, row0, col1, row1;
+        grid_span(client, col0, row0, col1, row1);
+        if (col0 != client.grid_col0 || row0 != client.grid_row0 || col1 != client.grid_col1 || row1 != client.grid_row1) {
+            return "spatial index span out of date";
+        }
+        for (int row = row0; row <= row1; ++row) {
+            for (int col = col0; col <= col1; ++col) {
+                const std::vector<Window>& cell = grid_at(col, row);
+                if (std::find(cell.begin(), cell.end(), window) == cell.end()) return "window missing from its spatial index cell";
+            }
+        }
+        expected_entries += (client.grid_col1 - client.grid_col0 + 1) * (client.grid_row1 - client.grid_row0 + 1);
+    }
+    if (grid_entries != expected_entries) {
+        return "spatial index has stale entries";
+    }
+    // Tìm theo hướng qua lưới phải cho cùng kết quả với duyệt hết mọi cửa sổ
+    if (is_managed(focused_window)) {
+        const Client& origin = clients[focused_window];
+        const int from_x = origin.x + origin.width / 2 + border_width, from_y = origin.y + origin.height / 2 + border_width;
+        for (int direction = DIR_LEFT; direction <= DIR_DOWN; ++direction) {
+            const bool horizontal = direction == DIR_LEFT || direction == DIR_RIGHT;
+            const int step = (direction == DIR_RIGHT || direction == DIR_DOWN) ? 1 : -1;
+            Window expected = None;
+            long expected_score = 0;
+            for (Window window : managed_windows) {
+                const Client& client = clients[window];
+                // Cửa sổ tiling mở ra dưới cửa sổ fullscreen chưa được xếp chỗ nên chưa nằm trong chỉ mục
+                if (window == focused_window || window == None || client.grid_col1 < 0) continue;
+                const int x = client.x + client.width / 2 + border_width, y = client.y + client.height / 2 + border_width;
+                const long along = step * (long)(horizontal ? x - from_x : y - from_y);
+                if (along <= 0) continue;
+                const long score = along + 2 * std::abs((long)(horizontal ? y - from_y : x - from_x));
+                if (expected == None || score < expected_score || (score == expected_score && window < expected)) {
+                    expected = window;
+                    expected_score = score;
+                }
+            }
+            if (window_in_direction(focused_window, (Direction)direction, false) != expected) {
+                return "directional focus disagrees with a full scan";
+            }
+        }
+    }
+    if (is_moving && current_moving_window == None) {
+        return "moving without a window";
+    }
+    if (is_resizing && current_resizing_window == None) {
+        return "resizing without a window";
+    }
+    if (outline_shown && !is_moving && !is_resizing) {
+        return "outline left on screen after the drag ended";
+    }
+    if (sync_waiting && !(is_resizing && resize_sync)) {
+        return "waiting for sync outside a synced resize";
+    }
+    size_t num_floating = 0;
+    for (Window window : managed_windows) {
+        if (clients[window].floating) {
+            ++num_floating;
+            if (std::find(floating_windows.begin(), floating_windows.end(), window) == floating_windows.end()) {
+                return "floating window missing from the floating layer";
+            }
+        }
+    }
+    if (num_floating != floating_windows.size()) {
+        return "floating layer out of sync with clients";
+    }
+    // Nhiều nhất một cửa sổ fullscreen, phủ đúng cả màn hình; layout chỉ bị hoãn khi nó còn đó
+    for (Window window : managed_windows) {
+        const Client& client = clients[window];
+        if (client.fullscreen != (fullscreen_window != None && window == fullscreen_window)) {
+            return "fullscreen flag out of sync with the fullscreen window";
+        }
+        if (client.fullscreen && (client.x != 0 || client.y != 0 || client.width != screen_width || client.height != screen_height)) {
+            return "fullscreen window does not cover the screen";
+        }
+    }
+    if (fullscreen_window != None && !is_managed(fullscreen_window)) {
+        return "fullscreen window is not managed";
+    }
+    if (relayout_pending && fullscreen_window == None) {
+        return "relayout still pending after leaving fullscreen";
+    }
+    return "";
+}
 
-        execvp(argv_c[0], argv_c.data());
-        std::cerr << "Error: Could not execute command: " << command_args[0] << std::endl;
-        _exit(1);
-    } else if (pid > 0) {
-        // Parent process
-    } else {
-        std::cerr << "Error: Could not create child process." << std::endl;
+int run_mock_bench(long num_events) {
+    MockBackend mock;
+    mock.record_requests = false;
+    setup_mock(mock);
+
+    // Vòng làm việc lặp lại: tạo và map cửa sổ, client tự đổi kích thước, rê chuột qua lại,
+    // kéo cửa sổ, rồi hủy cửa sổ cũ nhất khi có quá 16 cửa sổ
+    std::vector<Window> live;
+    Window next_window = 0x400000;
+    long processed = 0;
+    uint64_t busy_ns = 0;
+    XEvent event;
+    while (processed < num_events) {
+        Window window = next_window++;
+        mock.create(mock_root, window, 0, 0, 640, 480, true);
+        mock.windows[window].protocols.push_back(NET_WM_SYNC_REQUEST);
+        PropertyReply& counter = mock.windows[window].properties[NET_WM_SYNC_REQUEST_COUNTER];
+        uint32_t counter_id = 0x800000 + window;
+        counter.format = 32;
+        counter.value.assign((const char*)&counter_id, 4);
+        mock.request_map(mock_root, window);
+        mock.request_configure(mock_root, window, 10, 10, 800, 600);
+        live.push_back(window);
+        for (Window w : live) mock.enter(w);
+        mock.button(mock_root, ButtonPress, window, 1, 100, 100);
+        for (int i = 0; i < 32; ++i) mock.motion(mock_root, 100 + i, 100 + i);
+        mock.button(mock_root, ButtonRelease, window, 1, 132, 132);
+        // Thay đổi kích thước một client hỗ trợ sync, client trả lời ngay sau mỗi lần chuột di chuyển
+        mock.button(mock_root, ButtonPress, window, 3, 132, 132, Mod4Mask);
+        for (int i = 0; i < 16; ++i) {
+            mock.motion(mock_root, 132 + 4*i, 132 + 2*i);
+            mock.alarm_notify(mock.next_alarm - 1);
+        }
+        mock.button(mock_root, ButtonRelease, window, 3, 200, 170, Mod4Mask);
+        if (live.size() > 16) {
+            mock.destroy(mock_root, live.front());
+            live.erase(live.begin());
+        }
+
+        const uint64_t start = monotonic_ns();
+        while (mock.pending()) {
+            mock.next_event(&event);
+            dispatch_event(&mock, mock_root, event);
+            ++processed;
+        }
+        refresh_properties(&mock);
+        busy_ns += monotonic_ns() - start;
     }
+
+    std::cout << "Processed " << processed << " mock events in " << busy_ns / 1e6 << " ms ("
+              << (uint64_t)(processed / (busy_ns / 1e9)) << " events/s, " << mock.serial << " requests)" << std::endl;
+    std::cout << format_metrics() << format_round_trips();
+    return round_trip_budget_failed ? 3 : 0;
 }
 
-// Gửi yêu cầu đóng cửa sổ một cách lịch sự
-void close_window(Display* display, Window window) {
-    Atom* protocols = nullptr;
-    int count;
-    bool delete_supported = false;
-
-    if (XGetWMProtocols(display, window, &protocols, &count)) {
-        for (int i = 0; i < count; ++i) {
-            if (protocols[i] == WM_DELETE_WINDOW) {
-                delete_supported = true;
+int run_mock_fuzz(long num_events, unsigned seed) {
+    MockBackend mock;
+    setup_mock(mock);
+    thumbnails_enabled = true;
+    // Compositor cần MapNotify/ConfigureNotify thật để theo dõi cây cửa sổ
+    composite_enabled = true;
+    mock.structure_notify = true;
+    composite_overlay = mock.composite_start(mock_root);
+    composite_redirected = true;
+    // Thanh trạng thái và bảng Alt+Tab do chính WM tạo lúc khởi động, X server báo CreateNotify như mọi cửa sổ khác
+    mock.create(mock_root, statusbar_window, 0, 0, screen_width, 20, false);
+    mock.create(mock_root, switcher_window, 0, 0, 1, 1, false);
+    std::mt19937 rng(seed);
+    auto random_window = [&]() -> Window {
+        // Phần lớn là cửa sổ trong nhóm nhỏ để các sự kiện hay đụng nhau, đôi khi là root hoặc None
+        switch (rng() % 16) {
+            case 0: return None;
+            case 1: return mock_root;
+            case 2: return statusbar_window;
+            default: return 0x400000 + rng() % 12;
+        }
+    };
+    XEvent event;
+    for (long n = 0; n < num_events; ++n) {
+        Window window = random_window();
+        switch (rng() % 10) {
+            case 0: {
+                if (window == None || window == mock_root) break; // X server không bao giờ tạo cửa sổ 0, nó mang nghĩa "không có sibling"
+                // ID còn đang được dùng thì X server không cấp lại
+                if (is_managed(window) || std::find(mock.stacking.begin(), mock.stacking.end(), window) != mock.stacking.end()) break;
+                mock.create(mock_root, window, rng() % 2000, rng() % 1200, 1 + rng() % 1000, 1 + rng() % 800, rng() % 2);
+                if (rng() % 2) {
+                    // WM_NORMAL_HINTS ngẫu nhiên: min, max, bước tăng và base, đôi khi không thỏa mãn được
+                    uint32_t hints[18] = {};
+                    hints[0] = PMinSize | PMaxSize | PResizeInc | PBaseSize;
+                    hints[5] = rng() % 900;
+                    hints[6] = rng() % 700;
+                    hints[7] = rng() % 3 ? 0 : rng() % 2000;
+                    hints[8] = rng() % 3 ? 0 : rng() % 1200;
+                    hints[9] = 1 + rng() % 20;
+                    hints[10] = 1 + rng() % 20;
+                    hints[15] = rng() % 50;
+                    hints[16] = rng() % 50;
+                    if (rng() % 3 == 0) {
+                        // Tỉ lệ min/max, đôi khi rất hẹp hoặc ngược nhau
+                        hints[0] |= PAspect;
+                        hints[11] = 1 + rng() % 16;
+                        hints[12] = 1 + rng() % 16;
+                        hints[13] = 1 + rng() % 16;
+                        hints[14] = 1 + rng() % 16;
+                    }
+                    PropertyReply& reply = mock.windows[window].properties[XA_WM_NORMAL_HINTS];
+                    reply.type = XA_WM_SIZE_HINTS;
+                    reply.format = 32;
+                    reply.value.assign((const char*)hints, sizeof(hints));
+                }
+                if (rng() % 2) {
+                    // Client hỗ trợ _NET_WM_SYNC_REQUEST
+                    mock.windows[window].protocols.push_back(NET_WM_SYNC_REQUEST);
+                    PropertyReply& reply = mock.windows[window].properties[NET_WM_SYNC_REQUEST_COUNTER];
+                    uint32_t counter = 0x800000 + window;
+                    reply.format = 32;
+                    reply.value.assign((const char*)&counter, 4);
+                }
+                if (rng() % 4 == 0) {
+                    // Dialog hoặc transient của một cửa sổ khác (có thể chưa tồn tại, hoặc chính nó)
+                    PropertyReply& reply = mock.windows[window].properties[rng() % 2 ? XA_WM_TRANSIENT_FOR : NET_WM_WINDOW_TYPE];
+                    uint32_t value = rng() % 2 ? (uint32_t)NET_WM_WINDOW_TYPE_DIALOG : (uint32_t)random_window();
+                    reply.format = 32;
+                    reply.value.assign((const char*)&value, 4);
+                }
+                if (rng() % 8 == 0) {
+                    // Client xin fullscreen ngay từ lúc map
+                    PropertyReply& reply = mock.windows[window].properties[NET_WM_STATE];
+                    uint32_t state = NET_WM_STATE_FULLSCREEN;
+                    reply.type = XA_ATOM;
+                    reply.format = 32;
+                    reply.value.assign((const char*)&state, 4);
+                }
+                if (rng() % 4 == 0) {
+                    // Cửa sổ bán trong suốt: compositor không được bỏ qua nó dù nó phủ kín màn hình
+                    PropertyReply& reply = mock.windows[window].properties[NET_WM_WINDOW_OPACITY];
+                    uint32_t opacity = rng() % 2 ? 0x80000000 : 0xffffffff;
+                    reply.type = XA_CARDINAL;
+                    reply.format = 32;
+                    reply.value.assign((const char*)&opacity, 4);
+                }
+                break;
+            }
+            case 1:
+                // X server chỉ chuyển MapRequest của cửa sổ đang tồn tại
+                // (thanh trạng thái và bảng Alt+Tab là override-redirect nên không qua WM)
+                if (window != statusbar_window && window != switcher_window
+                    && std::find(mock.stacking.begin(), mock.stacking.end(), window) != mock.stacking.end()) {
+                    mock.request_map(mock_root, window);
+                }
+                break;
+            case 2: mock.request_configure(mock_root, window, (int)(rng() % 4000) - 2000, (int)(rng() % 4000) - 2000, 1 + rng() % 3000, 1 + rng() % 3000); break;
+            case 3: mock.enter(window); break;
+            case 4: mock.motion(mock_root, rng() % 1920, rng() % 1080); break;
+            case 5: mock.button(mock_root, ButtonPress, window, 1 + rng() % 3, rng() % 1920, rng() % 1080, rng() % 2 ? Mod4Mask : 0); break;
+            case 6:
+                if (rng() % 2) {
+                    mock.button(mock_root, ButtonRelease, window, 1 + rng() % 3, rng() % 1920, rng() % 1080);
+                } else {
+                    // Alarm của lần resize hiện tại, hoặc của một alarm cũ/lạ
+                    mock.alarm_notify(rng() % 2 ? resize_alarm : mock.next_alarm + rng() % 4);
+                }
+                break;
+            case 7: {
+                const KeyCode keys[] = { key_q_keycode, key_space_keycode, key_h_keycode, key_j_keycode, key_k_keycode, key_l_keycode };
+                switch (rng() % 4) {
+                    case 0: mock.key(mock_root, key_tab_keycode, Mod1Mask | (rng() % 2 ? ShiftMask : 0)); break;
+                    case 1: mock.key(mock_root, key_alt_l_keycode, Mod1Mask, KeyRelease); break;
+                    default: mock.key(mock_root, keys[rng() % 6], Mod4Mask | (rng() % 2 ? ShiftMask : 0)); break;
+                }
+                break;
+            }
+            case 8:
+                if (rng() % 2) {
+                    mock.destroy(mock_root, window);
+                } else {
+                    mock.unmap(mock_root, window);
+                }
+                break;
+            case 9: {
+                if (rng() % 3 == 0) {
+                    mock.damage_notify(window, rng() % 1200, rng() % 900, 1 + rng() % 800, 1 + rng() % 600);
+                    break;
+                }
+                if (rng() % 3 == 0) {
+                    // _NET_WM_STATE: bỏ, thêm hoặc đảo fullscreen (ở vị trí thứ nhất hoặc thứ hai), đôi khi hành động lạ
+                    XEvent& e = mock.push(ClientMessage, window);
+                    e.xclient.message_type = NET_WM_STATE;
+                    e.xclient.format = 32;
+                    e.xclient.data.l[0] = rng() % 4;
+                    e.xclient.data.l[1 + rng() % 2] = NET_WM_STATE_FULLSCREEN;
+                    break;
+                }
+                XEvent& e = mock.push(rng() % 2 ? PropertyNotify : Expose, rng() % 8 ? window : switcher_window);
+                const Atom atoms[] = { NET_WM_NAME, XA_WM_NAME, XA_WM_NORMAL_HINTS, NET_WM_WINDOW_OPACITY };
+                e.xproperty.atom = atoms[rng() % 4];
                 break;
             }
         }
-        XFree(protocols);
+        // Bật/tắt chế độ khung giữa các lần kéo, giống như chạy lại WM với --outline
+        if (!is_moving && !is_resizing && rng() % 64 == 0) {
+            outline_mode = !outline_mode;
+        }
+        // Đổi layout qua IPC (nothingctl layout tile|monocle)
+        if (rng() % 64 == 0) {
+            current_layout = current_layout == LAYOUT_MONOCLE ? LAYOUT_TILE : LAYOUT_MONOCLE;
+            tile_windows(&mock);
+        }
+        // Cửa sổ có ảnh thu nhỏ còn mới trước đợt này thì không được chụp lại trong đợt
+        std::vector<Window> fresh_thumbnails;
+        for (const auto& entry : clients) {
+            if (!entry.second.thumbnail_stale && !entry.second.thumbnail.empty()) fresh_thumbnails.push_back(entry.first);
+        }
+        bool damage_in_batch = false;
+        // Kiểm tra sau mỗi đợt, giống vòng lặp chính: thuộc tính được làm mới ở cuối đợt cho tới khi hàng đợi
+        // trống, rồi vẽ khung (bỏ qua nhịp khung để mỗi đợt đều được vẽ)
+        do {
+            while (mock.pending()) {
+                mock.next_event(&event);
+                damage_in_batch |= event.type == damage_event_base + XDamageNotify;
+                dispatch_event(&mock, mock_root, event);
+            }
+            refresh_properties(&mock);
+        } while (mock.pending());
+        comp_last_frame_ns = 0;
+        composite_frame(&mock, mock_root);
+        std::string error = check_invariants();
+        // _NET_WM_STATE mà client thấy phải khớp với trạng thái fullscreen của WM
+        if (error.empty() && fullscreen_window != None) {
+            const std::vector<Atom> state = mock.windows[fullscreen_window].properties[NET_WM_STATE].atoms();
+            if (std::find(state.begin(), state.end(), NET_WM_STATE_FULLSCREEN) == state.end()) {
+                error = "fullscreen window does not advertise _NET_WM_STATE_FULLSCREEN";
+            }
+            // Không cửa sổ nào được nằm trên cửa sổ fullscreen, trừ dialog của chính nó
+            auto it = std::find(mock.stacking.begin(), mock.stacking.end(), fullscreen_window);
+            if (it != mock.stacking.end()) {
+                for (++it; it != mock.stacking.end(); ++it) {
+                    if (error.empty() && is_managed(*it) && !(clients[*it].floating && clients[*it].transient_for == fullscreen_window)) {
+                        error = "managed window stacked above the fullscreen window";
+                    }
+                }
+            }
+        }
+        // nothingctl window_at phải trả về cửa sổ được quản lý trên cùng tại điểm đó theo thứ tự xếp chồng
+        // của X server (trừ lúc đang kéo, khi client chưa kịp theo kích thước mới)
+        if (error.empty() && !is_moving && !is_resizing) {
+            const long x = rng() % screen_width, y = rng() % screen_height;
+            Window expected = None;
+            for (auto it = mock.stacking.rbegin(); it != mock.stacking.rend() && expected == None; ++it) {
+                const MockWindow& w = mock.windows[*it];
+                if (is_managed(*it) && w.mapped && x >= w.x && y >= w.y
+                    && x < w.x + (long)w.width + 2*(long)w.border && y < w.y + (long)w.height + 2*(long)w.border) {
+                    expected = *it;
+                }
+            }
+            // (thứ tự giữa các cửa sổ tiling bị che trong monocle thì WM không theo dõi)
+            const Window actual = window_at(x, y);
+            const bool hidden_tiled = current_layout == LAYOUT_MONOCLE && is_managed(actual) && is_managed(expected)
+                                      && !clients[actual].floating && !clients[expected].floating
+                                      && actual != top_tiled_window && expected != top_tiled_window;
+            if (actual != expected && !hidden_tiled) {
+                error = "window_at does not match the stacking order";
+            }
+        }
+        // Compositor phải thấy đúng cây cửa sổ của X server: thứ tự xếp chồng, vị trí, trạng thái map
+        if (error.empty()) {
+            std::vector<Window> expected_stack;
+            for (Window window : mock.stacking) {
+                if (comp_windows.count(window)) expected_stack.push_back(window);
+            }
+            if (expected_stack != comp_stack || comp_stack.size() != comp_windows.size()) {
+                error = "compositor stacking order does not match the server";
+            }
+            // (mock chấp nhận kích thước 0, compositor coi nó như 1)
+            for (const auto& entry : comp_windows) {
+                auto it = mock.windows.find(entry.first);
+                if (error.empty() && (it == mock.windows.end() || it->second.x != entry.second.x || it->second.y != entry.second.y
+                                      || std::max(1, (int)it->second.width) != entry.second.width || std::max(1, (int)it->second.height) != entry.second.height
+                                      || (int)it->second.border != entry.second.border || it->second.mapped != entry.second.mapped)) {
+                    error = "compositor window state does not match the server";
+                }
+            }
+            if (error.empty() && (composite_redirected != (comp_fullscreen_window() == None) || mock.redirected != composite_redirected)) {
+                error = "compositor bypass does not match the topmost window";
+            }
+            for (const XRectangle& r : mock.painted_region) {
+                if (error.empty() && (r.width == 0 || r.height == 0 || r.x < 0 || r.y < 0 || r.x + r.width > screen_width || r.y + r.height > screen_height)) {
+                    error = "painted region lies outside the screen";
+                }
+            }
+            mock.painted_region.clear();
+            // Khung --outline do compositor vẽ phải hiện đúng chỗ, và biến mất khi hết kéo
+            // (khung có cả bốn cạnh nằm ngoài màn hình thì không có gì để vẽ)
+            auto on_screen = [](int x, int y, int width, int height) {
+                auto visible = [](int x, int y, int width, int height) {
+                    return x < screen_width && y < screen_height && x + width > 0 && y + height > 0;
+                };
+                return visible(x, y, width, outline_line_width) || visible(x, y + height - outline_line_width, width, outline_line_width)
+                       || visible(x, y, outline_line_width, height) || visible(x + width - outline_line_width, y, outline_line_width, height);
+            };
+            const XRectangle& painted = mock.painted_outline;
+            const bool painted_visible = mock.outline_painted && on_screen(painted.x, painted.y, painted.width, painted.height);
+            const bool outline_visible = outline_shown && outline_composited && on_screen(outline_x, outline_y, outline_width, outline_height);
+            if (error.empty() && composite_redirected && (painted_visible != outline_visible
+                || (outline_visible && (painted.x != outline_x || painted.y != outline_y
+                                        || painted.width != outline_width || painted.height != outline_height)))) {
+                error = "compositor outline does not match the drag";
+            }
+        }
+        // Khung XOR chỉ được vẽ khi server đang bị grab, và grab phải được thả khi khung biến mất
+        if (error.empty() && mock.server_grabbed != (outline_shown && !outline_composited)) {
+            error = "server grab does not match the XOR outline";
+        }
+        // Trong lúc Alt+Tab, mỗi lần nhấn Tab chỉ được đổi màu viền, không focus hay xếp chồng lại
+        if (error.empty() && switching && event.type == KeyPress && event.xkey.keycode == key_tab_keycode) {
+            for (const MockRequest& request : mock.requests) {
+                if ((strcmp(request.op, "SetInputFocus") == 0 || strcmp(request.op, "RaiseWindow") == 0 || strcmp(request.op, "ConfigureWindow") == 0)
+                    && request.window != switcher_window) {
+                    error = "Alt+Tab step sent a focus or restack request";
+                }
+            }
+        }
+        // Ảnh thu nhỏ phải là nội dung (màu đồng nhất) của đúng cửa sổ đó, và chỉ được chụp lại sau DamageNotify
+        for (const MockRequest& request : mock.requests) {
+            if (error.empty() && strcmp(request.op, "CaptureWindow") == 0 && !damage_in_batch
+                && std::find(fresh_thumbnails.begin(), fresh_thumbnails.end(), request.window) != fresh_thumbnails.end()) {
+                error = "unchanged window was captured again";
+            }
+        }
+        if (error.empty() && switching && switch_target != nullptr) {
+            const uint32_t expected = MockBackend::mock_window_pixel(switch_target->window);
+            for (uint32_t pixel : switch_target->thumbnail) {
+                if (pixel != expected) {
+                    error = "thumbnail does not match the window contents";
+                    break;
+                }
+            }
+        }
+        if (!error.empty()) {
+            std::cerr << "Fuzz failure after event " << n << " (" << event_type_name(event.type) << ", window " << event.xany.window
+                      << ", seed " << seed << "): " << error << std::endl;
+            return 1;
+        }
+        mock.requests.clear();
     }
-    
-    if (delete_supported) {
-        XClientMessageEvent cm;
-        memset(&cm, 0, sizeof(cm));
-
-        cm.type = ClientMessage;
-        cm.window = window;
-        cm.message_type = WM_PROTOCOLS;
-        cm.format = 32;
-        cm.data.l[0] = WM_DELETE_WINDOW;
-        cm.data.l[1] = CurrentTime;
-
-        XSendEvent(display, window, False, NoEventMask, (XEvent*)&cm);
-        std::cout << "Sent polite close request to window " << window << std::endl;
-    } else {
-        std::cerr << "Window " << window << " does not support WM_DELETE_WINDOW. Attempting forceful kill." << std::endl;
-        XKillClient(display, window);
+    if (round_trip_budget_failed) {
+        std::cerr << "Fuzz failure (seed " << seed << "): round-trip budget exceeded" << std::endl << format_round_trips();
+        return 3;
     }
+    std::cout << "Fuzzed " << num_events << " events with seed " << seed << ", no invariant violations." << std::endl;
+    return 0;
 }
 
-// Hàm tiling chính
-void tile_windows(Display* display, Window root_window) {
-    if (managed_windows.empty()) return;
+// Các kịch bản cố định, mỗi kịch bản kiểm tra một lỗi đã gặp
+int run_mock_tests() {
+    MockBackend mock;
+    setup_mock(mock);
+    XEvent event;
+    auto drain = [&]() {
+        while (mock.pending()) {
+            mock.next_event(&event);
+            dispatch_event(&mock, mock_root, event);
+        }
+        refresh_properties(&mock);
+    };
+    auto set_fullscreen_state = [&](Window window, long action) {
+        XEvent& e = mock.push(ClientMessage, window);
+        e.xclient.message_type = NET_WM_STATE;
+        e.xclient.format = 32;
+        e.xclient.data.l[0] = action;
+        e.xclient.data.l[1] = NET_WM_STATE_FULLSCREEN;
+        drain();
+    };
+    int failures = 0;
+    auto expect = [&](bool condition, const char* what) {
+        if (!condition) {
+            std::cerr << "Mock test failed: " << what << std::endl;
+            ++failures;
+        }
+    };
 
-    XWindowAttributes root_attrs;
-    XGetWindowAttributes(display, root_window, &root_attrs);
-    
-    const int num_windows = managed_windows.size();
-    const int screen_width = root_attrs.width;
-    const int screen_height = root_attrs.height;
-    
-    if (num_windows == 1) {
-        XMoveResizeWindow(display, managed_windows[0], 0, statusbar_height, screen_width - 2*border_width, screen_height - statusbar_height - 2*border_width);
-        return;
+    // Monocle + fullscreen: đổi focus (IPC, Alt+Tab, đóng cửa sổ) không được đưa cửa sổ khác lên trên cửa sổ fullscreen
+    const Window a = 0x400001, b = 0x400002, c = 0x400003;
+    for (Window window : { a, b, c }) {
+        mock.create(mock_root, window, 0, 0, 640, 480, true);
+        mock.request_map(mock_root, window);
     }
-    
-    const int master_width = screen_width * master_ratio;
-    XMoveResizeWindow(display, managed_windows[0], 0, statusbar_height, master_width - 2*border_width, screen_height - statusbar_height - 2*border_width);
+    drain();
+    current_layout = LAYOUT_MONOCLE;
+    tile_windows(&mock);
+    drain();
+    set_fullscreen_state(b, 1);
+    expect(fullscreen_window == b && mock.stacking.back() == b, "fullscreen window is raised");
+    focus_window(&mock, a);
+    drain();
+    expect(focused_window == a && mock.stacking.back() == b, "focusing another window in monocle keeps fullscreen on top");
+    expect(window_at(100, 100) == b, "window_at returns the fullscreen window");
+    mock.key(mock_root, key_tab_keycode, Mod1Mask);
+    mock.key(mock_root, key_alt_l_keycode, Mod1Mask, KeyRelease);
+    drain();
+    expect(mock.stacking.back() == b, "Alt+Tab in monocle keeps fullscreen on top");
+    mock.destroy(mock_root, a);
+    drain();
+    expect(mock.stacking.back() == b, "refocus after unmanage keeps fullscreen on top");
+    set_fullscreen_state(b, 0);
+    expect(fullscreen_window == None && mock.stacking.back() == focused_window, "leaving fullscreen restores monocle stacking");
+    expect(window_at(100, 100) == mock.stacking.back(), "window_at returns the visible monocle window");
 
-    const int stack_width = screen_width - master_width;
-    const int stack_height = (screen_height - statusbar_height) / (num_windows - 1);
-    
-    for (int i = 1; i < num_windows; ++i) {
-        XMoveResizeWindow(display, managed_windows[i], 
-                          master_width, 
-                          (i - 1) * stack_height + statusbar_height,
-                          stack_width - 2*border_width,
-                          stack_height - 2*border_width);
+    // Gói lệnh IPC: lỗi ở bất kỳ dòng nào thì không lệnh nào được áp dụng; gói hợp lệ chỉ tile lại một lần ở cuối
+    IpcClient client;
+    client.fd = -1;
+    client.closed = false;
+    const std::vector<Window> order = managed_windows;
+    std::string reply = ipc_execute_batch(&mock, client, "move 0x400003 0\nlayout tile\nstate\n");
+    expect(reply == "error: line 3: state page unavailable\n" && managed_windows == order && current_layout == LAYOUT_MONOCLE,
+           "IPC batch with an unavailable state page is rejected before anything runs");
+    reply = ipc_execute_batch(&mock, client, "layout tile\nfocus 0x400001\n");
+    expect(reply.compare(0, 14, "error: line 2:") == 0 && current_layout == LAYOUT_MONOCLE, "IPC batch naming an unmanaged window is rejected");
+    mock.requests.clear();
+    reply = ipc_execute_batch(&mock, client, "move 0x400003 0\nlayout tile\nfocus 0x400002\ntree\n");
+    size_t configures = 0;
+    for (const MockRequest& request : mock.requests) {
+        if (strcmp(request.op, "MoveResizeWindow") == 0 && request.window == c) ++configures;
     }
-}
+    expect(managed_windows.front() == c && current_layout == LAYOUT_TILE && focused_window == b, "IPC batch applies every command");
+    expect(reply == "layout tile\n0 0x400003\n1 0x400002 focused\nok\n", "IPC batch replies with the tree and ok");
+    expect(configures == 1 && mock.windows[c].x == 0 && mock.windows[b].x > 0, "IPC batch is tiled once, after the last command");
+    tracing_enabled = true;
+    trace_ring.resize(trace_ring_size);
+    reply = ipc_execute_batch(&mock, client, "trace /nonexistent/nothingwm-trace.json\n");
+    expect(reply == "error: could not write /nonexistent/nothingwm-trace.json\n", "failed trace write is not followed by ok");
+    tracing_enabled = false;
 
-// Hàm đặt màu viền cho cửa sổ
-void set_window_border(Display* display, Window window, bool is_focused) {
-    if (is_focused) {
-        XSetWindowBorder(display, window, focused_border_color);
-    } else {
-        XSetWindowBorder(display, window, unfocused_border_color);
+    // Dialog được ẩn rồi hiện lại: MapRequest lần hai dùng kích thước đã nhớ, không hỏi X server
+    const Window d = 0x400004;
+    mock.create(mock_root, d, 0, 0, 300, 200, true);
+    PropertyReply& transient = mock.windows[d].properties[XA_WM_TRANSIENT_FOR];
+    const uint32_t parent = (uint32_t)b;
+    transient.format = 32;
+    transient.value.assign((const char*)&parent, 4);
+    mock.request_map(mock_root, d);
+    drain();
+    expect(is_managed(d) && clients[d].floating && clients[d].width == 300, "dialog is mapped floating at its requested size");
+    mock.unmap(mock_root, d);
+    drain();
+    mock.requests.clear();
+    mock.request_map(mock_root, d);
+    drain();
+    bool geometry_query = false;
+    for (const MockRequest& request : mock.requests) {
+        geometry_query |= strcmp(request.op, "GetGeometry") == 0;
     }
-}
+    expect(is_managed(d) && clients[d].width == 300 && !geometry_query, "re-shown dialog is placed without a GetGeometry round trip");
 
-// Hàm vẽ lại thanh taskbar
-void draw_statusbar(Display* display) {
-    XClearWindow(display, statusbar_window);
-    
-    XWindowAttributes attrs;
-    XGetWindowAttributes(display, statusbar_window, &attrs);
-    
-    XGCValues gcv;
-    GC gc = XCreateGC(display, statusbar_window, 0, &gcv);
-    XSetForeground(display, gc, XWhitePixel(display, DefaultScreen(display)));
-    
-    // Lấy thông tin từ thuộc tính _NET_WM_NAME của cửa sổ gốc
-    Atom actual_type;
-    int actual_format;
-    unsigned long nitems, bytes_after;
-    unsigned char* prop;
-    
-    if (XGetWindowProperty(display, DefaultRootWindow(display), NET_WM_NAME, 0, 1024, False, UTF8_STRING, &actual_type, &actual_format, &nitems, &bytes_after, &prop) == Success && nitems > 0) {
-        XDrawString(display, statusbar_window, gc, 5, 15, (const char*)prop, nitems);
-        XFree(prop);
+    // WM_NAME không phải STRING (COMPOUND_TEXT) vẫn cho tiêu đề; STRING là Latin-1 và được chuyển sang UTF-8
+    const Window e = 0x400005, f = 0x400006;
+    const std::pair<Window, std::pair<Atom, std::string>> names[] = { { e, { COMPOUND_TEXT, "Terminal" } }, { f, { XA_STRING, "caf\xe9" } } };
+    for (const auto& name : names) {
+        mock.create(mock_root, name.first, 0, 0, 640, 480, true);
+        mock.windows[name.first].title.clear();
+        PropertyReply& wm_name = mock.windows[name.first].properties[XA_WM_NAME];
+        wm_name.type = name.second.first;
+        wm_name.format = 8;
+        wm_name.value = name.second.second;
+        mock.request_map(mock_root, name.first);
     }
-    XFreeGC(display, gc);
+    drain();
+    expect(is_managed(e) && clients[e].title == "Terminal", "COMPOUND_TEXT WM_NAME becomes the title");
+    expect(is_managed(f) && clients[f].title == "caf\xc3\xa9", "Latin-1 WM_NAME is converted to UTF-8");
+
+    expect(!round_trip_budget_failed, "no handler went over its round-trip budget");
+    if (failures == 0) std::cout << "All mock tests passed." << std::endl;
+    return failures == 0 ? 0 : 1;
 }
 
-int main() {
+int main(int argc, char** argv) {
     Display* display;
     Window root_window;
 
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            if (!start_recording(argv[++i])) return 1;
+        } else if (strcmp(argv[i], "--outline") == 0) {
+            outline_mode = true;
+        } else if (strcmp(argv[i], "--thumbnails") == 0) {
+            thumbnails_enabled = true;
+        } else if (strcmp(argv[i], "--composite") == 0) {
+            composite_enabled = true;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            tracing_enabled = true;
+            trace_ring.resize(trace_ring_size);
+        } else if (strcmp(argv[i], "--mock-bench") == 0 && i + 1 < argc) {
+            init_round_trip_budget();
+            return run_mock_bench(atol(argv[i + 1]));
+        } else if (strcmp(argv[i], "--mock-test") == 0) {
+            init_round_trip_budget();
+            return run_mock_tests();
+        } else if (strcmp(argv[i], "--mock-fuzz") == 0 && i + 1 < argc) {
+            init_round_trip_budget();
+            return run_mock_fuzz(atol(argv[i + 1]), i + 2 < argc ? strtoul(argv[i + 2], nullptr, 0) : 1);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--record <trace-file>] [--trace] [--outline] [--thumbnails] [--composite] | --mock-bench <events> | --mock-fuzz <events> [seed] | --mock-test" << std::endl;
+            return 1;
+        }
+    }
+
     display = XOpenDisplay(NULL);
     if (display == NULL) {
         std::cerr << "Could not connect to X server!" << std::endl;
@@ -173,8 +4584,61 @@ int main() {
     WM_DELETE_WINDOW = XInternAtom(display, "WM_DELETE_WINDOW", False);
     NET_WM_NAME = XInternAtom(display, "_NET_WM_NAME", False);
     UTF8_STRING = XInternAtom(display, "UTF8_STRING", False);
+    // Xlib tra atom này khi chuyển COMPOUND_TEXT; intern trước để nó nằm sẵn trong bộ đệm atom, MapRequest không phải chờ
+    COMPOUND_TEXT = XInternAtom(display, "COMPOUND_TEXT", False);
+    NET_WM_WINDOW_TYPE = XInternAtom(display, "_NET_WM_WINDOW_TYPE", False);
+    NET_WM_WINDOW_TYPE_DIALOG = XInternAtom(display, "_NET_WM_WINDOW_TYPE_DIALOG", False);
+    NET_WM_WINDOW_TYPE_SPLASH = XInternAtom(display, "_NET_WM_WINDOW_TYPE_SPLASH", False);
+    NET_WM_SYNC_REQUEST = XInternAtom(display, "_NET_WM_SYNC_REQUEST", False);
+    NET_WM_SYNC_REQUEST_COUNTER = XInternAtom(display, "_NET_WM_SYNC_REQUEST_COUNTER", False);
+    NET_WM_WINDOW_OPACITY = XInternAtom(display, "_NET_WM_WINDOW_OPACITY", False);
+    NET_WM_STATE = XInternAtom(display, "_NET_WM_STATE", False);
+    NET_WM_STATE_FULLSCREEN = XInternAtom(display, "_NET_WM_STATE_FULLSCREEN", False);
+    NET_SUPPORTED = XInternAtom(display, "_NET_SUPPORTED", False);
+
+    // Extension SYNC cho resize đồng bộ với client; không có thì resize chỉ bị giới hạn tần suất
+    int sync_error_base, sync_major, sync_minor;
+    if (!XSyncQueryExtension(display, &sync_event_base, &sync_error_base) || !XSyncInitialize(display, &sync_major, &sync_minor)) {
+        std::cerr << "Warning: SYNC extension not available, resize falls back to rate limiting." << std::endl;
+        sync_event_base = 0;
+    }
+
+    // Ảnh thu nhỏ và compositor cần COMPOSITE và DAMAGE; ảnh thu nhỏ cần thêm MIT-SHM, compositor cần
+    // COMPOSITE >= 0.3 (cửa sổ overlay), RENDER và XFIXES >= 2 (vùng input rỗng cho overlay)
+    if (thumbnails_enabled || composite_enabled) {
+        int composite_event_base, composite_error_base, render_event_base, render_error_base;
+        int fixes_event_base, fixes_error_base;
+        int composite_major = 0, composite_minor = 3, fixes_major = 2, fixes_minor = 0;
+        const bool composite = XCompositeQueryExtension(display, &composite_event_base, &composite_error_base)
+                               && XCompositeQueryVersion(display, &composite_major, &composite_minor);
+#if HAVE_XDAMAGE
+        int damage_error_base, damage_major = 1, damage_minor = 1;
+        const bool damage = XDamageQueryExtension(display, &damage_event_base, &damage_error_base)
+                            && XDamageQueryVersion(display, &damage_major, &damage_minor);
+#else
+        std::cerr << "Warning: built without libXdamage." << std::endl;
+        const bool damage = false;
+#endif
+        if (thumbnails_enabled && !(composite && damage && (composite_major > 0 || composite_minor >= 2) && XShmQueryExtension(display))) {
+            std::cerr << "Warning: COMPOSITE, DAMAGE or MIT-SHM extension not available, thumbnails disabled." << std::endl;
+            thumbnails_enabled = false;
+        }
+        if (composite_enabled && !(composite && damage && (composite_major > 0 || composite_minor >= 3)
+                                   && XRenderQueryExtension(display, &render_event_base, &render_error_base)
+                                   && XFixesQueryExtension(display, &fixes_event_base, &fixes_error_base)
+                                   && XFixesQueryVersion(display, &fixes_major, &fixes_minor) && fixes_major >= 2)) {
+            std::cerr << "Warning: COMPOSITE, DAMAGE, RENDER or XFIXES extension not available, compositing disabled." << std::endl;
+            composite_enabled = false;
+        }
+        if (!damage || (!thumbnails_enabled && !composite_enabled)) {
+            damage_event_base = 0;
+        }
+    }
 
     XSetErrorHandler(x_error_handler);
+    init_round_trip_budget();
+    XcbBackend xcb_backend(display);
+    XBackend* backend = &xcb_backend;
 
     root_window = DefaultRootWindow(display);
     std::cout << "Root window ID: " << root_window << std::endl;
@@ -183,20 +4647,39 @@ int main() {
     unfocused_border_color = XBlackPixel(display, DefaultScreen(display));
 
     XSelectInput(display, root_window, SubstructureNotifyMask | SubstructureRedirectMask | KeyPressMask | ButtonPressMask | EnterWindowMask | PropertyChangeMask);
+    // Client (trình phát video, game) chỉ xin fullscreen qua _NET_WM_STATE khi WM khai báo hỗ trợ nó
+    backend->set_atom_property(root_window, NET_SUPPORTED, { NET_WM_NAME, NET_WM_WINDOW_TYPE, NET_WM_WINDOW_TYPE_DIALOG,
+                                                             NET_WM_WINDOW_TYPE_SPLASH, NET_WM_SYNC_REQUEST, NET_WM_STATE,
+                                                             NET_WM_STATE_FULLSCREEN });
 
     XSetWindowAttributes attributes;
     attributes.event_mask = SubstructureNotifyMask | SubstructureRedirectMask | KeyPressMask | ButtonPressMask | EnterWindowMask | PropertyChangeMask;
     attributes.border_pixel = unfocused_border_color;
     
     // Tạo cửa sổ taskbar
-    XWindowAttributes root_attrs;
-    XGetWindowAttributes(display, root_window, &root_attrs);
-    statusbar_window = XCreateSimpleWindow(display, root_window, 0, 0, root_attrs.width, statusbar_height, 0,
+    GeometryReply root_geometry;
+    backend->get_geometry_reply(backend->get_geometry(root_window), root_geometry);
+    screen_width = root_geometry.width;
+    screen_height = root_geometry.height;
+    statusbar_window = XCreateSimpleWindow(display, root_window, 0, 0, screen_width, statusbar_height, 0,
                                            XBlackPixel(display, DefaultScreen(display)), XBlackPixel(display, DefaultScreen(display)));
     XMapWindow(display, statusbar_window);
+    update_status_text(backend, root_window);
     
     // Lắng nghe các sự kiện cần thiết trên cửa sổ taskbar
     XSelectInput(display, statusbar_window, ExposureMask);
+
+    if (thumbnails_enabled) {
+        // X server giữ nội dung mọi cửa sổ trong pixmap riêng nhưng vẫn tự vẽ lên màn hình như bình thường
+        // (với --composite thì redirect thủ công thay thế cho chế độ này)
+        if (!composite_enabled) XCompositeRedirectSubwindows(display, root_window, CompositeRedirectAutomatic);
+        XSetWindowAttributes switcher_attributes;
+        switcher_attributes.override_redirect = True;
+        switcher_attributes.background_pixel = XBlackPixel(display, DefaultScreen(display));
+        switcher_attributes.event_mask = ExposureMask;
+        switcher_window = XCreateWindow(display, root_window, 0, 0, 1, 1, 0, CopyFromParent, InputOutput, CopyFromParent,
+                                        CWOverrideRedirect | CWBackPixel | CWEventMask, &switcher_attributes);
+    }
     
     XGrabServer(display);
     if (!XChangeWindowAttributes(display, root_window, CWEventMask, &attributes)) {
@@ -208,176 +4691,158 @@ int main() {
     XUngrabServer(display);
     std::cout << "Became Window Manager (or attempted to)." << std::endl;
     
-    Window* children;
-    unsigned int n_children;
-    XQueryTree(display, root_window, &root_window, &root_window, &children, &n_children);
-    if (children) {
-        for (unsigned int i = 0; i < n_children; ++i) {
-            XSetWindowBorderWidth(display, children[i], border_width);
-            set_window_border(display, children[i], false);
-            // Thay đổi vị trí của các cửa sổ có sẵn để không bị taskbar che
-            XWindowAttributes child_attrs;
-            XGetWindowAttributes(display, children[i], &child_attrs);
-            if (child_attrs.y < statusbar_height) {
-                XMoveWindow(display, children[i], child_attrs.x, child_attrs.y + statusbar_height);
-            }
+    if (composite_enabled) {
+        composite_overlay = backend->composite_start(root_window);
+        composite_redirected = true;
+        comp_add_damage(0, 0, screen_width, screen_height);
+    }
+
+    // Gửi truy vấn vị trí của mọi cửa sổ có sẵn trước, rồi mới lấy trả lời: một round trip cho cả cây
+    std::vector<Window> children;
+    backend->query_tree_reply(backend->query_tree(root_window), children);
+    // Compositor phải biết mọi cửa sổ đang có, theo đúng thứ tự xếp chồng (QueryTree trả về từ dưới lên)
+    for (Window child : children) {
+        XWindowAttributes child_attributes;
+        if (composite_enabled && child != composite_overlay && XGetWindowAttributes(display, child, &child_attributes)) {
+            comp_add_window(backend, child, child_attributes.x, child_attributes.y, child_attributes.width, child_attributes.height,
+                            child_attributes.border_width);
+            comp_windows[child].mapped = child_attributes.map_state != IsUnmapped;
+        }
+    }
+    std::vector<QueryCookie> geometry_cookies;
+    for (Window child : children) {
+        geometry_cookies.push_back(backend->get_geometry(child));
+    }
+    for (size_t i = 0; i < children.size(); ++i) {
+        backend->set_border_width(children[i], border_width);
+        set_window_border(backend, children[i], false);
+        // Thay đổi vị trí của các cửa sổ có sẵn để không bị taskbar che
+        GeometryReply child_geometry;
+        if (backend->get_geometry_reply(geometry_cookies[i], child_geometry) && child_geometry.y < statusbar_height) {
+            backend->move_window(children[i], child_geometry.x, child_geometry.y + statusbar_height);
         }
-        XFree(children);
     }
 
     // Grab các phím tắt
-    KeyCode key_enter_keycode = XKeysymToKeycode(display, XK_Return);
+    key_enter_keycode = XKeysymToKeycode(display, XK_Return);
     XGrabKey(display, key_enter_keycode, Mod4Mask, root_window, True, GrabModeAsync, GrabModeAsync);
 
-    KeyCode key_d_keycode = XKeysymToKeycode(display, XK_d);
+    key_d_keycode = XKeysymToKeycode(display, XK_d);
     XGrabKey(display, key_d_keycode, Mod4Mask, root_window, True, GrabModeAsync, GrabModeAsync);
 
-    KeyCode key_e_keycode = XKeysymToKeycode(display, XK_e);
+    key_e_keycode = XKeysymToKeycode(display, XK_e);
     XGrabKey(display, key_e_keycode, Mod4Mask, root_window, True, GrabModeAsync, GrabModeAsync);
     
-    KeyCode key_q_keycode = XKeysymToKeycode(display, XK_q);
+    key_q_keycode = XKeysymToKeycode(display, XK_q);
     XGrabKey(display, key_q_keycode, Mod4Mask, root_window, True, GrabModeAsync, GrabModeAsync);
     XGrabKey(display, key_q_keycode, Mod4Mask | ShiftMask, root_window, True, GrabModeAsync, GrabModeAsync);
     
-    KeyCode key_m_keycode = XKeysymToKeycode(display, XK_m);
+    key_m_keycode = XKeysymToKeycode(display, XK_m);
     XGrabKey(display, key_m_keycode, Mod4Mask, root_window, True, GrabModeAsync, GrabModeAsync);
 
-    std::cout << "Grabbed keybindings: Super + Enter (Terminal), Super + D (dmenu), Super + E (Dolphin), Super + Q (Close), Super + Shift + Q (Kill), Super + M (Exit WM)." << std::endl;
+    key_space_keycode = XKeysymToKeycode(display, XK_space);
+    XGrabKey(display, key_space_keycode, Mod4Mask, root_window, True, GrabModeAsync, GrabModeAsync);
 
-    XEvent event;
+    XGrabButton(display, Button3, Mod4Mask, root_window, True, ButtonPressMask | ButtonReleaseMask | PointerMotionMask, GrabModeAsync, GrabModeAsync, None, None);
 
-    while (true) {
-        XNextEvent(display, &event);
+    for (KeySym keysym : { XK_h, XK_j, XK_k, XK_l }) {
+        KeyCode keycode = XKeysymToKeycode(display, keysym);
+        XGrabKey(display, keycode, Mod4Mask, root_window, True, GrabModeAsync, GrabModeAsync);
+        XGrabKey(display, keycode, Mod4Mask | ShiftMask, root_window, True, GrabModeAsync, GrabModeAsync);
+    }
+    key_h_keycode = XKeysymToKeycode(display, XK_h);
+    key_j_keycode = XKeysymToKeycode(display, XK_j);
+    key_k_keycode = XKeysymToKeycode(display, XK_k);
+    key_l_keycode = XKeysymToKeycode(display, XK_l);
 
-        switch (event.type) {
-            case CreateNotify:
-                XSelectInput(display, event.xcreatewindow.window, StructureNotifyMask | ExposureMask | KeyPressMask | ButtonPressMask | EnterWindowMask);
-                XSetWindowBorderWidth(display, event.xcreatewindow.window, border_width);
-                set_window_border(display, event.xcreatewindow.window, false);
-                break;
+    key_tab_keycode = XKeysymToKeycode(display, XK_Tab);
+    XGrabKey(display, key_tab_keycode, Mod1Mask, root_window, True, GrabModeAsync, GrabModeAsync);
+    XGrabKey(display, key_tab_keycode, Mod1Mask | ShiftMask, root_window, True, GrabModeAsync, GrabModeAsync);
+    key_alt_l_keycode = XKeysymToKeycode(display, XK_Alt_L);
+    key_alt_r_keycode = XKeysymToKeycode(display, XK_Alt_R);
 
-            case MapRequest:
-                if (std::find(managed_windows.begin(), managed_windows.end(), event.xmaprequest.window) == managed_windows.end()) {
-                    managed_windows.push_back(event.xmaprequest.window);
-                }
-                XMapWindow(display, event.xmaprequest.window);
-                tile_windows(display, root_window);
+    std::cout << "Grabbed keybindings: Super + Enter (Terminal), Super + D (dmenu), Super + E (Dolphin), Super + Q (Close), Super + Shift + Q (Kill), Super + Space (Toggle floating), Super + M (Exit WM), Super + Right drag (Resize), Super + H/J/K/L (Focus neighbour), Super + Shift + H/J/K/L (Swap), Alt + Tab (Switch windows)." << std::endl;
 
-                if (focused_window != None) {
-                    set_window_border(display, focused_window, false);
-                }
-                XSetInputFocus(display, event.xmaprequest.window, RevertToPointerRoot, CurrentTime);
-                set_window_border(display, event.xmaprequest.window, true);
-                focused_window = event.xmaprequest.window;
-                break;
+    setup_signals();
+    setup_watchdog();
+    setup_ipc(display);
+    setup_state_page();
 
-            case ConfigureRequest:
-                XWindowChanges changes;
-                changes.x = event.xconfigurerequest.x;
-                changes.y = event.xconfigurerequest.y;
-                changes.width = event.xconfigurerequest.width;
-                changes.height = event.xconfigurerequest.height;
-                changes.border_width = event.xconfigurerequest.border_width;
-                changes.sibling = event.xconfigurerequest.above;
-                changes.stack_mode = event.xconfigurerequest.detail;
-                XConfigureWindow(display, event.xconfigurerequest.window, event.xconfigurerequest.value_mask, &changes);
-                break;
-            
-            case DestroyNotify:
-                managed_windows.erase(std::remove(managed_windows.begin(), managed_windows.end(), event.xdestroywindow.window), managed_windows.end());
-                if(focused_window == event.xdestroywindow.window) {
-                    focused_window = None;
-                }
-                tile_windows(display, root_window);
-                break;
-            
-            case PropertyNotify:
-                if (event.xproperty.window == root_window && event.xproperty.atom == NET_WM_NAME) {
-                    draw_statusbar(display);
-                }
-                break;
-            
-            case Expose:
-                if (event.xexpose.window == statusbar_window) {
-                    draw_statusbar(display);
-                }
-                break;
+    XEvent event;
+    const int x_fd = ConnectionNumber(display);
 
-            case ButtonPress: {
-                if (event.xbutton.button == 1) {
-                    is_moving = true;
-                    current_moving_window = event.xbutton.subwindow;
-                    if (current_moving_window == None) {
-                        is_moving = false;
-                        break;
-                    }
-                    XWindowAttributes win_attrs;
-                    XGetWindowAttributes(display, current_moving_window, &win_attrs);
-                    start_win_x = win_attrs.x;
-                    start_win_y = win_attrs.y;
-                    start_x = event.xbutton.x_root;
-                    start_y = event.xbutton.y_root;
-                    XGrabPointer(display, root_window, False, ButtonPressMask | ButtonReleaseMask | PointerMotionMask,
-                                 GrabModeAsync, GrabModeAsync, root_window, None, CurrentTime);
-                }
-                break;
+    bool running = true;
+    while (running) {
+        // Xử lý hết các sự kiện X đang chờ trước khi ngủ trong poll(). refresh_properties chờ trả lời trên
+        // socket nên có thể kéo thêm sự kiện vào hàng đợi của Xlib, mà poll() thì không thấy chúng:
+        // lặp lại cho tới khi hàng đợi thật sự trống.
+        do {
+            while (running && backend->pending()) {
+                backend->next_event(&event);
+                running = dispatch_event(backend, root_window, event);
             }
+            if (!running) break;
+            refresh_properties(backend);
+        } while (backend->pending());
+        if (!running) break;
 
-            case MotionNotify: {
-                if (is_moving && current_moving_window != None) {
-                    int new_x = start_win_x + (event.xmotion.x_root - start_x);
-                    int new_y = start_win_y + (event.xmotion.y_root - start_y);
-                    XMoveWindow(display, current_moving_window, new_x, new_y);
-                }
-                break;
-            }
+        publish_state();
 
-            case ButtonRelease: {
-                is_moving = false;
-                current_moving_window = None;
-                XUngrabPointer(display, CurrentTime);
-                tile_windows(display, root_window);
-                break;
-            }
+        std::vector<pollfd> fds;
+        fds.push_back({x_fd, POLLIN, 0});
+        fds.push_back({signal_pipe[0], POLLIN, 0});
+        if (ipc_listen_fd >= 0) {
+            fds.push_back({ipc_listen_fd, POLLIN, 0});
+        }
+        for (auto& client : ipc_clients) {
+            // Thử gửi các sự kiện mới phát sinh trước khi chờ
+            ipc_flush_client(client);
+            bool pending = !client.out.empty() || client.ring_count > 0 || client.dropped > 0;
+            fds.push_back({client.fd, (short)(POLLIN | (pending ? POLLOUT : 0)), 0});
+        }
+        // Khi đang resize và còn kích thước chưa gửi, hoặc compositor còn vùng chưa vẽ, chỉ ngủ tới lúc được phép gửi
+        int timeout = resize_poll_timeout();
+        const int frame_timeout = composite_poll_timeout();
+        if (frame_timeout >= 0 && (timeout < 0 || frame_timeout < timeout)) timeout = frame_timeout;
+        if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) {
+            std::cerr << "Error: poll failed: " << strerror(errno) << std::endl;
+            break;
+        }
+        pump_resize(backend);
+        composite_frame(backend, root_window);
 
-            case EnterNotify: {
-                if (event.xcrossing.window != root_window && event.xcrossing.window != focused_window) {
-                    if (focused_window != None) {
-                        set_window_border(display, focused_window, false);
-                    }
-                    XSetInputFocus(display, event.xcrossing.window, RevertToPointerRoot, CurrentTime);
-                    set_window_border(display, event.xcrossing.window, true);
-                    focused_window = event.xcrossing.window;
+        if (fds[1].revents & POLLIN) {
+            char sig;
+            while (read(signal_pipe[0], &sig, 1) == 1) {
+                if (sig == SIGINT || sig == SIGTERM) {
+                    running = false;
+                } else if (sig == SIGUSR1) {
+                    std::cerr << format_metrics() << std::flush;
+                } else if (sig == SIGUSR2 && tracing_enabled) {
+                    write_chrome_trace("/tmp/nothingwm-trace-" + std::to_string(getpid()) + ".json");
                 }
-                break;
             }
+        }
 
-            case KeyPress:
-                if (event.xkey.keycode == key_enter_keycode && (event.xkey.state & Mod4Mask)) {
-                    execute_command({"konsole"});
-                } else if (event.xkey.keycode == key_d_keycode && (event.xkey.state & Mod4Mask)) {
-                    execute_command({"dmenu_run"});
-                } else if (event.xkey.keycode == key_e_keycode && (event.xkey.state & Mod4Mask)) {
-                    execute_command({"dolphin"});
-                } else if (event.xkey.keycode == key_q_keycode && (event.xkey.state & Mod4Mask) && !(event.xkey.state & ShiftMask)) {
-                    if (focused_window != None && focused_window != root_window) {
-                        close_window(display, focused_window);
-                    }
-                } else if (event.xkey.keycode == key_q_keycode && (event.xkey.state & Mod4Mask) && (event.xkey.state & ShiftMask)) {
-                    if (focused_window != None && focused_window != root_window) {
-                        XKillClient(display, focused_window);
-                    }
-                } else if (event.xkey.keycode == key_m_keycode && (event.xkey.state & Mod4Mask)) {
-                    XCloseDisplay(display);
-                    return 0;
-                }
-                break;
-            
-            default:
-                break;
+        size_t first_client = 2;
+        if (ipc_listen_fd >= 0) {
+            if (fds[2].revents & POLLIN) ipc_accept_clients();
+            first_client = 3;
+        }
+        for (size_t i = first_client; i < fds.size(); ++i) {
+            IpcClient& client = ipc_clients[i - first_client];
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) ipc_read_client(backend, client);
+            if (fds[i].revents & POLLOUT) ipc_flush_client(client);
         }
+        for (auto& client : ipc_clients) {
+            if (client.closed) close(client.fd);
+        }
+        ipc_clients.erase(std::remove_if(ipc_clients.begin(), ipc_clients.end(), [](const IpcClient& c) { return c.closed; }), ipc_clients.end());
+        backend->flush();
     }
 
+    shutdown_ipc();
+    stop_recording();
     XCloseDisplay(display);
-    return 0;
+    return (round_trip_strict && round_trip_budget_failed) ? 3 : 0;
 }
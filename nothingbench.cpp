@@ -0,0 +1,162 @@
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <unistd.h>
+#include <poll.h>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+
+// Benchmark "bão cửa sổ": tạo, map rồi hủy N cửa sổ trên một X server đang chạy WM,
+// đo độ trễ MapRequest -> MapNotify và hủy cửa sổ -> relayout (ConfigureNotify đầu tiên
+// trên một cửa sổ còn lại). Chạy được với mọi file .cpp trong repo, xem bench.sh.
+//
+//   DISPLAY=:9 ./nothingbench --windows 500 --rate 200
+
+uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Chờ sự kiện X tối đa timeout_ns; trả về false nếu hết giờ
+bool next_event(Display* display, XEvent& event, uint64_t timeout_ns) {
+    const uint64_t deadline = monotonic_ns() + timeout_ns;
+    while (!XPending(display)) {
+        uint64_t now = monotonic_ns();
+        if (now >= deadline) return false;
+        pollfd fd = { ConnectionNumber(display), POLLIN, 0 };
+        poll(&fd, 1, (int)((deadline - now) / 1000000) + 1);
+    }
+    XNextEvent(display, &event);
+    return true;
+}
+
+double percentile(const std::vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t index = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[index] / 1000.0;
+}
+
+// In percentile và histogram theo lũy thừa 2 (đơn vị micro giây)
+void report(const std::string& name, std::vector<uint64_t> samples, size_t expected) {
+    std::sort(samples.begin(), samples.end());
+    std::cout << name << ": " << samples.size() << "/" << expected << " samples" << std::endl;
+    if (samples.empty()) return;
+    std::cout << std::fixed << std::setprecision(1)
+              << "  p50 " << percentile(samples, 0.50) << " us"
+              << "  p99 " << percentile(samples, 0.99) << " us"
+              << "  p999 " << percentile(samples, 0.999) << " us"
+              << "  max " << samples.back() / 1000.0 << " us" << std::endl;
+
+    std::vector<size_t> buckets(40, 0);
+    for (uint64_t ns : samples) {
+        uint64_t us = ns / 1000;
+        int bucket = 0;
+        while (us > 1 && bucket < 39) {
+            us >>= 1;
+            ++bucket;
+        }
+        ++buckets[bucket];
+    }
+    for (int i = 0; i < 40; ++i) {
+        if (buckets[i] == 0) continue;
+        std::cout << "  <= " << std::setw(9) << (2ull << i) << " us " << std::setw(7) << buckets[i] << " "
+                  << std::string(std::max<size_t>(1, buckets[i] * 50 / samples.size()), '#') << std::endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    int num_windows = 200;
+    double rate = 0.0; // Cửa sổ mỗi giây, 0 = nhanh nhất có thể
+    uint64_t timeout_ns = 200 * 1000000ull;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--windows") == 0 && i + 1 < argc) {
+            num_windows = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--timeout-ms") == 0 && i + 1 < argc) {
+            timeout_ns = atoll(argv[++i]) * 1000000ull;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--windows N] [--rate windows/s] [--timeout-ms ms]" << std::endl;
+            return 2;
+        }
+    }
+
+    Display* display = XOpenDisplay(NULL);
+    if (display == NULL) {
+        std::cerr << "Could not connect to X server!" << std::endl;
+        return 1;
+    }
+    Window root_window = DefaultRootWindow(display);
+    unsigned long black = XBlackPixel(display, DefaultScreen(display));
+
+    // Giai đoạn 1: map với tốc độ cố định, không chờ từng cửa sổ, gom MapNotify khi chúng tới
+    std::vector<Window> windows;
+    std::unordered_map<Window, uint64_t> map_sent;
+    std::vector<uint64_t> map_latency;
+    XEvent event;
+    const uint64_t start_ns = monotonic_ns();
+    for (int i = 0; i < num_windows; ++i) {
+        if (rate > 0) {
+            uint64_t due = start_ns + (uint64_t)(i * 1e9 / rate);
+            while (monotonic_ns() < due) {
+                if (next_event(display, event, due - monotonic_ns()) && event.type == MapNotify && map_sent.count(event.xmap.window)) {
+                    map_latency.push_back(monotonic_ns() - map_sent[event.xmap.window]);
+                }
+            }
+        }
+        Window window = XCreateSimpleWindow(display, root_window, 0, 0, 100, 100, 0, black, black);
+        XSelectInput(display, window, StructureNotifyMask);
+        windows.push_back(window);
+        map_sent[window] = monotonic_ns();
+        XMapWindow(display, window);
+        XFlush(display);
+        while (XPending(display)) {
+            XNextEvent(display, &event);
+            if (event.type == MapNotify && map_sent.count(event.xmap.window)) {
+                map_latency.push_back(monotonic_ns() - map_sent[event.xmap.window]);
+            }
+        }
+    }
+    while ((int)map_latency.size() < num_windows && next_event(display, event, timeout_ns)) {
+        if (event.type == MapNotify && map_sent.count(event.xmap.window)) {
+            map_latency.push_back(monotonic_ns() - map_sent[event.xmap.window]);
+        }
+    }
+    const double map_seconds = (monotonic_ns() - start_ns) / 1e9;
+
+    // Giai đoạn 2: hủy từng cửa sổ một và đo thời gian tới khi WM sắp xếp lại các cửa sổ còn lại
+    std::vector<uint64_t> relayout_latency;
+    while (!windows.empty()) {
+        XSync(display, False);
+        while (XPending(display)) XNextEvent(display, &event);
+
+        Window victim = windows.back();
+        windows.pop_back();
+        const uint64_t sent = monotonic_ns();
+        XDestroyWindow(display, victim);
+        XFlush(display);
+        if (windows.empty()) break;
+
+        while (next_event(display, event, timeout_ns)) {
+            if (event.type == ConfigureNotify && event.xconfigure.window != victim) {
+                relayout_latency.push_back(monotonic_ns() - sent);
+                break;
+            }
+        }
+    }
+
+    std::cout << "Mapped " << num_windows << " windows in " << map_seconds << " s" << std::endl;
+    report("MapRequest -> MapNotify", map_latency, num_windows);
+    report("Destroy -> relayout", relayout_latency, num_windows > 0 ? num_windows - 1 : 0);
+
+    XCloseDisplay(display);
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cctype>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Công cụ dòng lệnh điều khiển nothing.cpp qua Unix socket.
+//
+//   nothingctl tree
+//   nothingctl focus 0x400007 \; layout monocle   (nhiều lệnh, áp dụng cùng lúc)
+//   nothingctl -                                  (đọc mỗi dòng một lệnh từ stdin)
+//
+//   nothingctl subscribe focus layout              (in ra sự kiện cho tới khi bị ngắt)
+//
+// Lệnh: focus <win>, close <win>, move <win> <index>, layout tile|monocle, spawn <cmd...>, tree, window_at <x> <y>,
+//       subscribe [window_added|window_removed|focus|layout ...]
+
+// Phải khớp với ipc_default_socket_path() trong nothing.cpp
+std::string socket_path() {
+    const char* env = getenv("NOTHINGWM_SOCKET");
+    if (env != nullptr && *env != '\0') {
+        return env;
+    }
+    const char* display = getenv("DISPLAY");
+    std::string name = display != nullptr ? display : "";
+    for (char& c : name) {
+        if (!isalnum((unsigned char)c)) c = '_';
+    }
+    return "/tmp/nothingwm-" + name + ".sock";
+}
+
+bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool read_all(int fd, char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = read(fd, data, size);
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool read_frame(int fd, std::string& payload) {
+    unsigned char header[4];
+    if (!read_all(fd, (char*)header, 4)) return false;
+    uint32_t len = header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24);
+    payload.assign(len, '\0');
+    return len == 0 || read_all(fd, &payload[0], len);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <command> [args...] [\\; <command> ...] | -" << std::endl;
+        return 2;
+    }
+
+    // Gộp các lệnh thành một gói, mỗi lệnh một dòng
+    std::string payload;
+    if (argc == 2 && strcmp(argv[1], "-") == 0) {
+        std::string line;
+        while (std::getline(std::cin, line)) {
+            payload += line + "\n";
+        }
+    } else {
+        std::string line;
+        for (int i = 1; i < argc; ++i) {
+            if (strcmp(argv[i], ";") == 0) {
+                payload += line + "\n";
+                line.clear();
+            } else {
+                if (!line.empty()) line += " ";
+                line += argv[i];
+            }
+        }
+        payload += line + "\n";
+    }
+
+    std::string path = socket_path();
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        std::cerr << "Could not connect to " << path << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    uint32_t len = payload.size();
+    char header[4] = { (char)(len & 0xff), (char)((len >> 8) & 0xff), (char)((len >> 16) & 0xff), (char)((len >> 24) & 0xff) };
+    if (!write_all(fd, header, 4) || !write_all(fd, payload.data(), payload.size())) {
+        std::cerr << "Error: Could not send command." << std::endl;
+        return 1;
+    }
+
+    std::string reply;
+    if (!read_frame(fd, reply)) {
+        std::cerr << "Error: No reply from window manager." << std::endl;
+        return 1;
+    }
+    std::cout << reply << std::flush;
+    if (reply.compare(0, 6, "error:") == 0) {
+        return 1;
+    }
+
+    // Sau lệnh subscribe, window manager tiếp tục đẩy mỗi sự kiện thành một gói
+    if (payload.compare(0, 9, "subscribe") == 0 || payload.find("\nsubscribe") != std::string::npos) {
+        std::string event;
+        while (read_frame(fd, event)) {
+            std::cout << event << std::flush;
+        }
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,162 @@
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unistd.h>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include "wmtrace.h"
+
+// Phát lại một file trace (ghi bằng `nothing --record`) lên một X server đang chạy WM bất kỳ,
+// ví dụ Xvfb + một trong các file .cpp của repo:
+//
+//   Xvfb :9 & DISPLAY=:9 ./fun &
+//   DISPLAY=:9 ./nothingreplay trace.bin --speed 0
+//
+// Một client tổng hợp tái tạo chuỗi create/map/configure/destroy/motion giống hệt trace.
+// --speed 1 giữ nguyên nhịp thời gian gốc, --speed 0 (mặc định) phát nhanh nhất có thể
+// để đo thông lượng xử lý sự kiện của WM.
+
+uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Chờ tới khi WM đã xử lý hết mọi yêu cầu trước đó: map một cửa sổ đánh dấu và đợi MapNotify.
+// WM xử lý MapRequest theo thứ tự, nên khi cửa sổ này hiện ra thì các sự kiện trước đã xong.
+void wait_for_wm(Display* display, Window root_window) {
+    Window marker = XCreateSimpleWindow(display, root_window, 0, 0, 1, 1, 0, 0, 0);
+    XSelectInput(display, marker, StructureNotifyMask);
+    XMapWindow(display, marker);
+    XEvent event;
+    do {
+        XWindowEvent(display, marker, StructureNotifyMask, &event);
+    } while (event.type != MapNotify);
+    XDestroyWindow(display, marker);
+    XSync(display, False);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <trace-file> [--speed <factor>]" << std::endl;
+        return 2;
+    }
+    double speed = 0.0;
+    for (int i = 2; i < argc; ++i) {
+        if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            speed = atof(argv[++i]);
+        }
+    }
+
+    FILE* file = fopen(argv[1], "rb");
+    if (file == nullptr) {
+        std::cerr << "Could not open trace file " << argv[1] << std::endl;
+        return 1;
+    }
+    WmTraceHeader header;
+    bool version1 = false;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.record_size != sizeof(WmTraceRecord)
+        || (memcmp(header.magic, WMTRACE_MAGIC, sizeof(header.magic)) != 0
+            && !(version1 = memcmp(header.magic, WMTRACE_MAGIC_V1, sizeof(header.magic)) == 0))) {
+        std::cerr << "Not a trace file: " << argv[1] << std::endl;
+        return 1;
+    }
+    std::vector<WmTraceRecord> records;
+    WmTraceRecord record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        records.push_back(record);
+    }
+    fclose(file);
+
+    Display* display = XOpenDisplay(NULL);
+    if (display == NULL) {
+        std::cerr << "Could not connect to X server!" << std::endl;
+        return 1;
+    }
+    Window root_window = DefaultRootWindow(display);
+    unsigned long black = XBlackPixel(display, DefaultScreen(display));
+
+    // Ánh xạ ID cửa sổ trong trace sang cửa sổ tổng hợp tạo ra khi phát lại
+    std::unordered_map<uint32_t, Window> windows;
+    size_t replayed = 0;
+    const uint64_t start_ns = monotonic_ns();
+
+    for (const auto& r : records) {
+        if (speed > 0.0) {
+            uint64_t due = start_ns + (uint64_t)(r.time_ns / speed);
+            uint64_t now = monotonic_ns();
+            if (due > now) {
+                XFlush(display);
+                usleep((due - now) / 1000);
+            }
+        }
+
+        auto it = windows.find(r.window);
+        switch (r.type) {
+            case CreateNotify:
+                if (it == windows.end()) {
+                    windows[r.window] = XCreateSimpleWindow(display, root_window, r.x, r.y,
+                                                            r.width ? r.width : 1, r.height ? r.height : 1, 0, black, black);
+                    ++replayed;
+                }
+                break;
+            case MapRequest:
+                if (it != windows.end()) {
+                    XMapWindow(display, it->second);
+                    ++replayed;
+                }
+                break;
+            case ConfigureRequest:
+                if (it != windows.end()) {
+                    // Chỉ gửi đúng các trường client đã xin đổi. Viền và cửa sổ sibling không được ghi lại,
+                    // nên stack mode được phát lại so với mọi cửa sổ anh em.
+                    XWindowChanges changes;
+                    changes.x = r.x;
+                    changes.y = r.y;
+                    changes.width = r.width ? r.width : 1;
+                    changes.height = r.height ? r.height : 1;
+                    changes.stack_mode = r.detail;
+                    unsigned int mask = version1 ? (CWX | CWY | CWWidth | CWHeight)
+                                                 : r.reserved & (CWX | CWY | CWWidth | CWHeight | CWStackMode);
+                    if (mask != 0) XConfigureWindow(display, it->second, mask, &changes);
+                    ++replayed;
+                }
+                break;
+            case DestroyNotify:
+                if (it != windows.end()) {
+                    XDestroyWindow(display, it->second);
+                    windows.erase(it);
+                    ++replayed;
+                }
+                break;
+            case MotionNotify:
+                XWarpPointer(display, None, root_window, 0, 0, 0, 0, r.x, r.y);
+                ++replayed;
+                break;
+            default:
+                // Phím và nút chuột cần extension XTest để tổng hợp, nên được bỏ qua
+                break;
+        }
+    }
+
+    const uint64_t sent_ns = monotonic_ns();
+    wait_for_wm(display, root_window);
+    const uint64_t done_ns = monotonic_ns();
+
+    double seconds = (done_ns - start_ns) / 1e9;
+    std::cout << "Replayed " << replayed << " of " << records.size() << " recorded events" << std::endl;
+    std::cout << "Send time:  " << (sent_ns - start_ns) / 1e6 << " ms" << std::endl;
+    std::cout << "Drain time: " << (done_ns - sent_ns) / 1e6 << " ms" << std::endl;
+    std::cout << "Throughput: " << (seconds > 0 ? replayed / seconds : 0) << " events/s" << std::endl;
+
+    for (const auto& entry : windows) {
+        XDestroyWindow(display, entry.second);
+    }
+    XCloseDisplay(display);
+    return 0;
+}
@@ -7,6 +7,8 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <cstring>
+#include <unordered_map>
+#include <algorithm>
 
 // Các biến toàn cục
 Atom WM_PROTOCOLS;
@@ -18,9 +20,23 @@ int start_win_x, start_win_y;
 Window current_moving_window = None;
 
 // Các biến để tự động đặt vị trí cửa sổ
-int last_x = 0;
-int last_y = 0;
-const int offset = 40; // Khoảng dịch chuyển của cửa sổ mới
+// Một hình chữ nhật trên màn hình, kể cả viền cửa sổ
+struct Rect {
+    int x, y, width, height;
+    int border = 0; // Độ dày viền của cửa sổ, để tính lại kích thước ngoài khi client chỉ đổi kích thước hoặc viền
+};
+
+// Vị trí của các cửa sổ đang hiện, và vị trí/kích thước mà cửa sổ chưa map tự chọn (CreateNotify, ConfigureRequest)
+std::unordered_map<Window, Rect> placed_windows;
+std::unordered_map<Window, Rect> requested_geometry;
+
+// Các vùng trống lớn nhất (maximal rectangles) còn lại trên màn hình. Đặt thêm cửa sổ chỉ cắt nhỏ các vùng
+// nó đè lên; cửa sổ bị di chuyển, đổi kích thước hoặc biến mất chỉ tính lại các vùng đi qua chỗ nó vừa bỏ trống.
+// Danh sách chỉ được dựng từ đầu một lần, ở lần đặt cửa sổ đầu tiên.
+std::vector<Rect> free_rects;
+bool free_rects_dirty = true;
+Rect free_rects_screen = {0, 0, 0, 0}; // Màn hình lúc dựng danh sách
+const int placement_cell = 16; // Kích thước ô lưới (pixel) khi tìm vị trí bị che ít nhất
 
 // Xử lý lỗi X
 int x_error_handler(Display* display, XErrorEvent* error) {
@@ -86,6 +102,182 @@ void close_window(Display* display, Window window) {
     }
 }
 
+bool rect_intersects(const Rect& a, const Rect& b) {
+    return a.x < b.x + b.width && b.x < a.x + a.width && a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+bool rect_contains(const Rect& outer, const Rect& inner) {
+    return inner.x >= outer.x && inner.y >= outer.y
+        && inner.x + inner.width <= outer.x + outer.width && inner.y + inner.height <= outer.y + outer.height;
+}
+
+// Cắt mỗi vùng trống mà used đè lên thành tối đa bốn vùng trống lớn nhất còn lại (trái, phải, trên, dưới).
+// Vùng cũ không bị cắt thì không thể nằm trong vùng mới, nên chỉ cần loại các vùng mới nằm gọn trong vùng khác.
+// Vùng mới nằm trong một vùng cũ thì vùng cũ đó phải chạm vào mép của used, nên chỉ so với các vùng cũ ấy.
+// Với near, các vùng không giao với near bị bỏ luôn (dùng khi chỉ cần các vùng đi qua near).
+void occupy_rect(const Rect& used, const Rect* near = nullptr) {
+    static std::vector<Rect> pieces;
+    static std::vector<size_t> touching;
+    pieces.clear();
+    touching.clear();
+    const Rect grown = {used.x - 1, used.y - 1, used.width + 2, used.height + 2};
+    size_t kept = 0;
+    for (size_t i = 0; i < free_rects.size(); ++i) {
+        const Rect r = free_rects[i];
+        if (!rect_intersects(r, used)) {
+            if (near != nullptr && !rect_intersects(r, *near)) continue;
+            if (rect_intersects(r, grown)) touching.push_back(kept);
+            free_rects[kept++] = r;
+            continue;
+        }
+        if (used.x > r.x) pieces.push_back({r.x, r.y, used.x - r.x, r.height});
+        if (used.x + used.width < r.x + r.width) pieces.push_back({used.x + used.width, r.y, r.x + r.width - used.x - used.width, r.height});
+        if (used.y > r.y) pieces.push_back({r.x, r.y, r.width, used.y - r.y});
+        if (used.y + used.height < r.y + r.height) pieces.push_back({r.x, used.y + used.height, r.width, r.y + r.height - used.y - used.height});
+    }
+    free_rects.resize(kept);
+    for (size_t i = 0; i < pieces.size(); ++i) {
+        bool redundant = near != nullptr && !rect_intersects(pieces[i], *near);
+        for (size_t j = 0; j < touching.size() && !redundant; ++j) {
+            redundant = rect_contains(free_rects[touching[j]], pieces[i]);
+        }
+        // Hai vùng mới trùng nhau thì chỉ giữ vùng đứng trước
+        for (size_t j = 0; j < pieces.size() && !redundant; ++j) {
+            redundant = j != i && rect_contains(pieces[j], pieces[i]) && (j < i || !rect_contains(pieces[i], pieces[j]));
+        }
+        if (!redundant) free_rects.push_back(pieces[i]);
+    }
+}
+
+// Vùng freed vừa được một cửa sổ bỏ trống (cửa sổ đó đã ra khỏi placed_windows). Các vùng trống lớn nhất mới
+// đều đi qua freed: cắt lại màn hình theo các cửa sổ đang hiện nhưng chỉ giữ các mảnh giao với freed, nên mỗi
+// bước chỉ làm việc với vài vùng quanh đó. Vùng cũ nằm gọn trong một vùng mới thì bị bỏ.
+void release_rect(const Rect& freed) {
+    if (free_rects_dirty) return;
+    std::vector<Rect> old_rects;
+    old_rects.swap(free_rects);
+    free_rects = { free_rects_screen };
+    for (const auto& entry : placed_windows) {
+        occupy_rect(entry.second, &freed);
+    }
+    const size_t fresh = free_rects.size();
+    for (const Rect& r : old_rects) {
+        bool redundant = false;
+        for (size_t j = 0; j < fresh && !redundant; ++j) {
+            redundant = rect_contains(free_rects[j], r);
+        }
+        if (!redundant) free_rects.push_back(r);
+    }
+}
+
+// Chọn vị trí cho một cửa sổ kích thước width x height (kể cả viền): góc trên trái của vùng trống lớn nhất
+// đủ chứa nó. Nếu không còn vùng nào đủ, quét các vị trí trên lưới placement_cell x placement_cell (bảng tổng
+// số cửa sổ trên mỗi ô) và chọn vị trí trong màn hình có ít cửa sổ đè lên các ô của nó nhất.
+void place_window(int width, int height, int screen_width, int screen_height, int& x, int& y) {
+    if (free_rects_dirty) {
+        // Cắt theo thứ tự từ trên xuống giữ danh sách vùng trống nhỏ trong lúc tính
+        std::vector<Rect> windows;
+        for (const auto& entry : placed_windows) {
+            windows.push_back(entry.second);
+        }
+        std::sort(windows.begin(), windows.end(), [](const Rect& a, const Rect& b) { return a.y != b.y ? a.y < b.y : a.x < b.x; });
+        free_rects_screen = {0, 0, screen_width, screen_height};
+        free_rects = { free_rects_screen };
+        for (const Rect& window : windows) {
+            occupy_rect(window);
+        }
+        free_rects_dirty = false;
+    }
+    const Rect* best = nullptr;
+    for (const Rect& r : free_rects) {
+        if (r.width < width || r.height < height) continue;
+        long area = (long)r.width * r.height, best_area = best != nullptr ? (long)best->width * best->height : -1;
+        if (area > best_area || (area == best_area && (r.y < best->y || (r.y == best->y && r.x < best->x)))) {
+            best = &r;
+        }
+    }
+    if (best != nullptr) {
+        x = best->x;
+        y = best->y;
+        return;
+    }
+
+    // Không còn vùng trống đủ lớn: đếm số cửa sổ đè lên từng ô placement_cell x placement_cell rồi cộng dồn
+    // thành bảng tổng (summed-area table), để độ che của mọi vị trí theo lưới được tính trong O(1)
+    const int cols = (screen_width + placement_cell - 1) / placement_cell;
+    const int rows = (screen_height + placement_cell - 1) / placement_cell;
+    const int stride = cols + 1;
+    std::vector<long> cells((rows + 1) * stride, 0);
+    for (const auto& entry : placed_windows) {
+        const Rect& p = entry.second;
+        int c0 = std::max(0, p.x / placement_cell), c1 = std::min(cols, (p.x + p.width + placement_cell - 1) / placement_cell);
+        int r0 = std::max(0, p.y / placement_cell), r1 = std::min(rows, (p.y + p.height + placement_cell - 1) / placement_cell);
+        if (c0 >= c1 || r0 >= r1) continue;
+        ++cells[r0 * stride + c0];
+        --cells[r0 * stride + c1];
+        --cells[r1 * stride + c0];
+        ++cells[r1 * stride + c1];
+    }
+    // Cộng dồn lần đầu: mảng hiệu thành số cửa sổ trên mỗi ô. Lần hai: thành bảng tổng, dời một hàng và một cột
+    // để sums[r][c] là tổng các ô phía trên bên trái (r, c)
+    for (int row = 0; row <= rows; ++row) {
+        for (int col = 0; col <= cols; ++col) {
+            if (row > 0) cells[row * stride + col] += cells[(row - 1) * stride + col];
+            if (col > 0) cells[row * stride + col] += cells[row * stride + col - 1];
+            if (row > 0 && col > 0) cells[row * stride + col] -= cells[(row - 1) * stride + col - 1];
+        }
+    }
+    std::vector<long> sums((rows + 1) * stride, 0);
+    for (int row = 1; row <= rows; ++row) {
+        for (int col = 1; col <= cols; ++col) {
+            sums[row * stride + col] = cells[(row - 1) * stride + col - 1] + sums[(row - 1) * stride + col]
+                                     + sums[row * stride + col - 1] - sums[(row - 1) * stride + col - 1];
+        }
+    }
+    // Các vị trí thử: mọi điểm lưới mà cửa sổ còn nằm trong màn hình, cộng thêm vị trí sát mép phải/dưới.
+    // Mỗi vị trí được chấm theo các ô nó thật sự đè lên, nên vị trí trả về đúng là vị trí đã được chấm.
+    auto candidates = [](int screen_size, int size) {
+        std::vector<int> positions;
+        const int last = std::max(0, screen_size - size);
+        for (int p = 0; p < last; p += placement_cell) positions.push_back(p);
+        positions.push_back(last);
+        return positions;
+    };
+    const std::vector<int> xs = candidates(screen_width, width), ys = candidates(screen_height, height);
+    long best_overlap = -1;
+    for (int cy : ys) {
+        const int r0 = cy / placement_cell, r1 = std::min(rows, (cy + height + placement_cell - 1) / placement_cell);
+        for (int cx : xs) {
+            const int c0 = cx / placement_cell, c1 = std::min(cols, (cx + width + placement_cell - 1) / placement_cell);
+            long overlap = sums[r1 * stride + c1] - sums[r0 * stride + c1] - sums[r1 * stride + c0] + sums[r0 * stride + c0];
+            if (best_overlap < 0 || overlap < best_overlap) {
+                best_overlap = overlap;
+                x = cx;
+                y = cy;
+            }
+        }
+    }
+}
+
+// Cửa sổ bị ẩn hoặc hủy: trả chỗ của nó lại cho các vùng trống
+void forget_placed_window(Window window) {
+    auto placed = placed_windows.find(window);
+    if (placed != placed_windows.end()) {
+        const Rect freed = placed->second;
+        placed_windows.erase(placed);
+        release_rect(freed);
+    }
+}
+
+// Ghi nhớ vị trí của một cửa sổ vừa được map, di chuyển hoặc đổi kích thước và trừ chỗ của nó khỏi các vùng trống
+void add_placed_window(Window window, const Rect& rect) {
+    forget_placed_window(window);
+    if (!free_rects_dirty) {
+        occupy_rect(rect);
+    }
+    placed_windows[window] = rect;
+}
+
 int main() {
     Display* display;
     Window root_window;
@@ -121,6 +313,24 @@ int main() {
     XUngrabServer(display);
     std::cout << "Became Window Manager (or attempted to)." << std::endl;
 
+    // Cửa sổ đang hiện từ trước khi WM chạy cũng chiếm chỗ: cửa sổ mới không được đặt đè lên chúng
+    Window root_return, parent_return;
+    Window* children = nullptr;
+    unsigned int num_children = 0;
+    if (XQueryTree(display, root_window, &root_return, &parent_return, &children, &num_children)) {
+        for (unsigned int i = 0; i < num_children; ++i) {
+            XWindowAttributes child_attributes;
+            if (XGetWindowAttributes(display, children[i], &child_attributes) && child_attributes.map_state == IsViewable
+                && !child_attributes.override_redirect) {
+                add_placed_window(children[i], { child_attributes.x, child_attributes.y,
+                                                 child_attributes.width + 2*child_attributes.border_width,
+                                                 child_attributes.height + 2*child_attributes.border_width,
+                                                 child_attributes.border_width });
+            }
+        }
+        if (children != nullptr) XFree(children);
+    }
+
     // Grab các phím tắt
     KeyCode key_enter_keycode = XKeysymToKeycode(display, XK_Return);
     XGrabKey(display, key_enter_keycode, Mod4Mask, root_window, True, GrabModeAsync, GrabModeAsync);
@@ -150,24 +360,37 @@ int main() {
             case CreateNotify:
                 std::cout << "CreateNotify event: New window created, ID: " << event.xcreatewindow.window << std::endl;
                 XSelectInput(display, event.xcreatewindow.window, StructureNotifyMask | ExposureMask | KeyPressMask | ButtonPressMask | EnterWindowMask);
+                // Cửa sổ override-redirect (menu, tooltip) không bao giờ gửi MapRequest
+                if (!event.xcreatewindow.override_redirect) {
+                    requested_geometry[event.xcreatewindow.window] = { event.xcreatewindow.x, event.xcreatewindow.y,
+                                                                       event.xcreatewindow.width + 2*event.xcreatewindow.border_width,
+                                                                       event.xcreatewindow.height + 2*event.xcreatewindow.border_width,
+                                                                       event.xcreatewindow.border_width };
+                }
                 break;
 
             case MapRequest:
                 std::cout << "MapRequest event: Application requests window display ID: " << event.xmaprequest.window << std::endl;
                 
-                // Logic tự động đặt vị trí cửa sổ
-                XWindowAttributes win_attrs;
-                XGetWindowAttributes(display, event.xmaprequest.window, &win_attrs);
-                XMoveWindow(display, event.xmaprequest.window, last_x, last_y);
-                
-                // Cập nhật vị trí cho cửa sổ tiếp theo
-                last_x += offset;
-                last_y += offset;
-
-                // Reset vị trí nếu nó ra ngoài màn hình
-                if (last_x > DefaultScreenOfDisplay(display)->width || last_y > DefaultScreenOfDisplay(display)->height) {
-                    last_x = 0;
-                    last_y = 0;
+                // Logic tự động đặt vị trí cửa sổ: cửa sổ đang hiện giữ nguyên chỗ, cửa sổ mới được đặt vào
+                // vùng trống lớn nhất với kích thước nó tự chọn lúc tạo
+                if (!placed_windows.count(event.xmaprequest.window)) {
+                    Rect rect;
+                    auto requested = requested_geometry.find(event.xmaprequest.window);
+                    if (requested != requested_geometry.end()) {
+                        rect = requested->second;
+                        requested_geometry.erase(requested);
+                    } else {
+                        // Cửa sổ có từ trước khi WM chạy, chưa có CreateNotify
+                        Window root;
+                        int x, y;
+                        unsigned int width, height, border, depth;
+                        XGetGeometry(display, event.xmaprequest.window, &root, &x, &y, &width, &height, &border, &depth);
+                        rect = { x, y, (int)(width + 2*border), (int)(height + 2*border), (int)border };
+                    }
+                    place_window(rect.width, rect.height, DefaultScreenOfDisplay(display)->width, DefaultScreenOfDisplay(display)->height, rect.x, rect.y);
+                    XMoveWindow(display, event.xmaprequest.window, rect.x, rect.y);
+                    add_placed_window(event.xmaprequest.window, rect);
                 }
                 
                 XMapWindow(display, event.xmaprequest.window);
@@ -185,10 +408,40 @@ int main() {
                 changes.stack_mode = event.xconfigurerequest.detail;
 
                 XConfigureWindow(display, event.xconfigurerequest.window, event.xconfigurerequest.value_mask, &changes);
+
+                // Cập nhật kích thước đã biết; với cửa sổ đang hiện thì các vùng trống quanh chỗ cũ và chỗ mới được tính lại
+                if (placed_windows.count(event.xconfigurerequest.window) || requested_geometry.count(event.xconfigurerequest.window)) {
+                    bool placed = placed_windows.count(event.xconfigurerequest.window) > 0;
+                    Rect rect = placed ? placed_windows[event.xconfigurerequest.window] : requested_geometry[event.xconfigurerequest.window];
+                    // Viền giữ nguyên nếu client không đổi nó; đổi viền mà không đổi kích thước vẫn làm thay đổi kích thước ngoài
+                    const int old_border = rect.border;
+                    if (event.xconfigurerequest.value_mask & CWBorderWidth) rect.border = event.xconfigurerequest.border_width;
+                    if (event.xconfigurerequest.value_mask & CWX) rect.x = event.xconfigurerequest.x;
+                    if (event.xconfigurerequest.value_mask & CWY) rect.y = event.xconfigurerequest.y;
+                    rect.width = (event.xconfigurerequest.value_mask & CWWidth) ? event.xconfigurerequest.width + 2*rect.border
+                                                                                 : rect.width + 2*(rect.border - old_border);
+                    rect.height = (event.xconfigurerequest.value_mask & CWHeight) ? event.xconfigurerequest.height + 2*rect.border
+                                                                                   : rect.height + 2*(rect.border - old_border);
+                    if (placed) {
+                        add_placed_window(event.xconfigurerequest.window, rect);
+                    } else {
+                        requested_geometry[event.xconfigurerequest.window] = rect;
+                    }
+                }
                 break;
 
             case DestroyNotify:
                 std::cout << "DestroyNotify event: Window destroyed, ID: " << event.xdestroywindow.window << std::endl;
+                requested_geometry.erase(event.xdestroywindow.window);
+                forget_placed_window(event.xdestroywindow.window);
+                break;
+
+            case UnmapNotify:
+                // Cửa sổ bị ẩn được đặt lại chỗ mới khi nó map lần sau, với kích thước nó đang có
+                if (placed_windows.count(event.xunmap.window)) {
+                    requested_geometry[event.xunmap.window] = placed_windows[event.xunmap.window];
+                    forget_placed_window(event.xunmap.window);
+                }
                 break;
 
             case ButtonPress: {
@@ -218,6 +471,13 @@ int main() {
                     int new_x = start_win_x + (event.xmotion.x_root - start_x);
                     int new_y = start_win_y + (event.xmotion.y_root - start_y);
                     XMoveWindow(display, current_moving_window, new_x, new_y);
+                    auto placed = placed_windows.find(current_moving_window);
+                    if (placed != placed_windows.end()) {
+                        Rect rect = placed->second;
+                        rect.x = new_x;
+                        rect.y = new_y;
+                        add_placed_window(current_moving_window, rect);
+                    }
                 }
                 break;
             }
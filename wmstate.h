@@ -0,0 +1,165 @@
+#ifndef WMSTATE_H
+#define WMSTATE_H
+
+// Trang trạng thái chỉ-đọc mà nothing.cpp công bố qua bộ nhớ chia sẻ (memfd).
+//
+// Chương trình bên ngoài (thanh trạng thái, agent giám sát) chỉ cần:
+//
+//   const WmStatePage* page = wmstate_open();
+//   WmStateSnapshot snap;
+//   if (page && wmstate_read(page, &snap)) { ... }
+//
+// wmstate_open() lấy file descriptor một lần qua socket IPC; sau đó mỗi lần
+// wmstate_read() chỉ là đọc bộ nhớ, không có syscall và không chạm tới X server.
+// Dữ liệu được bảo vệ bằng seqlock: WM tăng `seq` lên số lẻ trước khi ghi và
+// lên số chẵn sau khi ghi xong, người đọc thử lại nếu thấy `seq` lẻ hoặc bị thay đổi.
+
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+const uint32_t WMSTATE_MAGIC = 0x574d5354; // "WMST"
+const uint32_t WMSTATE_VERSION = 1;
+const int WMSTATE_MAX_CLIENTS = 256;
+const int WMSTATE_TITLE_LEN = 64;
+
+struct WmStateClient {
+    uint64_t window;
+    int32_t x, y;
+    uint32_t width, height;
+    uint32_t workspace;
+    uint32_t flags; // WMSTATE_FLAG_*
+    char title[WMSTATE_TITLE_LEN]; // UTF-8, luôn kết thúc bằng '\0'
+};
+
+const uint32_t WMSTATE_FLAG_FOCUSED = 1u << 0;
+const uint32_t WMSTATE_FLAG_FLOATING = 1u << 1; // Cửa sổ nổi (dialog, transient), không được tiling
+const uint32_t WMSTATE_FLAG_FULLSCREEN = 1u << 2; // _NET_WM_STATE_FULLSCREEN
+
+struct WmStatePage {
+    uint32_t magic;
+    uint32_t version;
+    std::atomic<uint32_t> seq;
+    uint32_t count;
+    uint64_t focused;
+    uint32_t layout; // 0 = tile, 1 = monocle
+    uint32_t reserved;
+    WmStateClient clients[WMSTATE_MAX_CLIENTS];
+};
+
+struct WmStateSnapshot {
+    uint32_t seq;
+    uint32_t count;
+    uint64_t focused;
+    uint32_t layout;
+    WmStateClient clients[WMSTATE_MAX_CLIENTS];
+};
+
+// Phía WM: bắt đầu và kết thúc một lần ghi
+inline void wmstate_write_begin(WmStatePage* page) {
+    page->seq.store(page->seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+inline void wmstate_write_end(WmStatePage* page) {
+    std::atomic_thread_fence(std::memory_order_release);
+    page->seq.store(page->seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+// Phía người đọc: chép một ảnh chụp nhất quán của trang trạng thái
+inline bool wmstate_read(const WmStatePage* page, WmStateSnapshot* out, int max_retries = 1000) {
+    if (page->magic != WMSTATE_MAGIC || page->version != WMSTATE_VERSION) return false;
+    for (int attempt = 0; attempt < max_retries; ++attempt) {
+        uint32_t before = page->seq.load(std::memory_order_acquire);
+        if (before & 1) continue;
+        uint32_t count = page->count;
+        if (count > (uint32_t)WMSTATE_MAX_CLIENTS) count = WMSTATE_MAX_CLIENTS;
+        out->count = count;
+        out->focused = page->focused;
+        out->layout = page->layout;
+        memcpy(out->clients, page->clients, count * sizeof(WmStateClient));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (page->seq.load(std::memory_order_relaxed) == before) {
+            out->seq = before;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Phải khớp với ipc_default_socket_path() trong nothing.cpp
+inline std::string wmstate_socket_path() {
+    const char* env = getenv("NOTHINGWM_SOCKET");
+    if (env != nullptr && *env != '\0') {
+        return env;
+    }
+    const char* display = getenv("DISPLAY");
+    std::string name = display != nullptr ? display : "";
+    for (char& c : name) {
+        if (!isalnum((unsigned char)c)) c = '_';
+    }
+    return "/tmp/nothingwm-" + name + ".sock";
+}
+
+// Gửi lệnh "state" qua socket IPC, nhận memfd (SCM_RIGHTS) và map nó ở chế độ chỉ đọc.
+// Trả về nullptr nếu không kết nối được.
+inline const WmStatePage* wmstate_open(const char* socket_path = nullptr) {
+    std::string path = socket_path != nullptr ? socket_path : wmstate_socket_path();
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return nullptr;
+    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return nullptr;
+    }
+    const char request[] = { 6, 0, 0, 0, 's', 't', 'a', 't', 'e', '\n' };
+    if (write(sock, request, sizeof(request)) != (ssize_t)sizeof(request)) {
+        close(sock);
+        return nullptr;
+    }
+
+    char reply[64];
+    iovec iov = { reply, sizeof(reply) };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    close(sock);
+    if (n <= 0) return nullptr;
+
+    int fd = -1;
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (fd < 0) return nullptr;
+
+    void* map = mmap(nullptr, sizeof(WmStatePage), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return nullptr;
+    return (const WmStatePage*)map;
+}
+
+inline void wmstate_close(const WmStatePage* page) {
+    if (page != nullptr) {
+        munmap((void*)page, sizeof(WmStatePage));
+    }
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef WMTRACE_H
+#define WMTRACE_H
+
+// Định dạng file trace nhị phân do `nothing --record <file>` ghi ra và nothingreplay đọc vào.
+//
+// File gồm một WmTraceHeader theo sau là các WmTraceRecord kích thước cố định 24 byte,
+// mỗi bản ghi là một XEvent mà WM nhận được, với thời điểm tính từ lúc bắt đầu ghi.
+// Ý nghĩa các trường phụ thuộc vào loại sự kiện:
+//
+//   CreateNotify                     window, x, y, width, height
+//   ConfigureRequest                 window, x, y, width, height, reserved = value_mask, detail = stack mode
+//   MapRequest, DestroyNotify, ...   window
+//   MotionNotify                     x, y (tọa độ root)
+//   ButtonPress, ButtonRelease       x, y (tọa độ root), detail = nút chuột
+//   KeyPress                         detail = keycode, width = state
+
+#include <cstdint>
+
+// Bản 2 thêm value_mask của ConfigureRequest; trace bản 1 không có nó (phát lại như đổi cả vị trí và kích thước)
+const char WMTRACE_MAGIC[8] = { 'W', 'M', 'T', 'R', 'A', 'C', 'E', '2' };
+const char WMTRACE_MAGIC_V1[8] = { 'W', 'M', 'T', 'R', 'A', 'C', 'E', '1' };
+
+struct WmTraceHeader {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+struct WmTraceRecord {
+    uint64_t time_ns;
+    uint32_t window;
+    uint8_t type;   // Loại XEvent (CreateNotify, MapRequest, ...)
+    uint8_t detail;
+    uint16_t reserved; // ConfigureRequest: value_mask
+    int16_t x, y;
+    uint16_t width, height;
+};
+
+static_assert(sizeof(WmTraceRecord) == 24, "WmTraceRecord must stay 24 bytes");
+
+#endif